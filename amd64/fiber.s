@@ -45,27 +45,27 @@
 # 后续编译出来的内容放在代码段【可执行】
 .text
 
+# 只保存SysV ABI要求被调用者保存的寄存器：rbx、rbp、r12~r15，以及MXCSR与x87控制字
+# 其余寄存器由调用ef_fiber_internal_swap的C代码自己保存，rflags也不需要保存（popfq很慢）
+# 协程栈上保存的现场，从stack_ptr开始：
+#   0: MXCSR（4字节）与x87控制字（2字节）
+#   8: r15, 16: r14, 24: r13, 32: r12, 40: rbx, 48: rbp, 56: 返回地址
 ef_fiber_internal_swap:
 # rdx: to_yield
 # to_yield标识保存在rax中，作为返回值返回
 mov %rdx,%rax
-# 保存一堆寄存器的值，保存现场，这个是保存在当前协程栈中
-push %rbx
+# 保存现场，这个是保存在当前协程栈中
 push %rbp
-push %rsi
-push %rdi
-push %r8
-push %r9
-push %r10
-push %r11
+push %rbx
 push %r12
 push %r13
 push %r14
 push %r15
-# 压入rflags寄存器的值，8个字节
-pushfq
+sub $8,%rsp
+stmxcsr (%rsp)
+fnstcw 4(%rsp)
 # rsi: &current->stack_ptr
-# 将当前协程的栈指针rsp存储到当前协程的stack_ptr处(为了之后将栈切换回来，切换回来之后，栈指针指向之前最后保存的r15寄存器的内容，然后会从popfq指令开始执行，因为执行切换栈的指令之后，rip是指向popfq指令的，之后正好从栈中弹出之前保存的一些寄存器)
+# 将当前协程的栈指针rsp存储到当前协程的stack_ptr处，切换回来时从_ef_fiber_restore开始恢复现场
 mov %rsp,(%rsi)
 # rdi: to->stack_ptr
 # 将要切换执行的协程的栈指针送到rsp中，完成栈切换
@@ -73,26 +73,28 @@ mov %rdi,%rsp
 _ef_fiber_restore:
 # 执行完切栈动作之后，后面执行的指令都是在需要被执行的协程栈中
 # 从需要被执行的协程栈中弹出一些值到寄存器，当前栈指针就是stack_ptr
-popfq
+ldmxcsr (%rsp)
+fldcw 4(%rsp)
+add $8,%rsp
 pop %r15
 pop %r14
+# r13: fiber_proc
 pop %r13
+# r12: param or fiber
 pop %r12
-pop %r11
-pop %r10
-pop %r9
-pop %r8
-# rdi: param or fiber
-pop %rdi
-# rsi: 0
-pop %rsi
-# rbp: stack_upper
-pop %rbp
 # rbx: 0
 pop %rbx
-# ret指令执行时，从栈中弹出8个字节到指令指针寄存rip，正好是fiber_proc的函数地址，之后开始执行fiber_proc函数，参数就是rdi中的param
+# rbp: stack_upper
+pop %rbp
+# ret指令执行时，从栈中弹出8个字节到指令指针寄存rip，第一次运行时是_ef_fiber_start
 ret
 
+# 协程第一次运行的入口，参数与入口函数不在被调用者保存的寄存器之外，需要从r12、r13中取出
+# 此时rsp指向_ef_fiber_exit，作为fiber_proc的返回地址
+_ef_fiber_start:
+mov %r12,%rdi
+jmp *%r13
+
 _ef_fiber_exit:
 pop %rdx
 mov $FIBER_STATUS_EXITED,%rcx
@@ -115,22 +117,22 @@ mov %rcx,-8(%rdi)
 # 即算出_ef_fiber_exit函数首条指令的地址传送到rax寄存器中
 lea _ef_fiber_exit(%rip),%rax
 mov %rax,-16(%rdi)
-mov %rsi,-24(%rdi)
+lea _ef_fiber_start(%rip),%rax
+mov %rax,-24(%rdi)
+# rbp
+mov %rdi,-32(%rdi)
 xor %rax,%rax
-mov %rax,-32(%rdi)
-mov %rdi,-40(%rdi)
-mov %rax,-48(%rdi)
-mov %rdx,-56(%rdi)
+# rbx
+mov %rax,-40(%rdi)
+# r12: param, r13: fiber_proc
+mov %rdx,-48(%rdi)
+mov %rsi,-56(%rdi)
+# r14, r15
 mov %rax,-64(%rdi)
 mov %rax,-72(%rdi)
-mov %rax,-80(%rdi)
-mov %rax,-88(%rdi)
-mov %rax,-96(%rdi)
-mov %rax,-104(%rdi)
-mov %rax,-112(%rdi)
-mov %rax,-120(%rdi)
-mov %rax,-128(%rdi)
+# 协程继承创建者的MXCSR与x87控制字
+stmxcsr -80(%rdi)
+fnstcw -76(%rdi)
 mov %rdi,%rax
-sub $128,%rax
+sub $80,%rax
 ret
-
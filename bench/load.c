@@ -0,0 +1,410 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// strcasestr
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../framework.h"
+#include "../timer.h"
+
+/*
+ * HTTP load generator, the clients are routines of ef_add_routine,
+ * usage: ef_bench [-c connections] [-t threads] [-d seconds] [-r rate]
+ *        [-k] [-s payload bytes] [-T timeout ms] [-U] [-h host] [-p port] [-u path]
+ *
+ * without -r each connection sends the next request once the response of
+ * the last one arrived (closed loop), with -r the requests are scheduled
+ * at the total rate, spread over the connections, and the latency counted
+ * from when the request should have been sent, so a stalled server is not
+ * hidden by the clients waiting for it (coordinated omission)
+ */
+
+#define BENCH_BUFFER_SIZE 16384
+
+typedef struct {
+    const char *host;
+    int port;
+    const char *path;
+    int connections;
+    int threads;
+    int seconds;
+    double rate;
+    int keepalive;
+    size_t payload;
+    int timeout;
+    int engine;
+} bench_conf_t;
+
+static bench_conf_t conf = {"127.0.0.1", 8082, "/", 16, 1, 10, 0, 0, 0, 2000, EF_ENGINE_POLL};
+
+ef_runtime_t efr = {0};
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static char *request;
+static size_t request_len;
+
+static long long started_at, finish_at, stopped_at;
+static int next_id, live;
+static unsigned long responses, bad_status, errors, timeouts, connects;
+
+// 所有连接共用一个直方图，ef_latency_record是原子的
+static ef_latency_hist_t latency;
+
+static void client_failed(void)
+{
+    if (errno == ETIMEDOUT) {
+        __atomic_add_fetch(&timeouts, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * read one response, the status in *status, *reusable cleared if the
+ * connection can not carry the next request, return -1 on error
+ */
+static int read_response(ef_routine_t *er, int fd, char *buf, int *status, int *reusable)
+{
+    size_t got = 0;
+    char *end = NULL;
+    long long length = -1;
+
+    while (end == NULL) {
+        if (got == BENCH_BUFFER_SIZE - 1) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        ssize_t r = ef_routine_read_timeout(er, fd, buf + got, BENCH_BUFFER_SIZE - 1 - got, conf.timeout);
+        if (r <= 0) {
+            if (r == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        got += r;
+        buf[got] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    *end = '\0';
+    end += 4;
+
+    if (strncmp(buf, "HTTP/1.", 7) != 0 || strlen(buf) < 12) {
+        errno = EPROTO;
+        return -1;
+    }
+    *status = atoi(buf + 9);
+
+    /*
+     * without Content-Length the body ends when the server closes
+     */
+    char *hdr = strcasestr(buf, "\r\nContent-Length:");
+    if (hdr) {
+        length = atoll(hdr + 17);
+    }
+    if (length < 0 || strcasestr(buf, "\r\nConnection: close") || (buf[7] == '0' && !strcasestr(buf, "\r\nConnection: keep-alive"))) {
+        *reusable = 0;
+    }
+
+    long long left = (length < 0) ? -1 : length - (long long)(got - (end - buf));
+    while (left != 0) {
+        ssize_t r = ef_routine_read_timeout(er, fd, buf, BENCH_BUFFER_SIZE, conf.timeout);
+        if (r == 0 && length < 0) {
+            break;
+        }
+        if (r <= 0) {
+            if (r == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        if (left > 0) {
+            left -= (r < left) ? r : left;
+        }
+    }
+    return 0;
+}
+
+static int send_request(ef_routine_t *er, int fd)
+{
+    size_t sent = 0;
+
+    while (sent < request_len) {
+        ssize_t w = ef_routine_write_timeout(er, fd, request + sent, request_len - sent, conf.timeout);
+        if (w < 0) {
+            return -1;
+        }
+        sent += w;
+    }
+    return 0;
+}
+
+static long client_proc(int fd, ef_routine_t *er)
+{
+    int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    long long interval, intended;
+    int sockfd = -1;
+    char *buf;
+
+    /*
+     * each thread started as many, only the connections asked for run
+     */
+    if (id >= conf.connections) {
+        return 0;
+    }
+
+    buf = (char *)malloc(BENCH_BUFFER_SIZE);
+
+    /*
+     * the schedules of the connections are staggered over one interval
+     */
+    interval = (conf.rate > 0) ? (long long)(1000000000.0 * conf.connections / conf.rate) : 0;
+    intended = started_at + interval * id / conf.connections;
+
+    while (buf && !er->poll_data.runtime_ptr->stopping) {
+        long long now = ef_timer_now(), begin;
+        int status = 0, reusable = conf.keepalive;
+
+        if (interval) {
+            if (intended >= finish_at) {
+                break;
+            }
+
+            /*
+             * the timers tick in milliseconds, less than one sent now
+             */
+            if (intended - now >= 1000000) {
+                ef_routine_sleep(er, (int)((intended - now) / 1000000));
+                now = ef_timer_now();
+            }
+        } else if (now >= finish_at) {
+            break;
+        }
+
+        /*
+         * a request sent late still counted from when it was due
+         */
+        begin = (interval && intended < now) ? intended : now;
+        intended += interval;
+
+        if (sockfd < 0) {
+            sockfd = socket(target.ss_family, SOCK_STREAM, 0);
+            if (sockfd < 0) {
+                client_failed();
+                break;
+            }
+            if (ef_routine_connect_timeout(er, sockfd, (const struct sockaddr *)&target, target_len, conf.timeout) < 0) {
+                client_failed();
+                goto next;
+            }
+            __atomic_add_fetch(&connects, 1, __ATOMIC_RELAXED);
+        }
+
+        if (send_request(er, sockfd) < 0 || read_response(er, sockfd, buf, &status, &reusable) < 0) {
+            client_failed();
+            goto next;
+        }
+        ef_latency_record(&latency, ef_timer_now() - begin);
+        __atomic_add_fetch(&responses, 1, __ATOMIC_RELAXED);
+        if (status < 200 || status > 399) {
+            __atomic_add_fetch(&bad_status, 1, __ATOMIC_RELAXED);
+        }
+        if (reusable) {
+            continue;
+        }
+
+    next:
+        ef_routine_close(er, sockfd);
+        sockfd = -1;
+
+        /*
+         * do not spin on a refused connection in the closed loop
+         */
+        if (!interval && status == 0) {
+            ef_routine_sleep(er, 1);
+        }
+    }
+
+    if (sockfd >= 0) {
+        ef_routine_close(er, sockfd);
+    }
+    free(buf);
+
+    /*
+     * the last one out stops the loops of all the threads
+     */
+    if (__atomic_sub_fetch(&live, 1, __ATOMIC_SEQ_CST) == 0) {
+        stopped_at = ef_timer_now();
+        efr.stopping = 1;
+    }
+    return 0;
+}
+
+static void signal_handler(int num)
+{
+    efr.stopping = 1;
+}
+
+static int build_request(void)
+{
+    char head[1024];
+    int len;
+
+    if (conf.payload) {
+        len = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n"
+            "Content-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n",
+            conf.path, conf.host, conf.port, conf.keepalive ? "keep-alive" : "close", conf.payload);
+    } else {
+        len = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n",
+            conf.path, conf.host, conf.port, conf.keepalive ? "keep-alive" : "close");
+    }
+    if (len < 0 || len >= sizeof(head)) {
+        return -1;
+    }
+    request_len = len + conf.payload;
+    request = (char *)malloc(request_len);
+    if (request == NULL) {
+        return -1;
+    }
+    memcpy(request, head, len);
+    memset(request + len, 'x', conf.payload);
+    return 0;
+}
+
+static int resolve_target(void)
+{
+    struct addrinfo hints = {0}, *res = NULL;
+    char port[16];
+
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", conf.port);
+    if (getaddrinfo(conf.host, port, &hints, &res) != 0 || res == NULL) {
+        return -1;
+    }
+    memcpy(&target, res->ai_addr, res->ai_addrlen);
+    target_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: ef_bench [-c connections] [-t threads] [-d seconds] [-r requests per second]\n"
+        "                [-k] [-s payload bytes] [-T timeout ms] [-U] [-h host] [-p port] [-u path]\n"
+        "  -r  constant rate over all connections (open loop), 0 waits for each response (closed loop)\n"
+        "  -k  keep the connections alive, or one connection per request\n"
+        "  -s  POST a body of the bytes instead of GET\n"
+        "  -U  use io_uring\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const double percents[] = {50, 75, 90, 99, 99.9, 99.99, 100};
+    int opt, per_thread;
+
+    while ((opt = getopt(argc, argv, "c:t:d:r:ks:T:Uh:p:u:")) != -1) {
+        switch (opt) {
+        case 'c': conf.connections = atoi(optarg); break;
+        case 't': conf.threads = atoi(optarg); break;
+        case 'd': conf.seconds = atoi(optarg); break;
+        case 'r': conf.rate = atof(optarg); break;
+        case 'k': conf.keepalive = 1; break;
+        case 's': conf.payload = (size_t)atol(optarg); break;
+        case 'T': conf.timeout = atoi(optarg); break;
+        case 'U': conf.engine = EF_ENGINE_URING; break;
+        case 'h': conf.host = optarg; break;
+        case 'p': conf.port = atoi(optarg); break;
+        case 'u': conf.path = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+    if (conf.connections <= 0 || conf.threads <= 0 || conf.seconds <= 0 || conf.rate < 0 || conf.timeout <= 0) {
+        usage();
+        return 1;
+    }
+    if (conf.threads > conf.connections) {
+        conf.threads = conf.connections;
+    }
+    if (resolve_target() < 0) {
+        fprintf(stderr, "can not resolve %s\n", conf.host);
+        return 1;
+    }
+    if (build_request() < 0) {
+        return 1;
+    }
+
+    /*
+     * every client routine of a thread alive all the time
+     */
+    per_thread = (conf.connections + conf.threads - 1) / conf.threads;
+    if (ef_init_engine(&efr, conf.engine, 64 * 1024, per_thread, per_thread, 1000 * 60, 16) < 0 ||
+        ef_init_threads(&efr, conf.threads, 0) < 0 ||
+        ef_add_routine(&efr, client_proc, per_thread, 0) < 0) {
+        fprintf(stderr, "init failed\n");
+        return 1;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    live = conf.connections;
+    started_at = ef_timer_now();
+    finish_at = started_at + conf.seconds * 1000000000LL;
+    if (ef_run_loop(&efr) < 0) {
+        fprintf(stderr, "loop failed\n");
+        return 1;
+    }
+    if (stopped_at == 0) {
+        stopped_at = ef_timer_now();
+    }
+
+    double elapsed = (stopped_at - started_at) / 1e9;
+    printf("%s:%d%s, %d connections on %d threads, %s, %s, %zu bytes payload, %.2fs\n",
+        conf.host, conf.port, conf.path, conf.connections, conf.threads,
+        conf.rate > 0 ? "open loop" : "closed loop", conf.keepalive ? "keep-alive" : "close per request",
+        conf.payload, elapsed);
+    if (conf.rate > 0) {
+        printf("target rate: %.2f/s\n", conf.rate);
+    }
+    printf("responses: %lu, %.2f/s, not 2xx/3xx: %lu, connects: %lu, errors: %lu, timeouts: %lu\n",
+        responses, responses / elapsed, bad_status, connects, errors, timeouts);
+    if (latency.count) {
+        printf("latency mean: %.1fus, max: %.1fus\n", (double)latency.sum / latency.count / 1000, latency.max / 1000.0);
+        printf("%10s %14s\n", "percentile", "latency(us)");
+        for (int i = 0; i < sizeof(percents) / sizeof(percents[0]); ++i) {
+            printf("%9g%% %14.1f\n", percents[i], ef_latency_percentile(&latency, percents[i]) / 1000.0);
+        }
+    }
+    free(request);
+    return (responses > 0) ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../coroutine.h"
+#include "../poll.h"
+
+/*
+ * ns per operation of the primitives under the event loop, printed as JSON,
+ * usage: ef_micro [iterations] [coroutines]
+ *
+ * iterations of the per-op benchmarks, coroutines the pool size of the
+ * create and shrink ones, run it before and after a runtime change and
+ * compare the numbers of the same machine
+ */
+
+#define MICRO_STACK_SIZE  (128 * 1024)
+#define MICRO_STACK_TOUCH (64 * 1024)
+#define MICRO_MAX_RESULTS 16
+
+typedef struct {
+    const char *name;
+    long iterations;
+    double ns_per_op;
+} micro_result_t;
+
+static ef_coroutine_pool_t pool;
+static micro_result_t results[MICRO_MAX_RESULTS];
+static int result_count;
+
+static long long now_nanosecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void micro_report(const char *name, long iterations, long long spent)
+{
+    if (result_count < MICRO_MAX_RESULTS && iterations > 0) {
+        results[result_count].name = name;
+        results[result_count].iterations = iterations;
+        results[result_count].ns_per_op = (double)spent / iterations;
+        ++result_count;
+    }
+}
+
+static long yield_proc(void *param)
+{
+    while (!*(volatile int *)param) {
+        ef_fiber_yield(&pool.fiber_sched, 0);
+    }
+    return 0;
+}
+
+static long exit_proc(void *param)
+{
+    return 0;
+}
+
+// 从栈顶向下每页写一次，超出已提交部分的每一页都经由SIGSEGV扩展
+static long touch_proc(void *param)
+{
+    volatile char area[MICRO_STACK_TOUCH];
+    for (long off = MICRO_STACK_TOUCH - 1; off >= 0; off -= 4096) {
+        area[off] = 1;
+    }
+    return area[0];
+}
+
+static int bench_switch(long iterations)
+{
+    int stop = 0;
+    ef_coroutine_t *co = ef_coroutine_create(&pool, sizeof(ef_coroutine_t), yield_proc, &stop);
+    long long start;
+
+    if (co == NULL) {
+        return -1;
+    }
+    for (long i = 0; i < iterations / 10; ++i) {
+        ef_fiber_resume(&pool.fiber_sched, &co->fiber, 0, NULL);
+    }
+    start = now_nanosecs();
+    for (long i = 0; i < iterations; ++i) {
+        ef_fiber_resume(&pool.fiber_sched, &co->fiber, 0, NULL);
+    }
+    micro_report("fiber_resume_yield", iterations, now_nanosecs() - start);
+
+    stop = 1;
+    ef_coroutine_resume(&pool, co, 0);
+    ef_coroutine_pool_shrink(&pool, 0, -1);
+    return 0;
+}
+
+/*
+ * create count coroutines with new stacks, run them to exit, create
+ * and run them again from free_list, then shrink the pool at count
+ */
+static int bench_pool(int count)
+{
+    ef_coroutine_t **cos = (ef_coroutine_t **)malloc(sizeof(ef_coroutine_t *) * count);
+    long long start;
+
+    if (cos == NULL) {
+        return -1;
+    }
+
+    start = now_nanosecs();
+    for (int i = 0; i < count; ++i) {
+        cos[i] = ef_coroutine_create(&pool, sizeof(ef_coroutine_t), exit_proc, NULL);
+        if (cos[i] == NULL) {
+            free(cos);
+            return -1;
+        }
+    }
+    micro_report("coroutine_create_mmap", count, now_nanosecs() - start);
+
+    /*
+     * the first run touches the committed stack page
+     */
+    start = now_nanosecs();
+    for (int i = 0; i < count; ++i) {
+        ef_coroutine_resume(&pool, cos[i], 0);
+    }
+    micro_report("coroutine_first_run", count, now_nanosecs() - start);
+
+    start = now_nanosecs();
+    for (int i = 0; i < count; ++i) {
+        cos[i] = ef_coroutine_create(&pool, sizeof(ef_coroutine_t), exit_proc, NULL);
+    }
+    micro_report("coroutine_create_free_list", count, now_nanosecs() - start);
+
+    start = now_nanosecs();
+    for (int i = 0; i < count; ++i) {
+        ef_coroutine_resume(&pool, cos[i], 0);
+    }
+    micro_report("coroutine_reused_run", count, now_nanosecs() - start);
+
+    start = now_nanosecs();
+    int freed = ef_coroutine_pool_shrink(&pool, 0, -count);
+    micro_report("coroutine_pool_shrink", freed, now_nanosecs() - start);
+
+    free(cos);
+    return (freed == count) ? 0 : -1;
+}
+
+/*
+ * a new stack touched page by page, all committed or growing by SIGSEGV,
+ * both take a page fault per page, the difference is the signal path
+ */
+static long long touch_once(size_t commit)
+{
+    long long start;
+    ef_coroutine_t *co;
+
+    if (ef_coroutine_pool_set_stack(&pool, commit, 4096, 0) < 0) {
+        return -1;
+    }
+    start = now_nanosecs();
+    co = ef_coroutine_create(&pool, sizeof(ef_coroutine_t), touch_proc, NULL);
+    if (co == NULL) {
+        return -1;
+    }
+    ef_coroutine_resume(&pool, co, 0);
+    ef_coroutine_pool_shrink(&pool, 0, -1);
+    return now_nanosecs() - start;
+}
+
+static int bench_stack(long iterations)
+{
+    long pages = MICRO_STACK_TOUCH / 4096;
+    long long committed = 0, grown = 0;
+
+    for (long i = 0; i < iterations; ++i) {
+        long long c = touch_once(MICRO_STACK_SIZE), g = touch_once(4096);
+        if (c < 0 || g < 0) {
+            return -1;
+        }
+        committed += c;
+        grown += g;
+    }
+    ef_coroutine_pool_set_stack(&pool, 4096, 4096, 0);
+    micro_report("stack_touch_committed_page", iterations * pages, committed);
+    micro_report("stack_touch_sigsegv_page", iterations * pages, grown);
+    micro_report("stack_sigsegv_growth", iterations * pages, grown > committed ? grown - committed : 0);
+    return 0;
+}
+
+/*
+ * the read end of a pipe with a byte in it, always readable
+ */
+static int bench_poll(long iterations)
+{
+    ef_poll_t *p = ef_create_poll(64);
+    ef_event_t evts[4];
+    long long associate = 0, wait = 0, dissociate = 0, t0, t1, t2, t3;
+    int fds[2], retval = -1;
+
+    if (p == NULL) {
+        return -1;
+    }
+    if (pipe(fds) < 0) {
+        p->free(p);
+        return -1;
+    }
+    if (write(fds[1], "x", 1) != 1) {
+        goto exit_bench;
+    }
+
+    for (long i = 0; i < iterations; ++i) {
+        t0 = now_nanosecs();
+        if (p->associate(p, fds[0], EF_POLLIN, &fds[0], 0) < 0) {
+            goto exit_bench;
+        }
+        t1 = now_nanosecs();
+        if (p->wait(p, evts, 4, 0) != 1) {
+            goto exit_bench;
+        }
+        t2 = now_nanosecs();
+        p->dissociate(p, fds[0], 0, 0);
+        t3 = now_nanosecs();
+        associate += t1 - t0;
+        wait += t2 - t1;
+        dissociate += t3 - t2;
+    }
+    micro_report("poll_associate", iterations, associate);
+    micro_report("poll_wait_ready", iterations, wait);
+    micro_report("poll_dissociate", iterations, dissociate);
+    retval = 0;
+
+exit_bench:
+    close(fds[0]);
+    close(fds[1]);
+    p->free(p);
+    return retval;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    int count = argc > 2 ? atoi(argv[2]) : 10000;
+    long long start;
+
+    if (iterations < 10 || count <= 0 ||
+        ef_coroutine_pool_init(&pool, MICRO_STACK_SIZE, 0, count) < 0) {
+        fprintf(stderr, "usage: ef_micro [iterations >= 10] [coroutines > 0]\n");
+        return 1;
+    }
+
+    /*
+     * the clock read itself, included once or twice in each number
+     */
+    start = now_nanosecs();
+    for (long i = 0; i < iterations; ++i) {
+        now_nanosecs();
+    }
+    micro_report("clock_gettime", iterations, now_nanosecs() - start);
+
+    if (bench_switch(iterations) < 0 || bench_pool(count) < 0 ||
+        bench_stack(iterations / 1000 + 1) < 0 || bench_poll(iterations / 10) < 0) {
+        fprintf(stderr, "benchmark failed\n");
+        return 1;
+    }
+
+    printf("{\n  \"stack_size\": %d,\n  \"coroutines\": %d,\n  \"benchmarks\": [\n", MICRO_STACK_SIZE, count);
+    for (int i = 0; i < result_count; ++i) {
+        printf("    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.2f}%s\n", results[i].name,
+            results[i].iterations, results[i].ns_per_op, (i + 1 < result_count) ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
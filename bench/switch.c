@@ -0,0 +1,106 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fenv.h>
+#include "../fiber.h"
+
+/*
+ * ns per resume/yield pair of ef_fiber_internal_swap, usage: ef_switch [pairs]
+ */
+
+static ef_fiber_sched_t sched;
+
+static long long now_nanosecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long yield_proc(void *param)
+{
+    while (1) {
+        ef_fiber_yield(&sched, 0);
+    }
+    return 0;
+}
+
+// 在协程中修改浮点舍入方式，切换回来之后不能影响调用方
+static long round_proc(void *param)
+{
+    fesetround(FE_UPWARD);
+    ef_fiber_yield(&sched, fegetround() == FE_UPWARD);
+    return fegetround() == FE_UPWARD;
+}
+
+int main(int argc, char *argv[])
+{
+    long pairs = argc > 1 ? atol(argv[1]) : 10000000;
+    long retval = 0;
+    long long start, spent;
+    ef_fiber_t *fiber;
+
+    if (pairs <= 0 || ef_fiber_init_sched(&sched, 0) < 0) {
+        return -1;
+    }
+
+    /*
+     * the FP control state is callee-saved, each side keeps its own
+     */
+    fiber = ef_fiber_create(&sched, 64 * 1024, sizeof(ef_fiber_t), round_proc, NULL);
+    if (!fiber) {
+        return -1;
+    }
+    ef_fiber_resume(&sched, fiber, 0, &retval);
+    if (!retval || fegetround() != FE_TONEAREST) {
+        fprintf(stderr, "fp control state not preserved on yield\n");
+        return 1;
+    }
+    ef_fiber_resume(&sched, fiber, 0, &retval);
+    if (!retval || fegetround() != FE_TONEAREST) {
+        fprintf(stderr, "fp control state not preserved on resume\n");
+        return 1;
+    }
+    ef_fiber_delete(fiber);
+
+    fiber = ef_fiber_create(&sched, 64 * 1024, sizeof(ef_fiber_t), yield_proc, NULL);
+    if (!fiber) {
+        return -1;
+    }
+
+    /*
+     * warm up, then measure
+     */
+    for (long i = 0; i < pairs / 10; ++i) {
+        ef_fiber_resume(&sched, fiber, 0, NULL);
+    }
+    start = now_nanosecs();
+    for (long i = 0; i < pairs; ++i) {
+        ef_fiber_resume(&sched, fiber, 0, NULL);
+    }
+    spent = now_nanosecs() - start;
+
+    printf("resume/yield pairs: %ld, ns per pair: %.2f\n", pairs, (double)spent / pairs);
+    ef_fiber_delete(fiber);
+    return 0;
+}
@@ -18,6 +18,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <stdlib.h>
 #include "coroutine.h"
 #include "util/util.h"
 
@@ -38,6 +39,83 @@ int ef_coroutine_pool_init(ef_coroutine_pool_t *pool, size_t stack_size, int lim
     pool->full_count = 0;
     pool->free_count = 0;
     pool->run_count = 0;
+    pool->reuse_count = 0;
+    pool->map_count = 0;
+    pool->unmap_count = 0;
+    pool->resume_count = 0;
+    pool->shared_stacks = NULL;
+    pool->shared_count = 0;
+    pool->shared_next = 0;
+    ef_list_init(&pool->shared_free_list);
+    pool->shared_free_count = 0;
+    ef_list_init(&pool->released_list);
+    pool->released_count = 0;
+    pool->release_advice = 0;
+    pool->release_now = 0;
+    return 0;
+}
+
+int ef_coroutine_pool_share(ef_coroutine_pool_t *pool, int count)
+{
+    int idx;
+
+    if (pool->shared_stacks || count <= 0) {
+        return -1;
+    }
+
+    pool->shared_stacks = (ef_fiber_stack_t *)calloc(count, sizeof(ef_fiber_stack_t));
+    if (!pool->shared_stacks) {
+        return -1;
+    }
+    for (idx = 0; idx < count; ++idx) {
+        if (ef_fiber_stack_init(&pool->shared_stacks[idx], pool->stack_size) < 0) {
+            pool->shared_count = idx;
+            ef_coroutine_pool_unshare(pool);
+            return -1;
+        }
+    }
+    pool->shared_count = count;
+    pool->shared_next = 0;
+    return 0;
+}
+
+void ef_coroutine_pool_unshare(ef_coroutine_pool_t *pool)
+{
+    for (int idx = 0; idx < pool->shared_count; ++idx) {
+        ef_fiber_stack_free(&pool->shared_stacks[idx]);
+    }
+    free(pool->shared_stacks);
+    pool->shared_stacks = NULL;
+    pool->shared_count = 0;
+}
+
+int ef_coroutine_pool_set_stack(ef_coroutine_pool_t *pool, size_t commit, size_t grow, int flags)
+{
+    return ef_fiber_set_stack_policy(&pool->fiber_sched, commit, grow, flags);
+}
+
+/*
+ * free the oldest pooled coroutine in list, to make room for one of
+ * the other kind at limit_max, count is the length of list if kept
+ */
+static int ef_coroutine_evict(ef_coroutine_pool_t *pool, ef_list_entry_t *list, int *count)
+{
+    ef_list_entry_t *ent = ef_list_entry_before(list);
+    ef_coroutine_t *co;
+
+    if (ent == list) {
+        return -1;
+    }
+    co = CAST_PARENT_PTR(ent, ef_coroutine_t, free_entry);
+    --pool->free_count;
+    --pool->full_count;
+    if (count) {
+        --*count;
+    }
+    ef_list_remove(&co->free_entry);
+    ef_list_remove(&co->full_entry);
+    ef_fiber_delete(&co->fiber);
+    ++pool->unmap_count;
     return 0;
 }
 
@@ -48,14 +126,25 @@ ef_coroutine_t *ef_coroutine_create(ef_coroutine_pool_t *pool, size_t header_siz
     /*
      * try take one from the free_list
      */
-    if (pool->free_count > 0) {
+    if (pool->free_count > pool->shared_free_count) {
+        ef_list_entry_t *ent = ef_list_remove_after(&pool->free_list);
+        if (!ent) {
+            // 栈内存页已归还的协程，再次使用时重新缺页
+            ent = ef_list_remove_after(&pool->released_list);
+            --pool->released_count;
+        }
         --pool->free_count;
-        co = CAST_PARENT_PTR(ef_list_remove_after(&pool->free_list), ef_coroutine_t, free_entry);
+        co = CAST_PARENT_PTR(ent, ef_coroutine_t, free_entry);
         ef_fiber_init(&co->fiber, fiber_proc, param);
+        ++pool->reuse_count;
         return co;
     }
 
-    if (pool->full_count >= pool->limit_max) {
+    /*
+     * the pooled ones may all be on the shared stacks
+     */
+    if (pool->full_count >= pool->limit_max &&
+        ef_coroutine_evict(pool, &pool->shared_free_list, &pool->shared_free_count) < 0) {
         return NULL;
     }
 
@@ -68,8 +157,56 @@ ef_coroutine_t *ef_coroutine_create(ef_coroutine_pool_t *pool, size_t header_siz
     }
 
     co->run_count = 0;
+    co->pool = pool;
+
+    ++pool->full_count;
+    ++pool->map_count;
+    ef_list_insert_after(&pool->full_list, &co->full_entry);
+    return co;
+}
+
+ef_coroutine_t *ef_coroutine_create_shared(ef_coroutine_pool_t *pool, size_t header_size, ef_coroutine_proc_t fiber_proc, void *param)
+{
+    ef_coroutine_t *co;
+    ef_fiber_stack_t *stack;
+
+    if (pool->shared_count <= 0) {
+        return NULL;
+    }
+
+    /*
+     * try take one from the shared_free_list, it keeps its stack
+     */
+    if (pool->shared_free_count > 0) {
+        --pool->shared_free_count;
+        --pool->free_count;
+        co = CAST_PARENT_PTR(ef_list_remove_after(&pool->shared_free_list), ef_coroutine_t, free_entry);
+        ef_fiber_init(&co->fiber, fiber_proc, param);
+        ++pool->reuse_count;
+        return co;
+    }
+
+    if (pool->full_count >= pool->limit_max &&
+        ef_coroutine_evict(pool, &pool->free_list, NULL) < 0 &&
+        ef_coroutine_evict(pool, &pool->released_list, &pool->released_count) < 0) {
+        return NULL;
+    }
+
+    /*
+     * spread the coroutines over the shared stacks
+     */
+    stack = &pool->shared_stacks[pool->shared_next];
+    pool->shared_next = (pool->shared_next + 1) % pool->shared_count;
+    co = (ef_coroutine_t *)ef_fiber_create_shared(&pool->fiber_sched, stack, header_size, fiber_proc, param);
+    if (!co) {
+        return NULL;
+    }
+
+    co->run_count = 0;
+    co->pool = pool;
 
     ++pool->full_count;
+    ++pool->map_count;
     ef_list_insert_after(&pool->full_list, &co->full_entry);
     return co;
 }
@@ -80,25 +217,91 @@ long ef_coroutine_resume(ef_coroutine_pool_t *pool, ef_coroutine_t *co, long to_
     long retval = 0;
 
     // 切换到co协程执行
+    ++pool->resume_count;
     int res = ef_fiber_resume(&pool->fiber_sched, &co->fiber, to_yield, &retval);
     if (res < 0) {
         return retval;
     }
 
     /*
-     * add to free_list when exited
+     * add to free_list when exited, a coroutine of other pool
+     * (migrated from other thread) is released by its owner
      */
-    if (ef_fiber_is_exited(&co->fiber)) {
-        ++co->run_count;
-        gettimeofday(&co->last_run_time, NULL);
-        ef_list_insert_after(&pool->free_list, &co->free_entry);
-        ++pool->free_count;
-        ++pool->run_count;
+    if (ef_fiber_is_exited(&co->fiber) && co->pool == pool) {
+        ef_coroutine_release(pool, co);
     }
 
     return retval;
 }
 
+void ef_coroutine_release(ef_coroutine_pool_t *pool, ef_coroutine_t *co)
+{
+    ++co->run_count;
+    gettimeofday(&co->last_run_time, NULL);
+    if (pool->fiber_sched.stack_flags & EF_FIBER_TRACK) {
+        ef_fiber_stack_clear(&co->fiber);
+    }
+    if (co->fiber.shared) {
+        ef_list_insert_after(&pool->shared_free_list, &co->free_entry);
+        ++pool->shared_free_count;
+    } else if (pool->release_now && ef_fiber_stack_release(&co->fiber, pool->release_advice) >= 0) {
+        ef_list_insert_after(&pool->released_list, &co->free_entry);
+        ++pool->released_count;
+    } else {
+        ef_list_insert_after(&pool->free_list, &co->free_entry);
+    }
+    ++pool->free_count;
+    ++pool->run_count;
+}
+
+/*
+ * whether the coroutine has been in the free list for idle_millisecs
+ */
+static int ef_coroutine_idle(ef_coroutine_t *co, struct timeval *tv, int idle_millisecs)
+{
+    return ((tv->tv_sec - co->last_run_time.tv_sec) * 1000 > idle_millisecs) ||
+        (((tv->tv_sec - co->last_run_time.tv_sec) * 1000 == idle_millisecs) && tv->tv_usec - co->last_run_time.tv_usec >= idle_millisecs % 1000);
+}
+
+void ef_coroutine_pool_set_release(ef_coroutine_pool_t *pool, int advice, int now)
+{
+    pool->release_advice = advice ? advice : MADV_DONTNEED;
+    pool->release_now = now;
+}
+
+int ef_coroutine_pool_release(ef_coroutine_pool_t *pool, int idle_millisecs, int max_count)
+{
+    int release_count = 0;
+    struct timeval tv = {0};
+    ef_list_entry_t *list_tail;
+
+    if (pool->release_advice == 0 || pool->free_count - pool->shared_free_count - pool->released_count <= 0) {
+        return 0;
+    }
+
+    gettimeofday(&tv, NULL);
+
+    /*
+     * the oldest at the tail, each moved to the head of released_list keeps the order
+     */
+    list_tail = ef_list_entry_before(&pool->free_list);
+    while (list_tail != &pool->free_list && (max_count <= 0 || release_count < max_count)) {
+
+        ef_coroutine_t *co = CAST_PARENT_PTR(list_tail, ef_coroutine_t, free_entry);
+        list_tail = ef_list_entry_before(list_tail);
+
+        if (!ef_coroutine_idle(co, &tv, idle_millisecs) ||
+            ef_fiber_stack_release(&co->fiber, pool->release_advice) < 0) {
+            break;
+        }
+        ef_list_remove(&co->free_entry);
+        ef_list_insert_after(&pool->released_list, &co->free_entry);
+        ++pool->released_count;
+        ++release_count;
+    }
+    return release_count;
+}
+
 int ef_coroutine_pool_shrink(ef_coroutine_pool_t *pool, int idle_millisecs, int max_count)
 {
     int beyond_min, free_count = 0;
@@ -123,24 +326,34 @@ int ef_coroutine_pool_shrink(ef_coroutine_pool_t *pool, int idle_millisecs, int
     gettimeofday(&tv, NULL);
 
     /*
-     * free at most max_count fibers from free_list
+     * free at most max_count fibers from released_list, which are the oldest,
+     * then free_list, then shared_free_list
      */
-    list_tail = ef_list_entry_before(&pool->free_list);
-    while (list_tail != &pool->free_list && max_count--) {
+    ef_list_entry_t *lists[3] = {&pool->released_list, &pool->free_list, &pool->shared_free_list};
+    int *counts[3] = {&pool->released_count, NULL, &pool->shared_free_count};
+    for (int idx = 0; idx < 3; ++idx) {
+        ef_list_entry_t *list = lists[idx];
+        list_tail = ef_list_entry_before(list);
+        while (list_tail != list && max_count > 0) {
 
-        ef_coroutine_t *co = CAST_PARENT_PTR(list_tail, ef_coroutine_t, free_entry);
-        list_tail = ef_list_entry_before(list_tail);
+            ef_coroutine_t *co = CAST_PARENT_PTR(list_tail, ef_coroutine_t, free_entry);
+            list_tail = ef_list_entry_before(list_tail);
 
-        if (((tv.tv_sec - co->last_run_time.tv_sec) * 1000 > idle_millisecs) ||
-            (((tv.tv_sec - co->last_run_time.tv_sec) * 1000 == idle_millisecs) && tv.tv_usec - co->last_run_time.tv_usec >= idle_millisecs % 1000)) {
-            --pool->free_count;
-            --pool->full_count;
-            ef_list_remove(&co->free_entry);
-            ef_list_remove(&co->full_entry);
-            ++free_count;
-            ef_fiber_delete(&co->fiber);
-        } else {
-            break;
+            if (ef_coroutine_idle(co, &tv, idle_millisecs)) {
+                --pool->free_count;
+                --pool->full_count;
+                if (counts[idx]) {
+                    --*counts[idx];
+                }
+                ef_list_remove(&co->free_entry);
+                ef_list_remove(&co->full_entry);
+                ++free_count;
+                --max_count;
+                ef_fiber_delete(&co->fiber);
+                ++pool->unmap_count;
+            } else {
+                break;
+            }
         }
     }
     return free_count;
@@ -55,6 +55,11 @@ typedef struct _ef_coroutine {
      * run count of the coroutine
      */
     unsigned int run_count;
+
+    /*
+     * the pool owns the coroutine, it may be resumed by other pools
+     */
+    struct _ef_coroutine_pool *pool;
 } ef_coroutine_t;
 
 typedef struct _ef_coroutine_pool {
@@ -108,6 +113,46 @@ typedef struct _ef_coroutine_pool {
      */
     // 运行的协程数量
     unsigned long run_count;
+
+    /*
+     * the coroutines taken from the free lists, the ones created with
+     * a new stack, the ones freed by shrink or to make room, and the
+     * times coroutines resumed, each a switch in and one back out
+     */
+    unsigned long reuse_count;
+    unsigned long map_count;
+    unsigned long unmap_count;
+    unsigned long resume_count;
+
+    /*
+     * the shared stacks, new coroutines of ef_coroutine_create_shared
+     * bound to them in turn
+     */
+    // 共享栈，以及下一个新建协程使用的共享栈
+    ef_fiber_stack_t *shared_stacks;
+    int shared_count;
+    int shared_next;
+
+    /*
+     * the chain of exited coroutines on shared stacks, counted in free_count too
+     */
+    ef_list_entry_t shared_free_list;
+    int shared_free_count;
+
+    /*
+     * the chain of exited coroutines whose stack pages given back, counted
+     * in free_count too, reused after the ones in free_list
+     */
+    // 已归还栈内存页的空闲协程
+    ef_list_entry_t released_list;
+    int released_count;
+
+    /*
+     * madvise advice to give back the stack pages, release_now set
+     * gives them back as soon as the coroutine exited
+     */
+    int release_advice;
+    int release_now;
 } ef_coroutine_pool_t;
 
 typedef ef_fiber_proc_t ef_coroutine_proc_t;
@@ -117,16 +162,59 @@ typedef ef_fiber_proc_t ef_coroutine_proc_t;
  */
 int ef_coroutine_pool_init(ef_coroutine_pool_t *pool, size_t stack_size, int limit_min, int limit_max);
 
+/*
+ * set the stack commit policy of the coroutines created in the pool afterwards,
+ * see ef_fiber_set_stack_policy, the ones in free_list keep their stacks
+ */
+int ef_coroutine_pool_set_stack(ef_coroutine_pool_t *pool, size_t commit, size_t grow, int flags);
+
 /*
  * create a coroutine in the pool and init it, may take one from free_list
  */
 ef_coroutine_t *ef_coroutine_create(ef_coroutine_pool_t *pool, size_t header_size, ef_coroutine_proc_t fiber_proc, void *param);
 
+/*
+ * map count shared stacks of stack_size for ef_coroutine_create_shared
+ */
+int ef_coroutine_pool_share(ef_coroutine_pool_t *pool, int count);
+
+/*
+ * unmap the shared stacks, after all the coroutines on them deleted
+ */
+void ef_coroutine_pool_unshare(ef_coroutine_pool_t *pool);
+
+/*
+ * the same as ef_coroutine_create, but the coroutine runs on one of the shared
+ * stacks, only its header and the used part of its stack on yield take memory,
+ * it must be resumed by the thread of the pool, never by another coroutine on
+ * the same stack, NULL if the pool has no shared stack
+ */
+ef_coroutine_t *ef_coroutine_create_shared(ef_coroutine_pool_t *pool, size_t header_size, ef_coroutine_proc_t fiber_proc, void *param);
+
 /*
  * resume or first run the coroutine in the pool
  */
 long ef_coroutine_resume(ef_coroutine_pool_t *pool, ef_coroutine_t *co, long to_yield);
 
+/*
+ * put the exited coroutine back to the free_list of its pool
+ */
+void ef_coroutine_release(ef_coroutine_pool_t *pool, ef_coroutine_t *co);
+
+/*
+ * give back the stack pages of the exited coroutines by madvise with advice,
+ * MADV_DONTNEED or MADV_FREE, now set does it as soon as a coroutine exited,
+ * otherwise when ef_coroutine_pool_release called, the coroutines stay
+ * in the pool, private stacks only, the ones on shared stacks not affected
+ */
+void ef_coroutine_pool_set_release(ef_coroutine_pool_t *pool, int advice, int now);
+
+/*
+ * give back the stack pages of at most max_count (all if <= 0) coroutines
+ * in free_list whose idle time exceed idle_millisecs, return the number
+ */
+int ef_coroutine_pool_release(ef_coroutine_pool_t *pool, int idle_millisecs, int max_count);
+
 /*
  * shrink the pool, free(delete) at most max_count coroutines whose idle time exceed idle_millisecs
  */
@@ -19,9 +19,12 @@
 // THE SOFTWARE.
 
 #include "poll.h"
+#include <errno.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
 
 typedef struct epoll_event epoll_event_t;
 
@@ -30,6 +33,7 @@ typedef struct _ef_epoll {
     ef_poll_t poll;
     int epfd;
     int cap;
+    int pwait2;
     epoll_event_t events[0];
 } ef_epoll_t;
 
@@ -65,7 +69,7 @@ static int ef_epoll_unset(ef_poll_t *p, int fd, int events)
     return 0;
 }
 
-static int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+static int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, long long nanosecs)
 {
     int ret, idx;
     ef_epoll_t *ep = (ef_epoll_t *)p;
@@ -74,7 +78,27 @@ static int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisec
         count = ep->cap;
     }
 
-    ret = epoll_wait(ep->epfd, &ep->events[0], count, millisecs);
+    /*
+     * epoll_pwait2 takes timespec since linux 5.11, called by syscall,
+     * the wrapper is only in glibc 2.35 and later
+     */
+#ifdef __NR_epoll_pwait2
+    if (ep->pwait2) {
+        struct timespec ts, *tsp = NULL;
+        if (nanosecs >= 0) {
+            ts.tv_sec = nanosecs / 1000000000;
+            ts.tv_nsec = nanosecs % 1000000000;
+            tsp = &ts;
+        }
+        ret = (int)syscall(__NR_epoll_pwait2, ep->epfd, &ep->events[0], count, tsp, NULL, 0);
+        if (ret < 0 && errno == ENOSYS) {
+            ep->pwait2 = 0;
+        }
+    }
+#endif
+    if (!ep->pwait2) {
+        ret = epoll_wait(ep->epfd, &ep->events[0], count, ef_poll_millisecs(nanosecs));
+    }
     if (ret <= 0) {
         return ret;
     }
@@ -123,7 +147,13 @@ static ef_poll_t *ef_epoll_create(int cap)
     ep->poll.unset = ef_epoll_unset;
     ep->poll.wait = ef_epoll_wait;
     ep->poll.free = ef_epoll_free;
+    ep->poll.migratable = 1;
     ep->cap = cap;
+#ifdef __NR_epoll_pwait2
+    ep->pwait2 = 1;
+#else
+    ep->pwait2 = 0;
+#endif
     return &ep->poll;
 }
 
@@ -0,0 +1,305 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "poll.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include "util/util.h"
+
+typedef struct epoll_event epoll_event_t;
+
+/*
+ * per fd state, the fd is registered only once with all events
+ * in edge triggered mode, so we must remember the readiness
+ * reported by kernel until the waiting routine consumes it
+ */
+typedef struct _ef_epollet_fd {
+
+    /*
+     * registered to the epoll object or not
+     */
+    int registered;
+
+    /*
+     * the events currently waited by the routine, 0 when nobody waits
+     */
+    int waiting;
+
+    /*
+     * the events fired but not consumed yet
+     */
+    int ready;
+
+    /*
+     * the poll data of the waiting routine
+     */
+    void *ptr;
+} ef_epollet_fd_t;
+
+typedef struct _ef_epollet {
+    ef_poll_t poll;
+    int epfd;
+    int cap;
+    int pwait2;
+
+    /*
+     * per fd state table, indexed by fd
+     */
+    int fd_cap;
+    ef_epollet_fd_t *fds;
+    epoll_event_t events[0];
+} ef_epollet_t;
+
+static ef_epollet_fd_t *ef_epollet_get_fd(ef_epollet_t *ep, int fd)
+{
+    ef_epollet_fd_t *fds;
+    int fd_cap;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fd < ep->fd_cap) {
+        return &ep->fds[fd];
+    }
+
+    /*
+     * grow the table to the next power of 2
+     */
+    fd_cap = (int)ef_resize(fd + 1, 1024);
+    fds = (ef_epollet_fd_t *)realloc(ep->fds, sizeof(ef_epollet_fd_t) * fd_cap);
+    if (!fds) {
+        return NULL;
+    }
+    memset(&fds[ep->fd_cap], 0, sizeof(ef_epollet_fd_t) * (fd_cap - ep->fd_cap));
+    ep->fds = fds;
+    ep->fd_cap = fd_cap;
+    return &fds[fd];
+}
+
+static int ef_epollet_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+{
+    ef_epollet_t *ep = (ef_epollet_t *)p;
+    ef_epollet_fd_t *ef;
+    epoll_event_t e;
+    int retval;
+
+    ef = ef_epollet_get_fd(ep, fd);
+    if (!ef) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /*
+     * register only once, all events in edge triggered mode,
+     * the fd is identified by itself, not by the routine
+     */
+    if (!ef->registered) {
+        e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        e.data.fd = fd;
+        retval = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &e);
+        if (retval < 0 && errno == EEXIST) {
+            retval = epoll_ctl(ep->epfd, EPOLL_CTL_MOD, fd, &e);
+        }
+        if (retval < 0) {
+            return retval;
+        }
+        ef->registered = 1;
+        ef->ready = 0;
+    }
+
+    ef->waiting = events;
+    ef->ptr = ptr;
+
+    /*
+     * already fired before, no need to wait
+     */
+    if (ef->ready & (events | EF_POLLERR | EF_POLLHUP)) {
+        return 1;
+    }
+    return 0;
+}
+
+static int ef_epollet_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+{
+    ef_epollet_t *ep = (ef_epollet_t *)p;
+    ef_epollet_fd_t *ef;
+    epoll_event_t e = {0};
+
+    if (fd < 0 || fd >= ep->fd_cap) {
+        return 0;
+    }
+
+    ef = &ep->fds[fd];
+
+    /*
+     * just stop waiting, keep the registration until closing
+     */
+    if (!onclose) {
+        ef->waiting = 0;
+        return 0;
+    }
+
+    if (!ef->registered) {
+        return 0;
+    }
+
+    ef->registered = 0;
+    ef->waiting = 0;
+    ef->ready = 0;
+    ef->ptr = NULL;
+    return epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, &e);
+}
+
+static int ef_epollet_unset(ef_poll_t *p, int fd, int events)
+{
+    ef_epollet_t *ep = (ef_epollet_t *)p;
+
+    /*
+     * the fired events consumed, such as EAGAIN returned
+     */
+    if (fd >= 0 && fd < ep->fd_cap) {
+        ep->fds[fd].ready &= ~events;
+    }
+    return 0;
+}
+
+static int ef_epollet_wait(ef_poll_t *p, ef_event_t *evts, int count, long long nanosecs)
+{
+    int ret, idx, cnt = 0;
+    ef_epollet_t *ep = (ef_epollet_t *)p;
+
+    if (count > ep->cap) {
+        count = ep->cap;
+    }
+
+    /*
+     * epoll_pwait2 takes timespec since linux 5.11, called by syscall,
+     * the wrapper is only in glibc 2.35 and later
+     */
+#ifdef __NR_epoll_pwait2
+    if (ep->pwait2) {
+        struct timespec ts, *tsp = NULL;
+        if (nanosecs >= 0) {
+            ts.tv_sec = nanosecs / 1000000000;
+            ts.tv_nsec = nanosecs % 1000000000;
+            tsp = &ts;
+        }
+        ret = (int)syscall(__NR_epoll_pwait2, ep->epfd, &ep->events[0], count, tsp, NULL, 0);
+        if (ret < 0 && errno == ENOSYS) {
+            ep->pwait2 = 0;
+        }
+    }
+#endif
+    if (!ep->pwait2) {
+        ret = epoll_wait(ep->epfd, &ep->events[0], count, ef_poll_millisecs(nanosecs));
+    }
+    if (ret <= 0) {
+        return ret;
+    }
+
+    for (idx = 0; idx < ret; ++idx) {
+        int fd = ep->events[idx].data.fd;
+        int events = ep->events[idx].events;
+        ef_epollet_fd_t *ef;
+
+        if (fd >= ep->fd_cap) {
+            continue;
+        }
+        ef = &ep->fds[fd];
+
+        /*
+         * peer closed its write side, the read will return 0
+         */
+        if (events & EPOLLRDHUP) {
+            events |= EF_POLLIN;
+        }
+        ef->ready |= events & (EF_POLLIN | EF_POLLOUT | EF_POLLERR | EF_POLLHUP);
+
+        /*
+         * only report to the routine waiting for the fired events,
+         * others kept in ready and will be checked by associate
+         */
+        if (ef->waiting && (ef->ready & (ef->waiting | EF_POLLERR | EF_POLLHUP))) {
+            evts[cnt].events = ef->ready;
+            evts[cnt].ptr = ef->ptr;
+            ++cnt;
+        }
+    }
+    return cnt;
+}
+
+static int ef_epollet_free(ef_poll_t *p)
+{
+    ef_epollet_t *ep = (ef_epollet_t *)p;
+    close(ep->epfd);
+    free(ep->fds);
+    free(ep);
+    return 0;
+}
+
+static ef_poll_t *ef_epollet_create(int cap)
+{
+    ef_epollet_t *ep;
+    size_t size = sizeof(ef_epollet_t);
+
+    /*
+     * event buffer at least 128
+     */
+    if (cap < 128) {
+        cap = 128;
+    }
+
+    size += sizeof(epoll_event_t) * cap;
+    ep = (ef_epollet_t *)malloc(size);
+    if (!ep) {
+        return NULL;
+    }
+
+    ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep->epfd < 0) {
+        free(ep);
+        return NULL;
+    }
+
+    ep->poll.associate = ef_epollet_associate;
+    ep->poll.dissociate = ef_epollet_dissociate;
+    ep->poll.unset = ef_epollet_unset;
+    ep->poll.wait = ef_epollet_wait;
+    ep->poll.free = ef_epollet_free;
+    ep->poll.migratable = 0;
+    ep->cap = cap;
+#ifdef __NR_epoll_pwait2
+    ep->pwait2 = 1;
+#else
+    ep->pwait2 = 0;
+#endif
+    ep->fd_cap = 0;
+    ep->fds = NULL;
+    return &ep->poll;
+}
+
+create_func_t ef_create_poll = ef_epollet_create;
@@ -18,13 +18,20 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <signal.h>
 #include "fiber.h"
 
 static long ef_page_size = 0;
-static ef_fiber_sched_t *ef_fiber_sched = NULL;
+
+/*
+ * each thread runs its own sched, the SIGSEGV handler runs on the faulting thread
+ */
+static __thread ef_fiber_sched_t *ef_fiber_sched = NULL;
 
 long ef_fiber_internal_swap(void *new_sp, void **old_sp_ptr, long retval);
 
@@ -34,6 +41,8 @@ ef_fiber_t *ef_fiber_create(ef_fiber_sched_t *rt, size_t stack_size, size_t head
 {
     ef_fiber_t *fiber;
     void *stack;
+    char *lower;
+    size_t commit;
     long page_size = ef_page_size;
 
     if (stack_size == 0) {
@@ -47,6 +56,12 @@ ef_fiber_t *ef_fiber_create(ef_fiber_sched_t *rt, size_t stack_size, size_t head
     // stack_size最小为一个页
     stack_size = (size_t)((stack_size + page_size - 1) & ~(page_size - 1));
 
+    /*
+     * the fiber_proc entered with rsp at stack_upper - 16, the abi wants
+     * rsp + 8 aligned to 16 there, so keep header_size an odd multiple of 8
+     */
+    header_size = ((header_size + 7) & ~(size_t)15) + 8;
+
     /*
      * reserve the stack area, no physical pages here
      */
@@ -106,10 +121,27 @@ ef_fiber_t *ef_fiber_create(ef_fiber_sched_t *rt, size_t stack_size, size_t head
     }
 
     /*
-     * map the highest page in the stack area
+     * map the highest commit bytes in the stack area, keep the guard page
+     */
+    // 预留出stack内存中最高位地址的commit大小（至少一个页），将其设置为可读可写
+    commit = (rt->stack_commit + page_size - 1) & ~(page_size - 1);
+    if (commit + page_size > stack_size) {
+        commit = stack_size - page_size;
+    }
+    if (commit < (size_t)page_size) {
+        commit = (size_t)page_size;
+    }
+    lower = (char *)stack + stack_size - commit;
+
+    /*
+     * MAP_POPULATE not works on PROT_NONE, so map the committed part again
      */
-    // 预留出stack内存中最最高位地址的一个页，将其设置为可读可写，即先使用这一个页
-    if (mprotect((char *)stack + stack_size - page_size, page_size, PROT_READ | PROT_WRITE) < 0) {
+    if (rt->stack_flags & EF_FIBER_PREFAULT) {
+        if (mmap(lower, commit, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED | MAP_POPULATE, -1, 0) == MAP_FAILED) {
+            munmap(stack, stack_size);
+            return NULL;
+        }
+    } else if (mprotect(lower, commit, PROT_READ | PROT_WRITE) < 0) {
         munmap(stack, stack_size);
         return NULL;
     }
@@ -124,21 +156,218 @@ ef_fiber_t *ef_fiber_create(ef_fiber_sched_t *rt, size_t stack_size, size_t head
     fiber->stack_size = stack_size; // 协程栈最大大小（目前有部分是不可访问的内存）
     fiber->stack_area = stack;  // 协程栈最大的栈底（目前有部分是不可访问的内存）
     fiber->stack_upper = (char *)stack + stack_size - header_size;  // 协程栈的栈顶
-    fiber->stack_lower = (char *)stack + stack_size - page_size;    // 协程栈目前所能使用内存的最低位地址（可读可写的内存最低地址，初始时为一个页）
+    fiber->stack_lower = lower;    // 协程栈目前所能使用内存的最低位地址（可读可写的内存最低地址，初始时为commit大小）
     fiber->sched = rt;  // 将调度器关联到协程上
+    fiber->stack_grow = rt->stack_grow; // 协程迁移到其他线程后仍按创建时的策略扩展
+    fiber->shared = NULL;
     // 初始化协程
     ef_fiber_init(fiber, fiber_proc, param);
     return fiber;
 }
 
+int ef_fiber_stack_init(ef_fiber_stack_t *stack, size_t stack_size)
+{
+    long page_size = ef_page_size;
+    void *area;
+
+    stack_size = (size_t)((stack_size + page_size - 1) & ~(page_size - 1));
+    if (stack_size < (size_t)page_size * 2) {
+        stack_size = (size_t)page_size * 2;
+    }
+
+    /*
+     * shared by many fibers, so commit it all, only the guard page left
+     */
+    area = mmap(NULL, stack_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (MAP_FAILED == area) {
+        return -1;
+    }
+    if (mprotect((char *)area + page_size, stack_size - page_size, PROT_READ | PROT_WRITE) < 0) {
+        munmap(area, stack_size);
+        return -1;
+    }
+
+    stack->stack_area = area;
+    stack->stack_size = stack_size;
+
+    /*
+     * the fiber_proc entered with rsp at stack_upper - 16 as a private one
+     */
+    stack->stack_upper = (char *)area + stack_size - 8;
+    stack->owner = NULL;
+    return 0;
+}
+
+void ef_fiber_stack_free(ef_fiber_stack_t *stack)
+{
+    munmap(stack->stack_area, stack->stack_size);
+    stack->stack_area = NULL;
+    stack->owner = NULL;
+}
+
+ef_fiber_t *ef_fiber_create_shared(ef_fiber_sched_t *rt, ef_fiber_stack_t *stack, size_t header_size, ef_fiber_proc_t fiber_proc, void *param)
+{
+    ef_fiber_t *fiber = (ef_fiber_t *)calloc(1, header_size);
+    if (!fiber) {
+        return NULL;
+    }
+
+    /*
+     * the stack fields describe the shared stack, the SIGSEGV handler
+     * finds nothing to expand there and aborts on the guard page
+     */
+    fiber->stack_size = stack->stack_size;
+    fiber->stack_area = stack->stack_area;
+    fiber->stack_upper = stack->stack_upper;
+    fiber->stack_lower = (char *)stack->stack_area + ef_page_size;
+    fiber->sched = rt;
+    fiber->shared = stack;
+    ef_fiber_init(fiber, fiber_proc, param);
+    return fiber;
+}
+
+/*
+ * copy the owner's frames out of the shared stack, and the fiber's in
+ */
+static int ef_fiber_stack_switch(ef_fiber_t *fiber)
+{
+    ef_fiber_stack_t *stack = fiber->shared;
+    ef_fiber_t *owner = stack->owner;
+
+    if (owner) {
+        size_t used = (char *)stack->stack_upper - (char *)owner->stack_ptr;
+        if (used > owner->save_size) {
+
+            /*
+             * right-sized, rounded up to avoid reallocating for a few bytes deeper
+             */
+            size_t size = (used + 255) & ~(size_t)255;
+            void *area = malloc(size);
+            if (!area) {
+                return ERROR_FIBER_NO_MEMORY;
+            }
+            free(owner->save_area);
+            owner->save_area = area;
+            owner->save_size = size;
+        }
+        memcpy(owner->save_area, owner->stack_ptr, used);
+        owner->save_used = used;
+    }
+
+    stack->owner = fiber;
+    if (fiber->stack_ptr == NULL) {
+        fiber->stack_ptr = ef_fiber_internal_init(fiber, fiber->fiber_proc, fiber->param);
+    } else {
+        memcpy((char *)stack->stack_upper - fiber->save_used, fiber->save_area, fiber->save_used);
+    }
+    return 0;
+}
+
+int ef_fiber_set_stack_policy(ef_fiber_sched_t *rt, size_t commit, size_t grow, int flags)
+{
+    long page_size = ef_page_size;
+
+    if (page_size <= 0) {
+        return -1;
+    }
+    rt->stack_commit = commit < (size_t)page_size ? (size_t)page_size : commit;
+    rt->stack_grow = (grow + page_size - 1) & ~(page_size - 1);
+    if (rt->stack_grow < (size_t)page_size) {
+        rt->stack_grow = (size_t)page_size;
+    }
+    rt->stack_flags = flags;
+    return 0;
+}
+
+size_t ef_fiber_stack_used(ef_fiber_t *fiber)
+{
+    /*
+     * fresh or cleared stack memory is zero, the deepest frame left something
+     */
+    long *ptr = (long *)fiber->stack_lower;
+    long *upper = (long *)fiber->stack_upper;
+
+    // 共享栈上还有其他协程留下的内容，以保存区的大小代替
+    if (fiber->shared) {
+        return fiber->save_size;
+    }
+    while (ptr < upper && *ptr == 0) {
+        ++ptr;
+    }
+    return (size_t)((char *)fiber->stack_area + fiber->stack_size - (char *)ptr);
+}
+
+void ef_fiber_stack_clear(ef_fiber_t *fiber)
+{
+    char *top = (char *)fiber->stack_area + fiber->stack_size;
+    size_t header_size = (size_t)(top - (char *)fiber->stack_upper);
+    size_t used = ef_fiber_stack_used(fiber);
+    if (fiber->shared) {
+        return;
+    }
+    if (used > header_size) {
+        memset(top - used, 0, used - header_size);
+    }
+}
+
+int ef_fiber_stack_release(ef_fiber_t *fiber, int advice)
+{
+    char *lower = (char *)fiber->stack_lower;
+    char *upper = (char *)((long)fiber->stack_upper & ~(ef_page_size - 1));
+
+    if (fiber->shared) {
+        free(fiber->save_area);
+        fiber->save_area = NULL;
+        fiber->save_size = 0;
+        return 0;
+    }
+    if (lower >= upper) {
+        return 0;
+    }
+
+    /*
+     * MADV_FREE since linux 4.5, fall back to MADV_DONTNEED
+     */
+    if (madvise(lower, upper - lower, advice) < 0) {
+        if (errno != EINVAL || advice == MADV_DONTNEED) {
+            return -1;
+        }
+        return madvise(lower, upper - lower, MADV_DONTNEED);
+    }
+    return 0;
+}
+
 void ef_fiber_init(ef_fiber_t *fiber, ef_fiber_proc_t fiber_proc, void *param)
 {
+    /*
+     * the shared stack may be used by others now, init when taking it
+     */
+    if (fiber->shared) {
+        fiber->fiber_proc = fiber_proc;
+        fiber->param = (param != NULL) ? param : fiber;
+        fiber->stack_ptr = NULL;
+        fiber->save_used = 0;
+        fiber->status = FIBER_STATUS_INITED;
+        return;
+    }
     // 当前协程所对应栈的栈顶指针（即从可读可写的内存中，划分出来一块作为当前协程栈），默认是指向上面划分的可读可写的一个page的内存的128B处
     fiber->stack_ptr = ef_fiber_internal_init(fiber, fiber_proc, (param != NULL) ? param : fiber);
 }
 
 void ef_fiber_delete(ef_fiber_t *fiber)
 {
+    /*
+     * the header and the save area of a fiber on a shared stack
+     */
+    if (fiber->shared) {
+        if (fiber->shared->owner == fiber) {
+            fiber->shared->owner = NULL;
+        }
+        free(fiber->save_area);
+        free(fiber);
+        return;
+    }
+
     /*
      * free the stack area, contains the ef_fiber_t
      * of course the fiber cannot delete itself
@@ -164,12 +393,36 @@ int ef_fiber_resume(ef_fiber_sched_t *rt, ef_fiber_t *to, long sndval, long *ret
 
     // 将to协程作为当前执行协程
     current = rt->current_fiber;
+
+    /*
+     * take the shared stack, the resumer must not be on it
+     */
+    if (to->shared && to->shared->owner != to) {
+        int res;
+        if (current->shared == to->shared) {
+            return ERROR_FIBER_NOT_INITED;
+        }
+        res = ef_fiber_stack_switch(to);
+        if (res < 0) {
+            return res;
+        }
+    }
+
     to->parent = current;
+    // 协程可能在其他线程的调度器上恢复执行（迁移），之后的yield与退出都回到该调度器
+    to->sched = rt;
     rt->current_fiber = to;
     // 真正切换逻辑
     // ret == sndval
     ret = ef_fiber_internal_swap(to->stack_ptr, &current->stack_ptr, sndval);
 
+    /*
+     * nothing to save for an exited one
+     */
+    if (to->shared && to->status == FIBER_STATUS_EXITED) {
+        to->shared->owner = NULL;
+    }
+
     if (retval) {
         *retval = ret;
     }
@@ -201,6 +454,15 @@ int ef_fiber_expand_stack(ef_fiber_t *fiber, void *addr)
      */
     if (lower - (char *)fiber->stack_area >= ef_page_size &&
         lower < (char *)fiber->stack_lower) {
+
+        /*
+         * expand by stack_grow at least, saves the following traps
+         */
+        // 按stack_grow整块扩展，减少之后的SIGSEGV次数，但不越过保护页
+        if ((size_t)((char *)fiber->stack_lower - lower) < fiber->stack_grow) {
+            size_t room = (char *)fiber->stack_lower - (char *)fiber->stack_area - ef_page_size;
+            lower = (char *)fiber->stack_lower - (fiber->stack_grow < room ? fiber->stack_grow : room);
+        }
         size_t size = (char *)fiber->stack_lower - lower;
         /**
          * 在Linux中，mprotect()函数可以用来修改一段指定内存区域的保护属性。
@@ -264,12 +526,20 @@ int ef_fiber_init_sched(ef_fiber_sched_t *rt, int handle_sigsegv)
 
     // 将当前系统线程当成当前运行的协程
     rt->current_fiber = &rt->thread_fiber;
+    rt->thread_fiber.shared = NULL;
     // 设置内存页的大小
     ef_page_size = sysconf(_SC_PAGESIZE);
     if (ef_page_size < 0) {
         return -1;
     }
 
+    /*
+     * commit one page and expand by one page as before, unless told
+     */
+    rt->stack_commit = (size_t)ef_page_size;
+    rt->stack_grow = (size_t)ef_page_size;
+    rt->stack_flags = 0;
+
     if (!handle_sigsegv) {
         return 0;
     }
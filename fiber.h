@@ -25,12 +25,26 @@
 
 #define ERROR_FIBER_EXITED     (-1)
 #define ERROR_FIBER_NOT_INITED (-2)
+#define ERROR_FIBER_NO_MEMORY  (-3)
 
 #define FIBER_STATUS_EXITED 0
 #define FIBER_STATUS_INITED 1
 
+/*
+ * populate the committed stack pages on creating, not on first touch
+ */
+#define EF_FIBER_PREFAULT 1
+
+/*
+ * keep the stack below the frames zeroed between runs, so the depth of
+ * each run can be measured by ef_fiber_stack_used
+ */
+#define EF_FIBER_TRACK 2
+
 typedef struct _ef_fiber ef_fiber_t;
 typedef struct _ef_fiber_sched ef_fiber_sched_t;
+typedef struct _ef_fiber_stack ef_fiber_stack_t;
+typedef long (*ef_fiber_proc_t)(void *param);
 
 /*
      the fiber layout
@@ -111,6 +125,62 @@ struct _ef_fiber {
      */
     // 协程调度器
     ef_fiber_sched_t *sched;
+
+    /*
+     * the minimum bytes the stack expanded by on each SIGSEGV
+     */
+    size_t stack_grow;
+
+    /*
+     * the shared stack the fiber runs on, NULL if it has its own
+     */
+    // 运行所在的共享栈，私有栈的协程为NULL
+    ef_fiber_stack_t *shared;
+
+    /*
+     * the used part of the shared stack copied here when other fiber takes it
+     */
+    // 其他协程占用共享栈时，本协程用到的那部分栈复制到这里，save_size为容量
+    void *save_area;
+    size_t save_size;
+    size_t save_used;
+
+    /*
+     * a fiber on a shared stack is initialized when it takes the stack
+     */
+    ef_fiber_proc_t fiber_proc;
+    void *param;
+};
+
+/*
+     the shared stack, the headers are allocated from heap
+
+    |----------------| <- stack_upper
+    |                |
+    | frames of the  |
+    | owner fiber    |
+    |                | <- owner->stack_ptr, the part above copied out
+    |                |    to the owner's save_area when others resume
+    |                |
+    |----------------|
+    | one page guard |
+    |----------------| <- stack_area
+
+*/
+struct _ef_fiber_stack {
+
+    /*
+     * the whole area committed except the guard page
+     */
+    void *stack_area;
+    size_t stack_size;
+    void *stack_upper;
+
+    /*
+     * the fiber whose frames are on the stack now
+     */
+    // 当前栈上是哪个协程的栈帧
+    ef_fiber_t *owner;
 };
 
 struct _ef_fiber_sched {
@@ -126,15 +196,31 @@ struct _ef_fiber_sched {
      */
     // 系统线程（也将其当成一个协程，不过协程结构体中仅存储其栈指针）
     ef_fiber_t thread_fiber;
-};
 
-typedef long (*ef_fiber_proc_t)(void *param);
+    /*
+     * bytes of stack made writable when creating a fiber
+     */
+    // 创建协程时预先提交（可读可写）的栈大小，默认一个页
+    size_t stack_commit;
+
+    /*
+     * the minimum bytes a fiber stack expanded by on each SIGSEGV
+     */
+    // 每次SIGSEGV时协程栈至少扩展的大小，默认一个页
+    size_t stack_grow;
+
+    /*
+     * EF_FIBER_PREFAULT or 0
+     */
+    int stack_flags;
+};
 
 #define ef_fiber_is_exited(fiber) ((fiber)->status == FIBER_STATUS_EXITED)
 
 /*
  * run a just initialized fiber or resume a fiber which doing yield
  * sndval will be the return value of the yield function in the latter
+ * the fiber belongs to rt afterwards, so it can be migrated to other sched
  */
 int ef_fiber_resume(ef_fiber_sched_t *rt, ef_fiber_t *to, long sndval, long *retval);
 
@@ -150,6 +236,20 @@ long ef_fiber_yield(ef_fiber_sched_t *rt, long sndval);
  */
 ef_fiber_t *ef_fiber_create(ef_fiber_sched_t *rt, size_t stack_size, size_t header_size, ef_fiber_proc_t fiber_proc, void *param);
 
+/*
+ * create a fiber running on the shared stack, its header_size bytes header
+ * allocated from heap, the frames are copied out when other fibers resume
+ * on the stack and copied back when it resumes, so pointers to its locals
+ * must not be used by others while it is not running
+ */
+ef_fiber_t *ef_fiber_create_shared(ef_fiber_sched_t *rt, ef_fiber_stack_t *stack, size_t header_size, ef_fiber_proc_t fiber_proc, void *param);
+
+/*
+ * map a stack_size shared stack, free it after all its fibers deleted
+ */
+int ef_fiber_stack_init(ef_fiber_stack_t *stack, size_t stack_size);
+void ef_fiber_stack_free(ef_fiber_stack_t *stack);
+
 /*
  * expand the lower boundary of the fiber stack to addr
  */
@@ -160,6 +260,35 @@ int ef_fiber_expand_stack(ef_fiber_t *fiber, void *addr);
  */
 int ef_fiber_init_sched(ef_fiber_sched_t *rt, int handle_sigsegv);
 
+/*
+ * set the stack commit policy of the fibers created by rt afterwards, commit
+ * bytes are writable at once, and a SIGSEGV expands the stack by at least grow
+ * bytes, both rounded up to pages, flags EF_FIBER_PREFAULT populates the
+ * committed pages on creating, so the first run takes no page fault at all
+ */
+int ef_fiber_set_stack_policy(ef_fiber_sched_t *rt, size_t commit, size_t grow, int flags);
+
+/*
+ * bytes from the top of the stack area down to the lowest non-zero word,
+ * the high-water mark of the stack since created or cleared, for a fiber
+ * on a shared stack the size of its save area, as deep as it yielded
+ */
+size_t ef_fiber_stack_used(ef_fiber_t *fiber);
+
+/*
+ * zero the used part of an exited fiber stack, then the next run of it
+ * is measured alone, the committed pages not touched stay untouched
+ */
+void ef_fiber_stack_clear(ef_fiber_t *fiber);
+
+/*
+ * give back the touched stack pages below the header page of an exited fiber
+ * by madvise with advice, MADV_DONTNEED or MADV_FREE, the mapping is kept and
+ * the pages read as zero (or the old content with MADV_FREE) when used again,
+ * a fiber on a shared stack frees its save area instead
+ */
+int ef_fiber_stack_release(ef_fiber_t *fiber, int advice);
+
 /*
  * init a fiber with fiber_proc and param
  */
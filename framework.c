@@ -18,25 +18,380 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+/*
+ * accept4, splice, recvmmsg
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "framework.h"
 #include "coroutine.h"
+#include "uring.h"
 #include "util/list.h"
 #include "util/util.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * the provided buffer group of the receive buffers
+ */
+#define EF_BUFFER_GROUP 0
+
+/*
+ * the empty pipes kept by a runtime for ef_routine_relay,
+ * and the bytes moved into a pipe at a time
+ */
+#define EF_PIPE_CACHE 64
+#define EF_PIPE_SIZE  (64 * 1024)
+#define EF_BUFIO_CACHE 64
+
+/*
+ * the iovecs copied to the stack to resume a partial writev or sendmsg
+ */
+#define EF_IOV_LOCAL 16
 
 /*
  * the global pointer
  */
-ef_runtime_t *ef_runtime = NULL;
+__thread ef_runtime_t *ef_runtime = NULL;
 
 inline int ef_queue_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd) __attribute__((always_inline));
-inline int ef_routine_run(ef_runtime_t *rt, ef_routine_proc_t proc, int socket) __attribute__((always_inline));
+inline int ef_routine_run(ef_runtime_t *rt, ef_listen_info_t *li, int socket, long long queued_at) __attribute__((always_inline));
+inline long ef_routine_wait(ef_routine_t *er, int fd, int events) __attribute__((always_inline));
+inline long ef_routine_park(ef_routine_t *er) __attribute__((always_inline));
+inline long long ef_routine_deadline(ef_routine_t *er, int millisecs) __attribute__((always_inline));
+inline struct io_uring_sqe *ef_routine_sqe(ef_routine_t *er) __attribute__((always_inline));
+inline long ef_routine_complete(ef_routine_t *er, struct io_uring_sqe *sqe) __attribute__((always_inline));
+inline long ef_routine_uring_io(ef_routine_t *er, int opcode, int fd, const void *buf, size_t len, int flags) __attribute__((always_inline));
+inline long ef_routine_poll(ef_routine_t *er, int fd, int events) __attribute__((always_inline));
+inline ssize_t ef_routine_splice_fd(ef_routine_t *er, int fd_in, int fd_out, size_t len, unsigned int flags, int wait_fd, int events) __attribute__((always_inline));
+inline int ef_iov_resume(struct iovec *local, const struct iovec *iov, int iovcnt, size_t skip) __attribute__((always_inline));
+inline void ef_iov_advance(const struct iovec **iov, int *iovcnt, size_t *skip, size_t bytes) __attribute__((always_inline));
+inline size_t ef_mmsg_bytes(const struct mmsghdr *msgvec, int count) __attribute__((always_inline));
+inline int ef_listen_drain(ef_runtime_t *rt, ef_listen_info_t *li) __attribute__((always_inline));
+inline int ef_listen_accept(ef_runtime_t *rt, ef_listen_info_t *li) __attribute__((always_inline));
+inline int ef_listen_cancel(ef_runtime_t *rt, ef_listen_info_t *li) __attribute__((always_inline));
+inline void ef_listen_shed(int fd) __attribute__((always_inline));
+inline int ef_latency_bucket(unsigned long nanosecs) __attribute__((always_inline));
+inline void ef_latency_record(ef_latency_hist_t *h, long long nanosecs) __attribute__((always_inline));
+inline void ef_routine_reply(ef_routine_t *er, int fd, ssize_t bytes) __attribute__((always_inline));
+inline void ef_recv_fired(ef_runtime_t *rt, ef_recv_state_t *st, int res, unsigned int flags) __attribute__((always_inline));
+inline ef_recv_state_t *ef_routine_recv_state(ef_routine_t *er, int fd) __attribute__((always_inline));
+void ef_routine_recv_drop(ef_routine_t *er, ef_recv_state_t *st);
+int ef_recv_arm(ef_runtime_t *rt, ef_recv_state_t *st);
+void ef_recv_rearm(ef_runtime_t *rt);
+static void ef_bufio_free(ef_bufio_t *b);
+static void ef_arena_unmap(ef_runtime_t *rt);
+
+/*
+ * the bucket of a stack high-water mark in pages, 1 to 8 pages a bucket each,
+ * then 4 buckets for each power of 2, the last one takes the deeper ones too
+ */
+static int ef_stack_bucket(size_t pages)
+{
+    size_t v = pages > 0 ? pages - 1 : 0;
+    int e, idx;
+
+    if (v < 8) {
+        return (int)v;
+    }
+    e = 63 - __builtin_clzl(v);
+    idx = 8 + (e - 3) * 4 + (int)((v >> (e - 2)) & 3);
+    return idx < EF_STACK_BUCKETS ? idx : EF_STACK_BUCKETS - 1;
+}
+
+/*
+ * the most pages counted in the bucket
+ */
+static size_t ef_stack_bucket_pages(int idx)
+{
+    if (idx < 8) {
+        return (size_t)idx + 1;
+    }
+    return (size_t)(5 + (idx - 8) % 4) << ((idx - 8) / 4 + 1);
+}
+
+/*
+ * a stolen routine may exit on another thread, so the counters are atomic
+ */
+static void ef_stack_stat_record(ef_stack_stat_t *st, size_t used)
+{
+    size_t pages = (used + st->page_size - 1) / st->page_size;
+
+    __atomic_add_fetch(&st->buckets[ef_stack_bucket(pages)], 1, __ATOMIC_RELAXED);
+    if (used > __atomic_load_n(&st->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&st->max, used, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED) % EF_STACK_SAMPLES == 0) {
+        __atomic_store_n(&st->commit, ef_stack_stat_percentile(st, 99), __ATOMIC_RELAXED);
+    }
+}
+
+// 查找处理函数的栈深度统计，没有时创建
+static ef_stack_stat_t *ef_stack_stat_get(ef_runtime_t *rt, ef_routine_proc_t proc)
+{
+    ef_stack_stat_t *st;
+    ef_list_entry_t *ent = ef_list_entry_after(&rt->stack_stat_list);
+    while (ent != &rt->stack_stat_list) {
+        st = CAST_PARENT_PTR(ent, ef_stack_stat_t, list_entry);
+        if (st->proc == proc) {
+            return st;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+
+    st = (ef_stack_stat_t *)calloc(1, sizeof(ef_stack_stat_t));
+    if (st) {
+        st->proc = proc;
+        st->page_size = sysconf(_SC_PAGESIZE);
+        ef_list_insert_before(&rt->stack_stat_list, &st->list_entry);
+    }
+    return st;
+}
+
+int ef_stack_stat(ef_runtime_t *rt, ef_routine_proc_t proc, ef_stack_stat_t *st)
+{
+    int found = 0;
+
+    memset(st, 0, sizeof(ef_stack_stat_t));
+    st->proc = proc;
+    for (int i = 0; i < rt->thread_count; ++i) {
+        ef_runtime_t *peer = rt->runtimes ? rt->runtimes[i] : rt;
+        ef_list_entry_t *ent = ef_list_entry_after(&peer->stack_stat_list);
+        while (ent != &peer->stack_stat_list) {
+            ef_stack_stat_t *one = CAST_PARENT_PTR(ent, ef_stack_stat_t, list_entry);
+            if (one->proc == proc) {
+                st->page_size = one->page_size;
+                st->count += __atomic_load_n(&one->count, __ATOMIC_RELAXED);
+                if (one->max > st->max) {
+                    st->max = one->max;
+                }
+                for (int idx = 0; idx < EF_STACK_BUCKETS; ++idx) {
+                    st->buckets[idx] += __atomic_load_n(&one->buckets[idx], __ATOMIC_RELAXED);
+                }
+                found = 1;
+                break;
+            }
+            ent = ef_list_entry_after(ent);
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    if (st->count >= EF_STACK_SAMPLES) {
+        st->commit = ef_stack_stat_percentile(st, 99);
+    }
+    return 0;
+}
+
+size_t ef_stack_stat_percentile(const ef_stack_stat_t *st, int percent)
+{
+    unsigned long rank, seen = 0;
+    int idx;
+
+    if (st->count == 0) {
+        return 0;
+    }
+    rank = (st->count * percent + 99) / 100;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (idx = 0; idx < EF_STACK_BUCKETS - 1; ++idx) {
+        seen += st->buckets[idx];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return ef_stack_bucket_pages(idx) * st->page_size;
+}
+
+/*
+ * the bucket of a latency in nanoseconds, the values below 16 a bucket each,
+ * then 16 buckets for each power of 2, the last one takes the longer ones too
+ */
+inline int ef_latency_bucket(unsigned long nanosecs)
+{
+    int e;
+
+    if (nanosecs < (1UL << EF_LATENCY_SUB_BITS)) {
+        return (int)nanosecs;
+    }
+    e = 63 - __builtin_clzl(nanosecs);
+    if (e > EF_LATENCY_MAX_BIT) {
+        return EF_LATENCY_BUCKETS - 1;
+    }
+    return ((e - EF_LATENCY_SUB_BITS + 1) << EF_LATENCY_SUB_BITS) +
+        (int)((nanosecs >> (e - EF_LATENCY_SUB_BITS)) & ((1UL << EF_LATENCY_SUB_BITS) - 1));
+}
+
+/*
+ * the longest latency counted in the bucket
+ */
+static unsigned long ef_latency_bucket_max(int idx)
+{
+    unsigned long sub = 1UL << EF_LATENCY_SUB_BITS;
+    int shift;
+
+    if (idx < (int)sub) {
+        return (unsigned long)idx;
+    }
+    shift = (idx >> EF_LATENCY_SUB_BITS) - 1;
+    return ((sub + (idx & (sub - 1)) + 1) << shift) - 1;
+}
+
+/*
+ * no allocation or lock, a stolen routine may record on another thread
+ */
+inline void ef_latency_record(ef_latency_hist_t *h, long long nanosecs)
+{
+    unsigned long v = (nanosecs > 0) ? (unsigned long)nanosecs : 0;
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&h->buckets[ef_latency_bucket(v)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, v, __ATOMIC_RELAXED);
+
+    /*
+     * another thread may raise max at the same time, retry until
+     * ours is stored or a larger one is seen, max is reloaded on failure
+     */
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+static void ef_latency_merge(ef_latency_hist_t *to, const ef_latency_hist_t *from)
+{
+    unsigned long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    if (max > to->max) {
+        to->max = max;
+    }
+    for (int idx = 0; idx < EF_LATENCY_BUCKETS; ++idx) {
+        to->buckets[idx] += __atomic_load_n(&from->buckets[idx], __ATOMIC_RELAXED);
+    }
+}
+
+unsigned long ef_latency_percentile(const ef_latency_hist_t *h, double percent)
+{
+    unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    unsigned long rank, seen = 0, value;
+    double exact = (double)count * percent / 100;
+    int idx;
+
+    if (count == 0) {
+        return 0;
+    }
+    rank = (unsigned long)exact;
+    if ((double)rank < exact || rank == 0) {
+        ++rank;
+    }
+    for (idx = 0; idx < EF_LATENCY_BUCKETS - 1; ++idx) {
+        seen += __atomic_load_n(&h->buckets[idx], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            break;
+        }
+    }
+    value = ef_latency_bucket_max(idx);
+    return value < h->max ? value : h->max;
+}
+
+// 为监听socket创建准入控制计数
+static ef_listen_stat_t *ef_listen_stat_new(ef_runtime_t *rt, int socket)
+{
+    ef_listen_stat_t *st = (ef_listen_stat_t *)calloc(1, sizeof(ef_listen_stat_t));
+    if (st) {
+        st->socket = socket;
+        ef_list_insert_before(&rt->listen_stat_list, &st->list_entry);
+    }
+    return st;
+}
+
+int ef_listen_stat(ef_runtime_t *rt, int socket, ef_listen_stat_t *st)
+{
+    int found = 0;
+
+    memset(st, 0, sizeof(ef_listen_stat_t));
+    st->socket = socket;
+    for (int i = 0; i < rt->thread_count; ++i) {
+        ef_runtime_t *peer = rt->runtimes ? rt->runtimes[i] : rt;
+        ef_list_entry_t *ent = ef_list_entry_after(&peer->listen_stat_list);
+        while (ent != &peer->listen_stat_list) {
+            ef_listen_stat_t *one = CAST_PARENT_PTR(ent, ef_listen_stat_t, list_entry);
+            if (one->socket == socket && socket >= 0) {
+                unsigned long queue_max = __atomic_load_n(&one->queue_max, __ATOMIC_RELAXED);
+                st->port = one->port;
+                st->accepted += __atomic_load_n(&one->accepted, __ATOMIC_RELAXED);
+                st->failed += __atomic_load_n(&one->failed, __ATOMIC_RELAXED);
+                st->expired += __atomic_load_n(&one->expired, __ATOMIC_RELAXED);
+                st->rejected += __atomic_load_n(&one->rejected, __ATOMIC_RELAXED);
+                st->disarmed += __atomic_load_n(&one->disarmed, __ATOMIC_RELAXED);
+                ef_latency_merge(&st->queue_wait, &one->queue_wait);
+                ef_latency_merge(&st->first_byte, &one->first_byte);
+                ef_latency_merge(&st->duration, &one->duration);
+                if (queue_max > st->queue_max) {
+                    st->queue_max = queue_max;
+                }
+                found = 1;
+                break;
+            }
+            ent = ef_list_entry_after(ent);
+        }
+    }
+    return found ? 0 : -1;
+}
+
+int ef_runtime_stat(ef_runtime_t *rt, int thread, ef_runtime_stat_t *st)
+{
+    int from = (thread < 0) ? 0 : thread;
+    int to = (thread < 0) ? rt->thread_count : thread + 1;
+
+    if (thread >= rt->thread_count) {
+        return -1;
+    }
+
+    memset(st, 0, sizeof(ef_runtime_stat_t));
+    for (int i = from; i < to; ++i) {
+        ef_runtime_t *peer = rt->runtimes ? rt->runtimes[i] : rt;
+        ef_coroutine_pool_t *pool = &peer->co_pool;
+        ef_io_stat_t *io = &peer->io_stat;
+        st->rounds += __atomic_load_n(&peer->round, __ATOMIC_RELAXED);
+        st->waits += __atomic_load_n(&peer->wait_count, __ATOMIC_RELAXED);
+        st->events += __atomic_load_n(&peer->event_count, __ATOMIC_RELAXED);
+        st->switches += __atomic_load_n(&pool->resume_count, __ATOMIC_RELAXED);
+        st->pool_hits += __atomic_load_n(&pool->reuse_count, __ATOMIC_RELAXED);
+        st->pool_maps += __atomic_load_n(&pool->map_count, __ATOMIC_RELAXED);
+        st->pool_frees += __atomic_load_n(&pool->unmap_count, __ATOMIC_RELAXED);
+        st->coroutines += __atomic_load_n(&pool->full_count, __ATOMIC_RELAXED);
+        st->free_coroutines += __atomic_load_n(&pool->free_count, __ATOMIC_RELAXED);
+        st->arena_mapped += __atomic_load_n(&peer->arena_mapped, __ATOMIC_RELAXED);
+        st->arena_used += __atomic_load_n(&peer->arena_used, __ATOMIC_RELAXED);
+        st->io.read.fast += __atomic_load_n(&io->read.fast, __ATOMIC_RELAXED);
+        st->io.read.wait += __atomic_load_n(&io->read.wait, __ATOMIC_RELAXED);
+        st->io.read.bytes += __atomic_load_n(&io->read.bytes, __ATOMIC_RELAXED);
+        st->io.write.fast += __atomic_load_n(&io->write.fast, __ATOMIC_RELAXED);
+        st->io.write.wait += __atomic_load_n(&io->write.wait, __ATOMIC_RELAXED);
+        st->io.write.bytes += __atomic_load_n(&io->write.bytes, __ATOMIC_RELAXED);
+        st->io.yield_count += __atomic_load_n(&io->yield_count, __ATOMIC_RELAXED);
+        st->io.steal_count += __atomic_load_n(&io->steal_count, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
 
 // 由于创建这个处理函数的协程时，传入的参数是NULL，所以这个param拿到的是fiber结构体，fiber结构体在ef_routine_t结构体中
 long ef_proc(void *param)
@@ -51,23 +406,83 @@ long ef_proc(void *param)
     }
 
     /*
-     * it may or may not closed by the user code
+     * the buffers not detached, before the fd may be closed below
+     */
+    while (!ef_list_empty(&er->bufio_list)) {
+        ef_bufio_free(CAST_PARENT_PTR(ef_list_entry_after(&er->bufio_list), ef_bufio_t, list_entry));
+    }
+
+    /*
+     * it may or may not closed by the user code, no fd if started by ef_add_routine
+     */
+    if (fd >= 0) {
+        ef_routine_close(er, fd);
+    }
+
+    /*
+     * the multishot recv on the sockets not closed by ef_routine_close
+     */
+    while (!ef_list_empty(&er->recv_list)) {
+        ef_routine_recv_drop(er, CAST_PARENT_PTR(ef_list_entry_after(&er->recv_list), ef_recv_state_t, list_entry));
+    }
+
+    /*
+     * the deepest frame of this run is below us, the pool clears it on release
      */
-    ef_routine_close(er, fd);
+    if (er->stack_stat) {
+        ef_stack_stat_record(er->stack_stat, ef_fiber_stack_used(&er->co.fiber));
+    }
 
     return retval;
 }
 
-inline int ef_routine_run(ef_runtime_t *rt, ef_routine_proc_t proc, int socket)
+inline int ef_routine_run(ef_runtime_t *rt, ef_listen_info_t *li, int socket, long long queued_at)
 {
+    ef_fiber_sched_t *sched = &rt->co_pool.fiber_sched;
+    ef_stack_stat_t *st = (sched->stack_flags & EF_FIBER_TRACK) ? li->stack_stat : NULL;
+    size_t commit = sched->stack_commit;
+    ef_routine_t *er;
+
+    /*
+     * a new stack committed as deep as most runs of the handler went
+     */
+    if (st && st->commit && (sched->stack_flags & EF_STACK_ADAPTIVE) == EF_STACK_ADAPTIVE) {
+        sched->stack_commit = st->commit;
+    }
+
     // 创建协程时，传入的协程的执行函数是ef_proc，参数为NULL
-    ef_routine_t *er = (ef_routine_t*)ef_coroutine_create(&rt->co_pool, sizeof(ef_routine_t), ef_proc, NULL);
+    if ((li->flags & EF_LISTEN_SHARED) && rt->co_pool.shared_count) {
+        er = (ef_routine_t*)ef_coroutine_create_shared(&rt->co_pool, sizeof(ef_routine_t), ef_proc, NULL);
+    } else {
+        er = (ef_routine_t*)ef_coroutine_create(&rt->co_pool, sizeof(ef_routine_t), ef_proc, NULL);
+    }
+    sched->stack_commit = commit;
     if (er) {
         er->poll_data.type = FD_TYPE_RWC;
         er->poll_data.fd = socket;
         er->poll_data.routine_ptr = er;
         er->poll_data.runtime_ptr = rt;
-        er->poll_data.ef_proc = proc;
+        er->poll_data.ef_proc = li->ef_proc;
+        er->stack_stat = st;
+        ef_list_init(&er->recv_list);
+        ef_list_init(&er->bufio_list);
+        // 共享栈属于本线程，共享栈上的协程不能被其他线程取走
+        er->borrowed = er->co.fiber.shared ? 1 : 0;
+        er->deadline = 0;
+        er->timer.pending = 0;
+        er->timedout = 0;
+
+        /*
+         * started now, queued_at 0 if never queued
+         */
+        er->latency_stat = NULL;
+        er->conn_fd = socket;
+        er->replied = 0;
+        if (li->flags & EF_LISTEN_LATENCY) {
+            er->started_at = ef_timer_now();
+            ef_latency_record(&li->stat->queue_wait, queued_at ? er->started_at - queued_at : 0);
+            er->latency_stat = li->stat;
+        }
         // 唤醒协程执行
         ef_coroutine_resume(&rt->co_pool, &er->co, 0);
         return 0;
@@ -75,46 +490,161 @@ inline int ef_routine_run(ef_runtime_t *rt, ef_routine_proc_t proc, int socket)
     return -1;
 }
 
-// 将新建立的客户端连接添加到监听socket的客户端连接队列中
-inline int ef_queue_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd)
+/*
+ * reset the connection, the peer gets ECONNRESET at once instead of
+ * a FIN after it sent the request, and no TIME_WAIT left on our side
+ */
+inline void ef_listen_shed(int fd)
 {
-    ef_queue_fd_t *qf;
-    int retval, flags;
+    struct linger lg = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
 
-    flags = fcntl(fd, F_GETFL);
-    if (!(flags & O_NONBLOCK)) {
-        retval = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-        if (retval < 0) {
-            return retval;
+// 协程池已用尽，停止在监听socket上accept，新连接留在内核的backlog中
+static void ef_listen_disarm(ef_runtime_t *rt, ef_listen_info_t *li)
+{
+    /*
+     * the cancelled accept completes without IORING_CQE_F_MORE,
+     * and is not submitted again while disarmed
+     */
+    if (rt->engine == EF_ENGINE_URING) {
+        if (li->accepting) {
+            ef_listen_cancel(rt, li);
         }
+    } else {
+        rt->p->dissociate(rt->p, li->poll_data.fd, 0, 0);
+    }
+    li->readable = 0;
+    li->disarmed = 1;
+    ++li->stat->disarmed;
+}
+
+// 有协程可用了，恢复accept，先把backlog中积压的连接取出来
+static void ef_listen_rearm(ef_runtime_t *rt, ef_listen_info_t *li)
+{
+    li->disarmed = 0;
+    if (rt->engine == EF_ENGINE_URING) {
+        if (!li->accepting) {
+            ef_listen_accept(rt, li);
+        }
+    } else {
+        rt->p->associate(rt->p, li->poll_data.fd, EF_POLLIN, &li->poll_data, 0);
+        li->readable = 1;
     }
+}
 
-    // 从runtime缓存的空闲ef_queue_fd_t列表中获取一个该对象
-    if (!ef_list_empty(&rt->free_fd_list)) {
-        qf = CAST_PARENT_PTR(ef_list_remove_after(&rt->free_fd_list), ef_queue_fd_t, list_entry);
-    } else {    // runtime没有空闲的ef_queue_fd_t时，就新建，客户端连接断开时，将这个qf加入到runtime的缓存中
-        qf = (ef_queue_fd_t*)malloc(sizeof(ef_queue_fd_t));
+// 将新建立的客户端连接添加到监听socket的客户端连接队列中，EF_LISTEN_INLINE时直接创建协程处理
+inline int ef_queue_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd)
+{
+    ++li->stat->accepted;
+
+    /*
+     * the queued ones first, or they wait for the pool
+     */
+    if ((li->flags & EF_LISTEN_INLINE) && li->head == li->tail &&
+        ef_routine_run(rt, li, fd, 0) >= 0) {
+        return 0;
     }
 
     /*
-     * close the new connection when no memory
+     * only io_uring accepts more than the ring holds, start it now,
+     * or close it if the pool is exhausted too
      */
-    if (!qf) {
-        close(fd);
-        return -1;
+    if (li->tail - li->head > li->ring_mask) {
+        if (ef_routine_run(rt, li, fd, 0) < 0) {
+            ef_listen_shed(fd);
+            ++li->stat->rejected;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (li->queue_millisecs > 0 || (li->flags & EF_LISTEN_LATENCY)) {
+        li->queued_at[li->tail & li->ring_mask] = ef_timer_now();
+    }
+    li->fds[li->tail++ & li->ring_mask] = fd;
+    if (li->tail - li->head > li->stat->queue_max) {
+        li->stat->queue_max = li->tail - li->head;
+    }
+    return 0;
+}
+
+// 在监听socket上accept新连接，最多accept_budget个，预算用完或队列满时返回1，下次事件循环继续
+inline int ef_listen_drain(ef_runtime_t *rt, ef_listen_info_t *li)
+{
+    int budget = li->accept_budget;
+
+    li->round = rt->round;
+    while (budget > 0 && li->tail - li->head <= li->ring_mask) {
+
+        /*
+         * non-blocking and close-on-exec in the same syscall
+         */
+        int socket = accept4(li->poll_data.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                ++li->stat->failed;
+            }
+            rt->p->unset(rt->p, li->poll_data.fd, EF_POLLIN);
+            li->readable = 0;
+            return 0;
+        }
+        ef_queue_fd(rt, li, socket);
+        --budget;
     }
+    return 1;
+}
 
-    qf->fd = fd;
-    // 将新建立的客户端连接添加到监听socket的客户端连接队列中
-    ef_list_insert_before(&li->fd_list, &qf->list_entry);
+// 提交一个accept请求到io_uring，完成时由事件循环处理新连接
+inline int ef_listen_accept(ef_runtime_t *rt, ef_listen_info_t *li)
+{
+    struct io_uring_sqe *sqe = ef_uring_get_sqe(rt->p);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = li->poll_data.fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (unsigned long)&li->poll_data;
+    if (rt->accept_multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    li->accepting = 1;
+    return 0;
+}
 
+// 取消在监听socket上提交的accept请求
+inline int ef_listen_cancel(ef_runtime_t *rt, ef_listen_info_t *li)
+{
+    struct io_uring_sqe *sqe = ef_uring_get_sqe(rt->p);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&li->poll_data;
     return 0;
 }
 
 int ef_init(ef_runtime_t *rt, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink)
 {
-    // 创建多路复用器
-    ef_poll_t *p = ef_create_poll(1024);
+    return ef_init_engine(rt, EF_ENGINE_POLL, stack_size, limit_min, limit_max, shrink_millisecs, count_per_shrink);
+}
+
+int ef_init_engine(ef_runtime_t *rt, int engine, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink)
+{
+    ef_poll_t *p;
+
+    // 创建多路复用器，或基于完成通知的io_uring
+    if (engine == EF_ENGINE_URING) {
+        p = ef_uring_create(1024);
+    } else {
+        p = ef_create_poll(1024);
+    }
     if (!p) {
         return -1;
     }
@@ -126,293 +656,2892 @@ int ef_init(ef_runtime_t *rt, size_t stack_size, int limit_min, int limit_max, i
     ef_runtime = rt;
 
     rt->p = p;
+    rt->engine = engine;
+    rt->accept_multishot = (engine == EF_ENGINE_URING);
+    rt->recv_multishot = (engine == EF_ENGINE_URING);
     rt->stopping = 0;
     rt->shrink_millisecs = shrink_millisecs;
     rt->count_per_shrink = count_per_shrink;
+    rt->release_policy = 0;
+    rt->release_millisecs = 0;
+    rt->release_check = 0;
 
     // 初始化协程池
     if (ef_coroutine_pool_init(&rt->co_pool, stack_size, limit_min, limit_max) < 0) {
         return -1;
     }
+    ef_timer_wheel_init(&rt->timers, ef_timer_now());
     ef_list_init(&rt->listen_list);
-    ef_list_init(&rt->free_fd_list);
+    rt->round = 0;
+    rt->wait_count = 0;
+    rt->event_count = 0;
+    rt->accept_pending = 0;
+    memset(&rt->io_stat, 0, sizeof(rt->io_stat));
+    ef_list_init(&rt->stack_stat_list);
+    ef_list_init(&rt->listen_stat_list);
+    rt->buf_base = NULL;
+    rt->buf_size = 0;
+    rt->buf_count = 0;
+    rt->bufs = NULL;
+    ef_list_init(&rt->free_buf_list);
+    ef_list_init(&rt->free_recv_list);
+    ef_list_init(&rt->nobufs_recv_list);
+    ef_list_init(&rt->free_pipe_list);
+    rt->pipe_count = 0;
+    ef_list_init(&rt->free_bufio_list);
+    rt->bufio_count = 0;
+    for (int cls = 0; cls < EF_ARENA_CLASSES; ++cls) {
+        ef_list_init(&rt->arena_free[cls]);
+    }
+    ef_list_init(&rt->arena_slabs);
+    rt->arena_mapped = 0;
+    rt->arena_used = 0;
+    rt->thread_count = 1;
+    rt->thread_index = 0;
+    rt->runtimes = NULL;
+    rt->started = NULL;
+    rt->steal = 0;
 
     return 0;
 }
 
-// 将新监听socket封装成ef_listen_info_t结构，并链接到ef_runtime_t的监听链表开头
-int ef_add_listen(ef_runtime_t *rt, int socket, ef_routine_proc_t proc)
+int ef_init_stack(ef_runtime_t *rt, size_t commit, size_t grow, int flags)
 {
-    /*
-     * set the listen socket in non-block mode
-     */
-    int retval = fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
-    if (retval < 0) {
-        return retval;
-    }
+    return ef_coroutine_pool_set_stack(&rt->co_pool, commit, grow, flags);
+}
 
-    // 将新监听socket封装成ef_listen_info_t结构
-    ef_listen_info_t *li = (ef_listen_info_t*)malloc(sizeof(ef_listen_info_t));
-    if (li == NULL) {
+int ef_init_stack_release(ef_runtime_t *rt, int policy, int millisecs, int advice)
+{
+    if (policy < EF_STACK_RELEASE_NOW || policy > EF_STACK_RELEASE_PRESSURE || millisecs < 0) {
+        errno = EINVAL;
         return -1;
     }
+    rt->release_policy = policy;
+    rt->release_millisecs = millisecs;
+    rt->release_check = 0;
+    ef_coroutine_pool_set_release(&rt->co_pool, advice, policy == EF_STACK_RELEASE_NOW);
+    return 0;
+}
 
-    li->poll_data.type = FD_TYPE_LISTEN;
-    li->poll_data.fd = socket;
-    li->poll_data.routine_ptr = NULL;
-    li->poll_data.runtime_ptr = rt;
-    li->ef_proc = proc;
-
-    ef_list_init(&li->fd_list);
-    // 使用ef_listen_info_t结构中的list_entry结构将其链接到ef_runtime_t的监听链表开头
-    ef_list_insert_after(&rt->listen_list, &li->list_entry);
+/*
+ * MemAvailable below EF_STACK_PRESSURE percent of MemTotal
+ */
+static int ef_memory_pressure(void)
+{
+    char buf[4096];
+    char *total, *avail;
+    ssize_t len;
+    int fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+    total = strstr(buf, "MemTotal:");
+    avail = strstr(buf, "MemAvailable:");
+    if (!total || !avail) {
+        return 0;
+    }
+    return strtoull(avail + 13, NULL, 10) * 100 < strtoull(total + 9, NULL, 10) * EF_STACK_PRESSURE;
+}
 
-    return 0;
+int ef_init_shared_stacks(ef_runtime_t *rt, int count)
+{
+    return ef_coroutine_pool_share(&rt->co_pool, count);
 }
 
-int ef_run_loop(ef_runtime_t *rt)
+int ef_init_buffers(ef_runtime_t *rt, int count, size_t size)
 {
-    ef_event_t evts[1024];
+    if (rt->bufs || count <= 0 || size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
     /*
-     * add all listen socket fds to poll object
+     * the buffer ring of io_uring needs power of 2
      */
-    // 将所有socket的监听事件添加到IO多路复用器中
-    ef_list_entry_t *ent = ef_list_entry_after(&rt->listen_list);
-    while (ent != &rt->listen_list) {
-        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
-        int ret = rt->p->associate(rt->p, li->poll_data.fd, EF_POLLIN, &li->poll_data, 0);
-        if (ret < 0) {
-            return ret;
-        }
-        ent = ef_list_entry_after(ent);
+    count = (int)ef_resize(count, 1);
+
+    /*
+     * physical pages committed only when the buffer used
+     */
+    rt->buf_base = (char *)mmap(NULL, size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (rt->buf_base == MAP_FAILED) {
+        rt->buf_base = NULL;
+        return -1;
+    }
+
+    rt->bufs = (ef_buffer_t *)calloc(count, sizeof(ef_buffer_t));
+    if (!rt->bufs) {
+        goto failed;
+    }
+    rt->buf_size = size;
+    rt->buf_count = count;
+
+    if (rt->engine == EF_ENGINE_URING) {
+        if (ef_uring_setup_buffers(rt->p, EF_BUFFER_GROUP, rt->buf_base, count, (int)size) < 0) {
+            goto failed;
+        }
+    } else {
+        for (int idx = count - 1; idx >= 0; --idx) {
+            ef_list_insert_after(&rt->free_buf_list, &rt->bufs[idx].list_entry);
+        }
+    }
+    return 0;
+
+failed:
+    free(rt->bufs);
+    munmap(rt->buf_base, size * count);
+    rt->bufs = NULL;
+    rt->buf_base = NULL;
+    rt->buf_size = 0;
+    rt->buf_count = 0;
+    return -1;
+}
+
+// 将新的ef_listen_info_t结构初始化后链接到ef_runtime_t的监听链表开头
+static int ef_listen_add(ef_runtime_t *rt, int socket, int type, ef_routine_proc_t proc, int accept_budget, int flags)
+{
+    unsigned int ring_size;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    /*
+     * the ring holds a few rounds, io_uring completions may exceed the budget
+     */
+    ring_size = (unsigned int)ef_resize((size_t)accept_budget * 4, 256);
+
+    ef_listen_info_t *li = (ef_listen_info_t*)malloc(sizeof(ef_listen_info_t) + (sizeof(int) + sizeof(long long)) * ring_size);
+    if (li == NULL) {
+        return -1;
+    }
+
+    li->poll_data.type = type;
+    li->poll_data.fd = socket;
+    li->poll_data.routine_ptr = NULL;
+    li->poll_data.runtime_ptr = rt;
+    li->ef_proc = proc;
+    li->accept_budget = accept_budget;
+    li->flags = flags;
+    li->readable = 0;
+    li->round = 0;
+    li->ring_mask = ring_size - 1;
+    li->head = 0;
+    li->tail = 0;
+    li->overload = EF_OVERLOAD_QUEUE;
+    li->queue_millisecs = 0;
+    li->disarmed = 0;
+    li->accepting = 0;
+    li->queued_at = (long long *)&li->fds[ring_size];
+    li->stack_stat = ef_stack_stat_get(rt, proc);
+    li->stat = li->stack_stat ? ef_listen_stat_new(rt, socket) : NULL;
+    if (li->stat == NULL) {
+        free(li);
+        return -1;
+    }
+    if (socket >= 0 && getsockname(socket, (struct sockaddr *)&addr, &addrlen) == 0) {
+        if (addr.ss_family == AF_INET) {
+            li->stat->port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        } else if (addr.ss_family == AF_INET6) {
+            li->stat->port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+        }
+    }
+
+    // 使用ef_listen_info_t结构中的list_entry结构将其链接到ef_runtime_t的监听链表开头
+    ef_list_insert_after(&rt->listen_list, &li->list_entry);
+
+    return 0;
+}
+
+int ef_add_listen(ef_runtime_t *rt, int socket, ef_routine_proc_t proc)
+{
+    return ef_add_listen_ex(rt, socket, proc, EF_ACCEPT_BUDGET, 0);
+}
+
+// 将新监听socket封装成ef_listen_info_t结构，并链接到ef_runtime_t的监听链表开头
+int ef_add_listen_ex(ef_runtime_t *rt, int socket, ef_routine_proc_t proc, int accept_budget, int flags)
+{
+    int type = SOCK_STREAM;
+    socklen_t optlen = sizeof(type);
+
+    if (accept_budget <= 0) {
+        accept_budget = EF_ACCEPT_BUDGET;
+    }
+
+    /*
+     * set the listen socket in non-block mode
+     */
+    int retval = fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /*
+     * no connection on a datagram socket, a routine owns it
+     */
+    getsockopt(socket, SOL_SOCKET, SO_TYPE, &type, &optlen);
+    return ef_listen_add(rt, socket, (type == SOCK_DGRAM) ? FD_TYPE_DGRAM : FD_TYPE_LISTEN, proc, accept_budget, flags);
+}
+
+int ef_add_routine(ef_runtime_t *rt, ef_routine_proc_t proc, int count, int flags)
+{
+    if (count <= 0) {
+        return 0;
+    }
+
+    /*
+     * no fd to accept from, the routines are started when the loop runs,
+     * the budget records how many, they never run inline
+     */
+    return ef_listen_add(rt, -1, FD_TYPE_TASK, proc, count, flags & ~EF_LISTEN_INLINE);
+}
+
+int ef_listen_overload(ef_runtime_t *rt, int socket, int policy, int queue_millisecs)
+{
+    ef_list_entry_t *ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list && socket >= 0) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        if (li->poll_data.fd == socket) {
+            li->overload = policy;
+            li->queue_millisecs = (queue_millisecs > 0) ? queue_millisecs : 0;
+            return 0;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+    return -1;
+}
+
+int ef_init_threads(ef_runtime_t *rt, int nthreads, int steal)
+{
+    int idx;
+
+    if (nthreads <= 1) {
+        return 0;
+    }
+
+    rt->runtimes = (ef_runtime_t **)calloc(nthreads, sizeof(ef_runtime_t *));
+    rt->started = (sem_t *)malloc(sizeof(sem_t));
+    if (!rt->runtimes || !rt->started || sem_init(rt->started, 0, 0) < 0) {
+        goto failed;
+    }
+
+    rt->runtimes[0] = rt;
+    for (idx = 1; idx < nthreads; ++idx) {
+        rt->runtimes[idx] = (ef_runtime_t *)calloc(1, sizeof(ef_runtime_t));
+        if (!rt->runtimes[idx]) {
+            goto failed;
+        }
+        rt->runtimes[idx]->thread_index = idx;
+        rt->runtimes[idx]->runtimes = rt->runtimes;
+    }
+
+    /*
+     * a routine may be resumed by other threads only if the poller keeps
+     * no fd state, all set up here before any thread runs
+     */
+    if (steal && rt->engine == EF_ENGINE_POLL && rt->p->migratable) {
+        for (idx = 0; idx < nthreads; ++idx) {
+            ef_runtime_t *peer = rt->runtimes[idx];
+            peer->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (peer->wake_fd < 0) {
+                while (--idx >= 0) {
+                    close(rt->runtimes[idx]->wake_fd);
+                    pthread_mutex_destroy(&rt->runtimes[idx]->ready_lock);
+                    rt->runtimes[idx]->steal = 0;
+                }
+                goto failed;
+            }
+            pthread_mutex_init(&peer->ready_lock, NULL);
+            ef_list_init(&peer->ready_list);
+            ef_list_init(&peer->remote_free_list);
+            peer->ready_count = 0;
+            peer->idle = 0;
+            peer->foreign = 0;
+            peer->wake_data.type = FD_TYPE_WAKE;
+            peer->wake_data.fd = peer->wake_fd;
+            peer->wake_data.routine_ptr = NULL;
+            peer->wake_data.runtime_ptr = peer;
+            peer->wake_data.ef_proc = NULL;
+            peer->steal = 1;
+        }
+    }
+
+    rt->thread_count = nthreads;
+    return 0;
+
+failed:
+    if (rt->runtimes) {
+        for (idx = 1; idx < nthreads; ++idx) {
+            free(rt->runtimes[idx]);
+        }
+        free(rt->runtimes);
+        rt->runtimes = NULL;
+    }
+    free(rt->started);
+    rt->started = NULL;
+    return -1;
+}
+
+// 为其他线程复制监听socket，设置了SO_REUSEPORT的创建新socket绑定到同一地址，由内核在各线程间分发连接，否则共享同一个socket
+static int ef_listen_replicate(int sockfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr), optlen = sizeof(int);
+    int domain, type, protocol, reuse = 0, fd;
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, &optlen) < 0 || !reuse ||
+        getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &optlen) < 0 ||
+        getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0 ||
+        getsockopt(sockfd, SOL_SOCKET, SO_PROTOCOL, &protocol, &optlen) < 0 ||
+        getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0) {
+        return dup(sockfd);
+    }
+
+    fd = socket(domain, type | SOCK_CLOEXEC, protocol);
+    if (fd < 0) {
+        return dup(sockfd);
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, len) < 0 ||
+        (type != SOCK_DGRAM && listen(fd, SOMAXCONN) < 0)) {
+        close(fd);
+        return dup(sockfd);
+    }
+    return fd;
+}
+
+static int ef_run_loop_thread(ef_runtime_t *rt);
+
+static void *ef_thread_proc(void *param)
+{
+    ef_runtime_t *rt = (ef_runtime_t *)param;
+    ef_runtime_t **runtimes = rt->runtimes;
+    ef_runtime_t *first = runtimes[0];
+    int idx = rt->thread_index;
+    int failed = 0;
+
+    /*
+     * init on the thread itself, the sched and the sigaltstack are per thread
+     */
+    if (ef_init_engine(rt, first->engine, first->co_pool.stack_size, first->co_pool.limit_min,
+        first->co_pool.limit_max, first->shrink_millisecs, first->count_per_shrink) < 0) {
+        failed = 1;
+    } else {
+        rt->thread_count = first->thread_count;
+        rt->thread_index = idx;
+        rt->runtimes = runtimes;
+        rt->steal = first->steal;
+        ef_coroutine_pool_set_stack(&rt->co_pool, first->co_pool.fiber_sched.stack_commit,
+            first->co_pool.fiber_sched.stack_grow, first->co_pool.fiber_sched.stack_flags);
+        if (first->bufs && ef_init_buffers(rt, first->buf_count, first->buf_size) < 0) {
+            failed = 1;
+        }
+        if (first->co_pool.shared_count && ef_init_shared_stacks(rt, first->co_pool.shared_count) < 0) {
+            failed = 1;
+        }
+        if (first->release_policy && ef_init_stack_release(rt, first->release_policy,
+            first->release_millisecs, first->co_pool.release_advice) < 0) {
+            failed = 1;
+        }
+    }
+
+    /*
+     * the first runtime waits for us, its listen list not changed now
+     */
+    ef_list_entry_t *ent = ef_list_entry_before(&first->listen_list);
+    while (!failed && ent != &first->listen_list) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        if (li->poll_data.type == FD_TYPE_TASK) {
+            if (ef_add_routine(rt, li->ef_proc, li->accept_budget, li->flags) < 0) {
+                failed = 1;
+            }
+            ent = ef_list_entry_before(ent);
+            continue;
+        }
+        int fd = ef_listen_replicate(li->poll_data.fd);
+        if (fd < 0 || ef_add_listen_ex(rt, fd, li->ef_proc, li->accept_budget, li->flags) < 0) {
+            failed = 1;
+        } else {
+            ef_listen_overload(rt, fd, li->overload, li->queue_millisecs);
+            CAST_PARENT_PTR(ef_list_entry_after(&rt->listen_list), ef_listen_info_t, list_entry)->stat->socket = li->stat->socket;
+        }
+        ent = ef_list_entry_before(ent);
+    }
+
+    if (failed) {
+        first->stopping = 1;
+    }
+
+    sem_post(first->started);
+
+    if (!failed) {
+        ef_run_loop_thread(rt);
+    }
+    return NULL;
+}
+
+int ef_run_loop(ef_runtime_t *rt)
+{
+    int retval, idx, count;
+
+    if (rt->thread_count <= 1) {
+        return ef_run_loop_thread(rt);
+    }
+
+    for (idx = 1; idx < rt->thread_count; ++idx) {
+        if (pthread_create(&rt->runtimes[idx]->thread, NULL, ef_thread_proc, rt->runtimes[idx]) != 0) {
+            rt->stopping = 1;
+            break;
+        }
+    }
+    count = idx;
+
+    /*
+     * wait all the others initialized, they read our listen list
+     */
+    for (idx = 1; idx < count; ++idx) {
+        sem_wait(rt->started);
+    }
+
+    retval = ef_run_loop_thread(rt);
+
+    /*
+     * the others stop as well, when the first stopped
+     */
+    for (idx = 1; idx < count; ++idx) {
+        rt->runtimes[idx]->stopping = 1;
+    }
+    for (idx = 1; idx < count; ++idx) {
+        pthread_join(rt->runtimes[idx]->thread, NULL);
+    }
+
+    /*
+     * the others may touch our ready list until they stopped
+     */
+    if (rt->steal) {
+        for (idx = 0; idx < rt->thread_count; ++idx) {
+            close(rt->runtimes[idx]->wake_fd);
+            pthread_mutex_destroy(&rt->runtimes[idx]->ready_lock);
+        }
+    }
+
+    return retval;
+}
+
+/*
+ * wake the runtime if it is blocked in the poller, return 1 if woken
+ */
+static int ef_runtime_wake(ef_runtime_t *rt)
+{
+    int idle = 1;
+    if (__atomic_compare_exchange_n(&rt->idle, &idle, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        eventfd_write(rt->wake_fd, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * put the fired routines to the ready list, wake an idle thread to steal
+ * if there are more than we can run right now
+ */
+static void ef_runtime_ready(ef_runtime_t *rt, ef_list_entry_t *ready, int count)
+{
+    ef_list_entry_t *ent;
+    int total;
+
+    pthread_mutex_lock(&rt->ready_lock);
+    while ((ent = ef_list_remove_after(ready)) != NULL) {
+        ef_list_insert_before(&rt->ready_list, ent);
+    }
+    total = __atomic_add_fetch(&rt->ready_count, count, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&rt->ready_lock);
+
+    if (total > 1) {
+        for (int idx = 0; idx < rt->thread_count; ++idx) {
+            if (rt->runtimes[idx] != rt && ef_runtime_wake(rt->runtimes[idx])) {
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * take one routine from the ready list, one at a time so that
+ * the others can steal the rest while we are running it
+ */
+static ef_routine_t *ef_runtime_next(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent = NULL;
+
+    if (__atomic_load_n(&rt->ready_count, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&rt->ready_lock);
+        ent = ef_list_remove_after(&rt->ready_list);
+        if (ent) {
+            __atomic_sub_fetch(&rt->ready_count, 1, __ATOMIC_SEQ_CST);
+        }
+        pthread_mutex_unlock(&rt->ready_lock);
+    }
+    return ent ? CAST_PARENT_PTR(ent, ef_routine_t, ready_entry) : NULL;
+}
+
+/*
+ * take half of the ready routines from the busiest thread, the stolen
+ * routines wait on our poller from now on
+ */
+static int ef_runtime_steal(ef_runtime_t *rt)
+{
+    ef_runtime_t *victim = NULL;
+    ef_list_entry_t stolen, *ent;
+    int most = 1, count, total = 0;
+
+    for (int idx = 0; idx < rt->thread_count; ++idx) {
+        ef_runtime_t *peer = rt->runtimes[idx];
+        count = __atomic_load_n(&peer->ready_count, __ATOMIC_SEQ_CST);
+        if (peer != rt && count > most) {
+            most = count;
+            victim = peer;
+        }
+    }
+    if (!victim) {
+        return 0;
+    }
+
+    /*
+     * from the tail, the head will be run by the victim soon
+     */
+    ef_list_init(&stolen);
+    pthread_mutex_lock(&victim->ready_lock);
+    count = victim->ready_count / 2;
+    ent = ef_list_entry_before(&victim->ready_list);
+    while (count > 0 && ent != &victim->ready_list) {
+        ef_routine_t *er = CAST_PARENT_PTR(ent, ef_routine_t, ready_entry);
+        ent = ef_list_entry_before(ent);
+        if (er->borrowed) {
+            continue;
+        }
+        ef_list_remove(&er->ready_entry);
+        ef_list_insert_after(&stolen, &er->ready_entry);
+        --count;
+        ++total;
+    }
+    __atomic_sub_fetch(&victim->ready_count, total, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&victim->ready_lock);
+
+    if (total == 0) {
+        return 0;
+    }
+
+    ent = ef_list_entry_after(&stolen);
+    while (ent != &stolen) {
+        ef_routine_t *er = CAST_PARENT_PTR(ent, ef_routine_t, ready_entry);
+        ent = ef_list_entry_after(ent);
+        if (er->co.pool != &victim->co_pool) {
+            __atomic_sub_fetch(&victim->foreign, 1, __ATOMIC_SEQ_CST);
+        }
+        if (er->co.pool != &rt->co_pool) {
+            __atomic_add_fetch(&rt->foreign, 1, __ATOMIC_SEQ_CST);
+        }
+        er->poll_data.runtime_ptr = rt;
+    }
+
+    pthread_mutex_lock(&rt->ready_lock);
+    while ((ent = ef_list_remove_after(&stolen)) != NULL) {
+        ef_list_insert_before(&rt->ready_list, ent);
+    }
+    __atomic_add_fetch(&rt->ready_count, total, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&rt->ready_lock);
+
+    rt->io_stat.steal_count += total;
+    return total;
+}
+
+/*
+ * resume a ready routine, the one exited here but owned by
+ * other thread is given back to its owner
+ */
+static void ef_runtime_resume(ef_runtime_t *rt, ef_routine_t *er)
+{
+    ef_coroutine_resume(&rt->co_pool, &er->co, er->ready_events);
+
+    if (ef_fiber_is_exited(&er->co.fiber) && er->co.pool != &rt->co_pool) {
+        ef_runtime_t *owner = CAST_PARENT_PTR(er->co.pool, ef_runtime_t, co_pool);
+        pthread_mutex_lock(&owner->ready_lock);
+        ef_list_insert_before(&owner->remote_free_list, &er->co.free_entry);
+        pthread_mutex_unlock(&owner->ready_lock);
+        __atomic_sub_fetch(&rt->foreign, 1, __ATOMIC_SEQ_CST);
+        ef_runtime_wake(owner);
+    }
+}
+
+/*
+ * put our routines exited on other threads back to the pool
+ */
+static void ef_runtime_reclaim(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent;
+
+    pthread_mutex_lock(&rt->ready_lock);
+    while ((ent = ef_list_remove_after(&rt->remote_free_list)) != NULL) {
+        ef_coroutine_release(&rt->co_pool, CAST_PARENT_PTR(ent, ef_coroutine_t, free_entry));
+    }
+    pthread_mutex_unlock(&rt->ready_lock);
+}
+
+/*
+ * block until the next timer, wake up periodically only if the pool
+ * needs shrinking, or the others may be told to stop without a signal
+ */
+static long long ef_runtime_timeout(ef_runtime_t *rt, long long now)
+{
+    long long nanosecs = ef_timer_wheel_next(&rt->timers, now);
+    long long period = -1;
+    ef_list_entry_t *ent;
+
+    /*
+     * connections left in the backlog when the budget ran out
+     */
+    if (rt->accept_pending) {
+        return 0;
+    }
+
+    if (rt->thread_count > 1 || rt->stopping) {
+        period = 1000 * 1000000LL;
+    }
+    if (rt->co_pool.free_count > 0 && rt->co_pool.full_count > rt->co_pool.limit_min &&
+        (period < 0 || period > rt->shrink_millisecs * 1000000LL)) {
+        period = rt->shrink_millisecs * 1000000LL;
+    }
+
+    /*
+     * pooled routines with their stack pages not given back yet
+     */
+    if (rt->release_policy > EF_STACK_RELEASE_NOW &&
+        rt->co_pool.free_count - rt->co_pool.shared_free_count - rt->co_pool.released_count > 0 &&
+        (period < 0 || period > rt->release_millisecs * 1000000LL)) {
+        period = rt->release_millisecs * 1000000LL;
+    }
+
+    /*
+     * the queued connections to reset when waited too long
+     */
+    ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        if (li->queue_millisecs > 0 && li->head != li->tail) {
+            long long left = li->queued_at[li->head & li->ring_mask] + li->queue_millisecs * 1000000LL - now;
+            if (left < 0) {
+                left = 0;
+            }
+            if (period < 0 || period > left) {
+                period = left;
+            }
+        }
+        ent = ef_list_entry_after(ent);
+    }
+
+    if (period >= 0 && (nanosecs < 0 || nanosecs > period)) {
+        nanosecs = period;
+    }
+    return nanosecs;
+}
+
+static int ef_run_loop_thread(ef_runtime_t *rt)
+{
+    ef_event_t evts[1024];
+    ef_timer_t *t;
+
+    /*
+     * add all listen socket fds to poll object
+     */
+    // 将所有socket的监听事件添加到IO多路复用器中
+    ef_list_entry_t *ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        int ret;
+        if (li->poll_data.type == FD_TYPE_DGRAM) {
+
+            /*
+             * the routine closes its own dup, the listen one closed when stopping
+             */
+            int fd = fcntl(li->poll_data.fd, F_DUPFD_CLOEXEC, 0);
+            ret = (fd < 0) ? fd : ef_routine_run(rt, li, fd, 0);
+            if (ret < 0 && fd >= 0) {
+                close(fd);
+            }
+        } else if (li->poll_data.type == FD_TYPE_TASK) {
+            ret = 0;
+            for (int n = 0; n < li->accept_budget && ret == 0; ++n) {
+                ret = ef_routine_run(rt, li, -1, 0);
+            }
+        } else if (rt->engine == EF_ENGINE_URING) {
+            ret = ef_listen_accept(rt, li);
+        } else {
+            ret = rt->p->associate(rt->p, li->poll_data.fd, EF_POLLIN, &li->poll_data, 0);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+
+    if (rt->steal && rt->p->associate(rt->p, rt->wake_fd, EF_POLLIN, &rt->wake_data, 0) < 0) {
+        return -1;
+    }
+
+    /*
+     * the main event loop
+     */
+    // 事件主循环
+    while (1) {
+        ef_list_entry_t ready;
+        int nready = 0;
+        long long nanosecs = ef_runtime_timeout(rt, ef_timer_now());
+
+        /*
+         * mark idle before the last look at the others, so that
+         * no ready routine left behind while we are blocked
+         */
+        if (rt->steal) {
+            ef_runtime_reclaim(rt);
+            __atomic_store_n(&rt->idle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&rt->ready_count, __ATOMIC_SEQ_CST) > 0 || ef_runtime_steal(rt) > 0) {
+                __atomic_store_n(&rt->idle, 0, __ATOMIC_SEQ_CST);
+                nanosecs = 0;
+            }
+            ef_list_init(&ready);
+        }
+
+        // 获取就绪的事件，一次最多获取1024个，最多阻塞到最近的定时器到期
+        int cnt = rt->p->wait(rt->p, &evts[0], 1024, nanosecs);
+        ++rt->wait_count;
+        if (cnt > 0) {
+            rt->event_count += cnt;
+        }
+        if (rt->steal) {
+            __atomic_store_n(&rt->idle, 0, __ATOMIC_SEQ_CST);
+        }
+        if (cnt < 0 && errno != EINTR) {
+            return cnt;
+        }
+
+        /*
+         * check all events returned by poll wait function
+         */
+        for (int i = 0; i < cnt; ++i) {
+            ef_poll_data_t *ed = (ef_poll_data_t*)evts[i].ptr;
+            if (ed->type == FD_TYPE_LISTEN && rt->engine == EF_ENGINE_URING) {
+                ef_listen_info_t *li = CAST_PARENT_PTR(ed, ef_listen_info_t, poll_data);
+
+                /*
+                 * the result of accept is the new connection, the listen
+                 * socket closed when stopping, drop it and no more accept
+                 */
+                if (evts[i].events >= 0) {
+                    if (ed->fd < 0) {
+                        close(evts[i].events);
+                    } else {
+                        ef_queue_fd(rt, li, evts[i].events);
+                    }
+                } else if (evts[i].events == -EINVAL && rt->accept_multishot) {
+                    /*
+                     * multishot accept needs linux 5.19
+                     */
+                    rt->accept_multishot = 0;
+                } else if (evts[i].events != -ECANCELED && ed->fd >= 0) {
+                    ++li->stat->failed;
+                }
+
+                /*
+                 * multishot accept keeps armed until no IORING_CQE_F_MORE
+                 */
+                if (!(evts[i].flags & IORING_CQE_F_MORE)) {
+                    li->accepting = 0;
+                    if (ed->fd >= 0 && !li->disarmed) {
+                        ef_listen_accept(rt, li);
+                    }
+                }
+            } else if (ed->type == FD_TYPE_LISTEN) {   // 事件类型为连接
+                ef_listen_info_t *li = CAST_PARENT_PTR(ed, ef_listen_info_t, poll_data);
+
+                /*
+                 * put new connections to queue, at most accept_budget of them
+                 */
+                // 将新建立的客户端连接添加到监听socket的客户端连接队列中
+                li->readable = 1;
+                ef_listen_drain(rt, li);
+
+                /*
+                 * solaris event port will auto dissociate fd after event fired
+                 */
+                rt->p->associate(rt->p, ed->fd, EF_POLLIN, ed, 1);
+            } else if (ed->type == FD_TYPE_RECV) { // multishot recv收到数据
+                ef_recv_fired(rt, CAST_PARENT_PTR(ed, ef_recv_state_t, poll_data), evts[i].events, evts[i].flags);
+            } else if (ed->type == FD_TYPE_RWC && rt->steal) {
+                /*
+                 * the routine may be resumed by other thread, dissociate here
+                 */
+                rt->p->dissociate(rt->p, ed->fd, 1, 0);
+                ef_timer_del(&rt->timers, &ed->routine_ptr->timer);
+                ed->routine_ptr->ready_events = evts[i].events;
+                ef_list_insert_before(&ready, &ed->routine_ptr->ready_entry);
+                ++nready;
+            } else if (ed->type == FD_TYPE_RWC) { // 事件类型为读写
+                //从协程池中获取一个协程去处理客户端连接的事件
+                ef_coroutine_resume(&rt->co_pool, &ed->routine_ptr->co, evts[i].events);
+            } else if (ed->type == FD_TYPE_WAKE) {
+                eventfd_t value;
+                eventfd_read(rt->wake_fd, &value);
+            }
+        }
+
+        /*
+         * wake up the routines timed out, or the sleeping ones
+         */
+        while ((t = ef_timer_wheel_expire(&rt->timers, ef_timer_now())) != NULL) {
+            ef_routine_t *er = CAST_PARENT_PTR(t, ef_routine_t, timer);
+            er->timedout = 1;
+            if (rt->steal) {
+                if (er->poll_data.fd >= 0) {
+                    rt->p->dissociate(rt->p, er->poll_data.fd, 1, 0);
+                }
+                er->ready_events = 0;
+                ef_list_insert_before(&ready, &er->ready_entry);
+                ++nready;
+            } else {
+                ef_coroutine_resume(&rt->co_pool, &er->co, 0);
+            }
+        }
+
+        /*
+         * run the fired and stolen routines
+         */
+        if (rt->steal) {
+            ef_routine_t *er;
+            if (nready > 0) {
+                ef_runtime_ready(rt, &ready, nready);
+            }
+            while ((er = ef_runtime_next(rt)) != NULL) {
+                ef_runtime_resume(rt, er);
+            }
+        }
+
+        // 刚监听之后，还没建立过客户端连接时，第一次创建客户端连接时，还没有协程被创建，所以协程池中没有可用协程，需要创建协程去处理新建的连接
+        /*
+         * handle queued connections
+         */
+        ent = ef_list_entry_after(&rt->listen_list);
+        rt->accept_pending = 0;
+
+        /*
+         * every listening sockets
+         */
+        while (ent != &rt->listen_list) {
+
+            ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+            long long now = li->queue_millisecs > 0 ? ef_timer_now() : 0;
+            int exhausted = 0;
+            ent = ef_list_entry_after(ent);
+
+            /*
+             * a routine exited since the pool was exhausted
+             */
+            if (li->disarmed && li->poll_data.fd >= 0 &&
+                (rt->co_pool.free_count > 0 || rt->co_pool.full_count < rt->co_pool.limit_max)) {
+                ef_listen_rearm(rt, li);
+            }
+
+            /*
+             * edge triggered pollers will not report the rest of the backlog again
+             */
+            if (li->readable && li->round != rt->round && li->poll_data.fd >= 0) {
+                ef_listen_drain(rt, li);
+            }
+
+            /*
+             * every queued connection
+             */
+            while (li->head != li->tail) {
+                unsigned int idx = li->head & li->ring_mask;
+
+                /*
+                 * the client likely gave up already, the ones behind are newer
+                 */
+                if (li->queue_millisecs > 0 && now - li->queued_at[idx] >= li->queue_millisecs * 1000000LL) {
+                    ef_listen_shed(li->fds[idx]);
+                    ++li->stat->expired;
+                    ++li->head;
+                    continue;
+                }
+
+                // 创建新的协程处理新建的客户端连接
+                int ret = ef_routine_run(rt, li, li->fds[idx], (li->flags & EF_LISTEN_LATENCY) ? li->queued_at[idx] : 0);
+                if (ret < 0) {
+                    exhausted = 1;
+                    break;
+                }
+                ++li->head;
+            }
+
+            /*
+             * the pool reached limit_max, the overload policy of the listener
+             */
+            if (exhausted && li->overload == EF_OVERLOAD_REJECT) {
+                while (li->head != li->tail) {
+                    ef_listen_shed(li->fds[li->head++ & li->ring_mask]);
+                    ++li->stat->rejected;
+                }
+            } else if (exhausted && li->overload == EF_OVERLOAD_DISARM && !li->disarmed && li->poll_data.fd >= 0) {
+                ef_listen_disarm(rt, li);
+            }
+
+            if (li->readable && li->poll_data.fd >= 0 && li->tail - li->head <= li->ring_mask) {
+                rt->accept_pending = 1;
+            }
+        }
+        ++rt->round;
+
+        // 事件循环停止
+        if (rt->stopping) {
+
+            /*
+             * tell the other threads
+             */
+            if (rt->thread_index == 0 && rt->runtimes) {
+                for (int idx = 1; idx < rt->thread_count; ++idx) {
+                    rt->runtimes[idx]->stopping = 1;
+                }
+            }
+
+            /*
+             * close all listening socket
+             */
+            if (!ef_list_empty(&rt->listen_list)) {
+
+                ent = ef_list_entry_after(&rt->listen_list);
+
+                while (ent != &rt->listen_list) {
+
+                    ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+                    ent = ef_list_entry_after(ent);
+
+                    /*
+                     * close listening socket
+                     */
+                    if (li->poll_data.fd >= 0 && li->poll_data.type == FD_TYPE_DGRAM) {
+
+                        /*
+                         * wake up the routine on it, ef_routine_recvmmsg returns 0 when stopping
+                         */
+                        shutdown(li->poll_data.fd, SHUT_RD);
+                    } else if (li->poll_data.fd >= 0) {
+                        rt->p->dissociate(rt->p, li->poll_data.fd, 0, 1);
+                        if (rt->engine == EF_ENGINE_URING) {
+                            ef_listen_cancel(rt, li);
+                        }
+                    }
+                    if (li->poll_data.fd >= 0) {
+                        close(li->poll_data.fd);
+                        li->poll_data.fd = -1;
+                    }
+
+                    /*
+                     * free listen info if connection queue empty,
+                     * io_uring may still complete the cancelled accept
+                     */
+                    if (li->head == li->tail && rt->engine != EF_ENGINE_URING) {
+                        ef_list_remove(&li->list_entry);
+                        free(li);
+                    }
+                }
+            }
+
+            /*
+             * destroy the unused multishot recv state
+             */
+            ent = ef_list_remove_after(&rt->free_recv_list);
+            while (ent != NULL) {
+                free(CAST_PARENT_PTR(ent, ef_recv_state_t, list_entry));
+                ent = ef_list_remove_after(&rt->free_recv_list);
+            }
+
+            /*
+             * close the cached pipes
+             */
+            ent = ef_list_remove_after(&rt->free_pipe_list);
+            while (ent != NULL) {
+                ef_pipe_t *pp = CAST_PARENT_PTR(ent, ef_pipe_t, list_entry);
+                close(pp->fds[0]);
+                close(pp->fds[1]);
+                free(pp);
+                ent = ef_list_remove_after(&rt->free_pipe_list);
+            }
+            rt->pipe_count = 0;
+
+            /*
+             * free the cached bufio
+             */
+            ent = ef_list_remove_after(&rt->free_bufio_list);
+            while (ent != NULL) {
+                free(CAST_PARENT_PTR(ent, ef_bufio_t, list_entry));
+                ent = ef_list_remove_after(&rt->free_bufio_list);
+            }
+            rt->bufio_count = 0;
+
+            /*
+             * shrink coroutine pool, to free
+             */
+            if (rt->co_pool.free_count == rt->co_pool.full_count &&
+                (!rt->steal || __atomic_load_n(&rt->foreign, __ATOMIC_SEQ_CST) == 0)) {
+                rt->p->free(rt->p);
+                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.full_count);
+                ef_coroutine_pool_unshare(&rt->co_pool);
+
+                /*
+                 * no more completions after poll object freed
+                 */
+                ent = ef_list_remove_after(&rt->listen_list);
+                while (ent != NULL) {
+                    free(CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry));
+                    ent = ef_list_remove_after(&rt->listen_list);
+                }
+                if (rt->bufs) {
+                    munmap(rt->buf_base, rt->buf_size * rt->buf_count);
+                    free(rt->bufs);
+                    rt->bufs = NULL;
+                }
+
+                /*
+                 * no buffer borrowed after all the routines exited
+                 */
+                ef_arena_unmap(rt);
+                break;
+            } else {
+                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.free_count);
+            }
+        }
+
+        if (rt->co_pool.free_count > 0 && rt->co_pool.full_count > rt->co_pool.limit_min) {
+            ef_coroutine_pool_shrink(&rt->co_pool, rt->shrink_millisecs, rt->count_per_shrink);
+        }
+
+        /*
+         * give back the stack pages, the routines stay in the pool
+         */
+        if (rt->release_policy > EF_STACK_RELEASE_NOW &&
+            rt->co_pool.free_count - rt->co_pool.shared_free_count - rt->co_pool.released_count > 0) {
+            if (rt->release_policy == EF_STACK_RELEASE_IDLE) {
+                ef_coroutine_pool_release(&rt->co_pool, rt->release_millisecs, 0);
+            } else {
+                long long now = ef_timer_now();
+                if (now >= rt->release_check) {
+                    rt->release_check = now + rt->release_millisecs * 1000000LL;
+                    if (ef_memory_pressure()) {
+                        ef_coroutine_pool_release(&rt->co_pool, 0, 0);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * park the routine until the fd fired, the last try on the fd returned EAGAIN,
+ * return the fired events, or -1 if failed to associate
+ */
+inline long ef_routine_wait(ef_routine_t *er, int fd, int events)
+{
+    ef_poll_t *p = er->poll_data.runtime_ptr->p;
+    long retval;
+
+    if (er->deadline && ef_timer_now() >= er->deadline) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = fd;
+
+    /*
+     * the fired events have been consumed by the EAGAIN try
+     */
+    p->unset(p, fd, (events & EF_POLLIN) ? (events | EF_POLLHUP) : events);
+
+    retval = p->associate(p, fd, events, &er->poll_data, 0);
+    if (retval < 0) {
+        return retval;
+    } else if (retval > 0) {
+        retval = events;
+    } else {
+        ++er->poll_data.runtime_ptr->io_stat.yield_count;
+        retval = ef_routine_park(er);
+
+        /*
+         * the loop dissociated it when fired, we may be on other thread now
+         */
+        if (er->poll_data.runtime_ptr->steal) {
+            return retval;
+        }
+    }
+
+    /*
+     * dissociate fd after event fired
+     */
+    p->dissociate(p, fd, 1, 0);
+
+    if (retval < 0) {
+        errno = ETIMEDOUT;
+    }
+    return retval;
+}
+
+/*
+ * yield to the loop, with the timer armed if the routine has a deadline,
+ * return the value resumed with, or -1 and ETIMEDOUT if the timer fired
+ */
+inline long ef_routine_park(ef_routine_t *er)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    long retval;
+
+    if (er->deadline) {
+        er->timedout = 0;
+        ef_timer_add(&rt->timers, &er->timer, er->deadline);
+    }
+
+    retval = ef_fiber_yield(er->co.fiber.sched, 0);
+
+    /*
+     * resumed by the event, the loop removes the timer when stealing
+     */
+    if (er->deadline) {
+        ef_timer_del(&rt->timers, &er->timer);
+        if (er->timedout) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return retval;
+}
+
+/*
+ * set the deadline millisecs later, a nearer one set before is kept,
+ * return the previous one to restore
+ */
+inline long long ef_routine_deadline(ef_routine_t *er, int millisecs)
+{
+    long long saved = er->deadline;
+    long long deadline = ef_timer_now() + (long long)millisecs * 1000000;
+
+    if (saved && saved < deadline) {
+        deadline = saved;
+    }
+    er->deadline = deadline;
+    return saved;
+}
+
+/*
+ * get a sqe for the routine, with room for the linked timeout if it has a deadline
+ */
+inline struct io_uring_sqe *ef_routine_sqe(ef_routine_t *er)
+{
+    ef_poll_t *p = er->poll_data.runtime_ptr->p;
+
+    if (er->deadline) {
+        if (ef_timer_now() >= er->deadline) {
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        if (ef_uring_reserve(p, 2) < 0) {
+            return NULL;
+        }
+    }
+    return ef_uring_get_sqe(p);
+}
+
+/*
+ * park the routine until the sqe completed, return the result as the syscall does
+ */
+inline long ef_routine_complete(ef_routine_t *er, struct io_uring_sqe *sqe)
+{
+    long retval;
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = sqe->fd;
+    sqe->user_data = (unsigned long)&er->poll_data;
+
+    /*
+     * the kernel cancels the request at the deadline, room reserved by ef_routine_sqe
+     */
+    if (er->deadline) {
+        struct io_uring_sqe *link = ef_uring_get_sqe(er->poll_data.runtime_ptr->p);
+        if (link) {
+            sqe->flags |= IOSQE_IO_LINK;
+            er->link_timeout.tv_sec = er->deadline / 1000000000;
+            er->link_timeout.tv_nsec = er->deadline % 1000000000;
+            link->opcode = IORING_OP_LINK_TIMEOUT;
+            link->fd = -1;
+            link->addr = (unsigned long)&er->link_timeout;
+            link->len = 1;
+            link->timeout_flags = IORING_TIMEOUT_ABS;
+        }
+    }
+
+    /*
+     * submitted in batch by the event loop
+     */
+    ++er->poll_data.runtime_ptr->io_stat.yield_count;
+    retval = ef_fiber_yield(er->co.fiber.sched, 0);
+    if (retval == -ECANCELED && er->deadline) {
+        retval = -ETIMEDOUT;
+    }
+    if (retval < 0) {
+        errno = (int)-retval;
+        return -1;
+    }
+    return retval;
+}
+
+/*
+ * the kernel may touch the buffers of an io_uring request after the routine
+ * yielded, when the frames on a shared stack are copied out, so routines on
+ * shared stacks wait for readiness by ef_routine_poll and do the syscall
+ */
+#define ef_routine_uring(er) \
+    ((er)->poll_data.runtime_ptr->engine == EF_ENGINE_URING && !(er)->co.fiber.shared)
+
+inline long ef_routine_uring_io(ef_routine_t *er, int opcode, int fd, const void *buf, size_t len, int flags)
+{
+    struct io_uring_sqe *sqe = ef_routine_sqe(er);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    if (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE ||
+        opcode == IORING_OP_READV || opcode == IORING_OP_WRITEV) {
+        // 使用当前文件偏移，socket、pipe等不可seek的fd只能如此
+        sqe->off = (unsigned long long)-1;
+    } else {
+        sqe->msg_flags = flags;
+    }
+    return ef_routine_complete(er, sqe);
+}
+
+int ef_routine_close(ef_routine_t *er, int fd)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * stop the multishot recv on the fd
+     */
+    if (!ef_list_empty(&er->recv_list)) {
+        ef_recv_state_t *st = ef_routine_recv_state(er, fd);
+        if (st) {
+            ef_routine_recv_drop(er, st);
+        }
+    }
+
+    /*
+     * dissociate fd before close
+     */
+    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 0, 1);
+
+    /*
+     * the connection of the routine done, ef_proc closes it again
+     */
+    if (er->latency_stat && fd == er->conn_fd) {
+        ef_latency_record(&er->latency_stat->duration, ef_timer_now() - er->started_at);
+        er->latency_stat = NULL;
+    }
+
+    return close(fd);
+}
+
+int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int retval, flags, error = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * set non-block mode if needed
+     */
+    flags = fcntl(sockfd, F_GETFL);
+    if (!(flags & O_NONBLOCK)) {
+        retval = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    /*
+     * io_uring will wait for the connection established
+     */
+    if (ef_routine_uring(er)) {
+        struct io_uring_sqe *sqe = ef_routine_sqe(er);
+        if (!sqe) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = sockfd;
+        sqe->addr = (unsigned long)addr;
+        sqe->off = addrlen;
+        return ef_routine_complete(er, sqe);
+    }
+
+    retval = connect(sockfd, addr, addrlen);
+    if (retval >= 0 || errno != EINPROGRESS) {
+        return retval;
+    }
+
+    /*
+     * yield and wait event
+     */
+    events = ef_routine_poll(er, sockfd, EF_POLLOUT);
+    if (events < 0) {
+        return events;
+    }
+
+    /*
+     * a refused or timed out connect is reported as POLLERR or POLLHUP,
+     * the reason is in SO_ERROR either way
+     */
+    retval = 0;
+    if (events & (EF_POLLOUT | EF_POLLERR | EF_POLLHUP)) {
+        socklen_t len = sizeof(error);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            error = errno;
+        }
+        if (!error && (events & (EF_POLLERR | EF_POLLHUP))) {
+            error = EBADF;
+        }
+        if (error) {
+            retval = -1;
+        }
+    }
+
+    errno = error;
+
+    return retval;
+}
+
+ssize_t ef_routine_read(ef_routine_t *er, int fd, void *buf, size_t count)
+{
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = read(fd, buf, count)) < 0 && errno == EAGAIN) {
+        if (ef_routine_uring(er)) {
+            retval = ef_routine_uring_io(er, IORING_OP_READ, fd, buf, count, 0);
+            waited = 1;
+            break;
+        }
+        events = ef_routine_poll(er, fd, EF_POLLIN);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & EF_POLLERR) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.read, waited, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_write(ef_routine_t *er, int fd, const void *buf, size_t count)
+{
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = write(fd, buf, count)) < 0 && errno == EAGAIN) {
+        if (ef_routine_uring(er)) {
+            retval = ef_routine_uring_io(er, IORING_OP_WRITE, fd, buf, count, 0);
+            waited = 1;
+            break;
+        }
+        events = ef_routine_poll(er, fd, EF_POLLOUT);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & (EF_POLLERR | EF_POLLHUP)) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, retval);
+    ef_routine_reply(er, fd, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_recv(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags)
+{
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = recv(sockfd, buf, len, flags)) < 0 && errno == EAGAIN) {
+        if (ef_routine_uring(er)) {
+            retval = ef_routine_uring_io(er, IORING_OP_RECV, sockfd, buf, len, flags);
+            waited = 1;
+            break;
+        }
+        events = ef_routine_poll(er, sockfd, EF_POLLIN);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & EF_POLLERR) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.read, waited, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags)
+{
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = send(sockfd, buf, len, flags)) < 0 && errno == EAGAIN) {
+        if (ef_routine_uring(er)) {
+            retval = ef_routine_uring_io(er, IORING_OP_SEND, sockfd, buf, len, flags);
+            waited = 1;
+            break;
+        }
+        events = ef_routine_poll(er, sockfd, EF_POLLOUT);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & (EF_POLLERR | EF_POLLHUP)) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, retval);
+    ef_routine_reply(er, sockfd, retval);
+
+    return retval;
+}
+
+/*
+ * the rest of the vectors from skip bytes in iov[0], as many as the local array holds
+ */
+inline int ef_iov_resume(struct iovec *local, const struct iovec *iov, int iovcnt, size_t skip)
+{
+    int cnt = (iovcnt < EF_IOV_LOCAL) ? iovcnt : EF_IOV_LOCAL;
+
+    memcpy(local, iov, sizeof(struct iovec) * cnt);
+    local[0].iov_base = (char *)local[0].iov_base + skip;
+    local[0].iov_len -= skip;
+    return cnt;
+}
+
+/*
+ * skip the vectors fully written, and the bytes written of the next one
+ */
+inline void ef_iov_advance(const struct iovec **iov, int *iovcnt, size_t *skip, size_t bytes)
+{
+    while (*iovcnt > 0 && (*iov)->iov_len - *skip <= bytes) {
+        bytes -= (*iov)->iov_len - *skip;
+        *skip = 0;
+        ++*iov;
+        --*iovcnt;
+    }
+    *skip += bytes;
+}
+
+/*
+ * the bytes of the first count datagrams sent or received
+ */
+inline size_t ef_mmsg_bytes(const struct mmsghdr *msgvec, int count)
+{
+    size_t bytes = 0;
+    for (int idx = 0; idx < count; ++idx) {
+        bytes += msgvec[idx].msg_len;
+    }
+    return bytes;
+}
+
+/*
+ * the time to the first byte written to the connection of the routine
+ */
+inline void ef_routine_reply(ef_routine_t *er, int fd, ssize_t bytes)
+{
+    if (er->latency_stat && !er->replied && bytes > 0 && fd == er->conn_fd) {
+        er->replied = 1;
+        ef_latency_record(&er->latency_stat->first_byte, ef_timer_now() - er->started_at);
+    }
+}
+
+ssize_t ef_routine_readv(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt)
+{
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = readv(fd, iov, iovcnt)) < 0 && errno == EAGAIN) {
+        if (ef_routine_uring(er)) {
+            retval = ef_routine_uring_io(er, IORING_OP_READV, fd, iov, iovcnt, 0);
+            waited = 1;
+            break;
+        }
+        events = ef_routine_poll(er, fd, EF_POLLIN);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & EF_POLLERR) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.read, waited, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_writev(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec local[EF_IOV_LOCAL];
+    const struct iovec *vec = iov;
+    int cnt = iovcnt, waited = 0;
+    size_t skip = 0;
+    ssize_t retval, total = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (cnt > 0) {
+
+        /*
+         * try first, wait only when EAGAIN
+         */
+        retval = writev(fd, vec, cnt);
+        if (retval < 0 && errno == EAGAIN) {
+            if (ef_routine_uring(er)) {
+                retval = ef_routine_uring_io(er, IORING_OP_WRITEV, fd, vec, cnt, 0);
+            } else {
+                events = ef_routine_poll(er, fd, EF_POLLOUT);
+                if (events >= 0 && (events & (EF_POLLERR | EF_POLLHUP))) {
+                    errno = EBADF;
+                    events = -1;
+                }
+                if (events < 0) {
+                    retval = -1;
+                } else {
+                    waited = 1;
+                    continue;
+                }
+            }
+            waited = 1;
+        }
+        if (retval < 0) {
+            return (total > 0) ? total : retval;
+        }
+        total += retval;
+
+        /*
+         * written partially, resume from where it stopped
+         */
+        ef_iov_advance(&iov, &iovcnt, &skip, retval);
+        if (skip > 0) {
+            cnt = ef_iov_resume(local, iov, iovcnt, skip);
+            vec = local;
+        } else {
+            cnt = iovcnt;
+            vec = iov;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, total);
+    ef_routine_reply(er, fd, total);
+
+    return total;
+}
+
+ssize_t ef_routine_recvmsg(ef_routine_t *er, int sockfd, struct msghdr *msg, int flags)
+{
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = recvmsg(sockfd, msg, flags)) < 0 && errno == EAGAIN) {
+        if (ef_routine_uring(er)) {
+            retval = ef_routine_uring_io(er, IORING_OP_RECVMSG, sockfd, msg, 1, flags);
+            waited = 1;
+            break;
+        }
+        events = ef_routine_poll(er, sockfd, EF_POLLIN);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & EF_POLLERR) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.read, waited, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_sendmsg(ef_routine_t *er, int sockfd, const struct msghdr *msg, int flags)
+{
+    struct iovec local[EF_IOV_LOCAL];
+    const struct iovec *iov = msg->msg_iov;
+    int iovcnt = (int)msg->msg_iovlen, waited = 0;
+    struct msghdr m = *msg;
+    size_t skip = 0;
+    ssize_t retval, total = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (1) {
+
+        /*
+         * try first, wait only when EAGAIN
+         */
+        retval = sendmsg(sockfd, &m, flags);
+        if (retval < 0 && errno == EAGAIN) {
+            if (ef_routine_uring(er)) {
+                retval = ef_routine_uring_io(er, IORING_OP_SENDMSG, sockfd, &m, 1, flags);
+            } else {
+                events = ef_routine_poll(er, sockfd, EF_POLLOUT);
+                if (events >= 0 && (events & (EF_POLLERR | EF_POLLHUP))) {
+                    errno = EBADF;
+                    events = -1;
+                }
+                if (events < 0) {
+                    retval = -1;
+                } else {
+                    waited = 1;
+                    continue;
+                }
+            }
+            waited = 1;
+        }
+        if (retval < 0) {
+            return (total > 0) ? total : retval;
+        }
+        total += retval;
+
+        /*
+         * the ancillary data goes with the first byte, not again
+         */
+        m.msg_control = NULL;
+        m.msg_controllen = 0;
+
+        /*
+         * sent partially on a stream socket, resume from where it stopped
+         */
+        ef_iov_advance(&iov, &iovcnt, &skip, retval);
+        if (skip > 0) {
+            m.msg_iovlen = ef_iov_resume(local, iov, iovcnt, skip);
+            m.msg_iov = local;
+        } else {
+            m.msg_iovlen = iovcnt;
+            m.msg_iov = (struct iovec *)iov;
+        }
+        if (iovcnt == 0) {
+            break;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, total);
+    ef_routine_reply(er, sockfd, total);
+
+    return total;
+}
+
+int ef_routine_recvmmsg(ef_routine_t *er, int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    int retval, waited = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, wait only when EAGAIN, no recvmmsg op on io_uring, poll instead
+     */
+    while ((retval = recvmmsg(sockfd, msgvec, vlen, flags, NULL)) < 0 && errno == EAGAIN) {
+
+        /*
+         * the socket has been shut down to wake us up
+         */
+        if (er->poll_data.runtime_ptr->stopping) {
+            return 0;
+        }
+        events = ef_routine_poll(er, sockfd, EF_POLLIN);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & EF_POLLERR) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.read, waited, ef_mmsg_bytes(msgvec, retval));
+
+    return retval;
+}
+
+int ef_routine_sendmmsg(ef_routine_t *er, int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    unsigned int sent = 0;
+    int retval, waited = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (sent < vlen) {
+
+        /*
+         * try first, wait only when EAGAIN, resume from the first not sent
+         */
+        retval = sendmmsg(sockfd, msgvec + sent, vlen - sent, flags);
+        if (retval < 0 && errno == EAGAIN) {
+            events = ef_routine_poll(er, sockfd, EF_POLLOUT);
+            if (events >= 0 && (events & (EF_POLLERR | EF_POLLHUP))) {
+                errno = EBADF;
+                events = -1;
+            }
+            if (events < 0) {
+                return sent > 0 ? (int)sent : -1;
+            }
+            waited = 1;
+            continue;
+        }
+        if (retval <= 0) {
+            return sent > 0 ? (int)sent : -1;
+        }
+        sent += retval;
+    }
+
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, ef_mmsg_bytes(msgvec, (int)sent));
+
+    return (int)sent;
+}
+
+inline ef_recv_state_t *ef_routine_recv_state(ef_routine_t *er, int fd)
+{
+    ef_list_entry_t *ent = ef_list_entry_after(&er->recv_list);
+    while (ent != &er->recv_list) {
+        ef_recv_state_t *st = CAST_PARENT_PTR(ent, ef_recv_state_t, list_entry);
+        if (st->poll_data.fd == fd) {
+            return st;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+    return NULL;
+}
+
+/*
+ * submit the recv of st, multishot if the kernel supports it
+ */
+int ef_recv_arm(ef_runtime_t *rt, ef_recv_state_t *st)
+{
+    struct io_uring_sqe *sqe = ef_uring_get_sqe(rt->p);
+
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = st->poll_data.fd;
+    sqe->ioprio = rt->recv_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EF_BUFFER_GROUP;
+    sqe->user_data = (unsigned long)&st->poll_data;
+    st->armed = 1;
+    st->multishot = rt->recv_multishot;
+    return 0;
+}
+
+/*
+ * a buffer given back to the ring, arm the recvs stopped by ENOBUFS,
+ * the waiting routines are resumed by their completions
+ */
+void ef_recv_rearm(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent;
+
+    while ((ent = ef_list_remove_after(&rt->nobufs_recv_list)) != NULL) {
+        ef_recv_state_t *st = CAST_PARENT_PTR(ent, ef_recv_state_t, nobufs_entry);
+        st->nobufs = 0;
+        if (!st->armed && ef_recv_arm(rt, st) < 0) {
+            st->nobufs = 1;
+            ef_list_insert_after(&rt->nobufs_recv_list, &st->nobufs_entry);
+            break;
+        }
+    }
+}
+
+/*
+ * handle a completion of multishot recv, queue the data for the routine
+ */
+inline void ef_recv_fired(ef_runtime_t *rt, ef_recv_state_t *st, int res, unsigned int flags)
+{
+    if (!(flags & IORING_CQE_F_MORE)) {
+        st->armed = 0;
+    }
+
+    /*
+     * multishot recv needs linux 6.0, the routine arms a single recv again,
+     * and an empty buffer ring stops the recv until a buffer is given back
+     */
+    if (res == -EINVAL && st->multishot) {
+        rt->recv_multishot = 0;
+        res = -ECANCELED;
+    } else if (res == -ENOBUFS) {
+        if (!st->nobufs) {
+            st->nobufs = 1;
+            ef_list_insert_before(&rt->nobufs_recv_list, &st->nobufs_entry);
+        }
+        res = -ECANCELED;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+        ef_buffer_t *eb = &rt->bufs[bid];
+        if (res > 0) {
+            eb->len = res;
+            ef_list_insert_before(&st->buf_list, &eb->list_entry);
+        } else {
+            ef_uring_release_buffer(rt->p, rt->buf_base + bid * rt->buf_size, (int)rt->buf_size, bid);
+            ef_recv_rearm(rt);
+        }
+    }
+
+    if (res == 0) {
+        st->eof = 1;
+    } else if (res < 0 && res != -ECANCELED) {
+        st->error = -res;
+    }
+
+    if (st->waiting) {
+        st->waiting = 0;
+        ef_coroutine_resume(&rt->co_pool, &st->poll_data.routine_ptr->co, 0);
+    }
+}
+
+/*
+ * cancel the multishot recv and wait until it really stopped,
+ * then give back all the buffers not taken by the routine
+ */
+void ef_routine_recv_drop(ef_routine_t *er, ef_recv_state_t *st)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    ef_list_entry_t *ent;
+
+    if (st->armed) {
+        struct io_uring_sqe *sqe = ef_uring_get_sqe(rt->p);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)&st->poll_data;
+            while (st->armed) {
+                st->waiting = 1;
+                ef_fiber_yield(er->co.fiber.sched, 0);
+            }
+        }
+    }
+
+    if (st->nobufs) {
+        st->nobufs = 0;
+        ef_list_remove(&st->nobufs_entry);
+    }
+
+    ent = ef_list_remove_after(&st->buf_list);
+    while (ent != NULL) {
+        ef_buffer_t *eb = CAST_PARENT_PTR(ent, ef_buffer_t, list_entry);
+        int bid = (int)(eb - rt->bufs);
+        ef_uring_release_buffer(rt->p, rt->buf_base + bid * rt->buf_size, (int)rt->buf_size, bid);
+        ent = ef_list_remove_after(&st->buf_list);
+    }
+    ef_recv_rearm(rt);
+
+    ef_list_remove(&st->list_entry);
+    ef_list_insert_after(&rt->free_recv_list, &st->list_entry);
+}
+
+static ssize_t ef_routine_recv_multishot(ef_routine_t *er, int sockfd, void **buf)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    ef_recv_state_t *st = ef_routine_recv_state(er, sockfd);
+    ef_list_entry_t *ent;
+    int waited = 0;
+    ssize_t retval;
+
+    /*
+     * first recv on the socket, take a state from the free list
+     */
+    if (!st) {
+        ent = ef_list_remove_after(&rt->free_recv_list);
+        if (ent) {
+            st = CAST_PARENT_PTR(ent, ef_recv_state_t, list_entry);
+        } else {
+            st = (ef_recv_state_t *)malloc(sizeof(ef_recv_state_t));
+            if (!st) {
+                return -1;
+            }
+        }
+        st->poll_data.type = FD_TYPE_RECV;
+        st->poll_data.fd = sockfd;
+        st->poll_data.routine_ptr = er;
+        st->poll_data.runtime_ptr = rt;
+        st->poll_data.ef_proc = NULL;
+        st->armed = 0;
+        st->multishot = 0;
+        st->nobufs = 0;
+        st->waiting = 0;
+        st->eof = 0;
+        st->error = 0;
+        ef_list_init(&st->buf_list);
+        ef_list_insert_after(&er->recv_list, &st->list_entry);
+    }
+
+    while (1) {
+        ent = ef_list_remove_after(&st->buf_list);
+        if (ent) {
+            ef_buffer_t *eb = CAST_PARENT_PTR(ent, ef_buffer_t, list_entry);
+            *buf = rt->buf_base + (eb - rt->bufs) * rt->buf_size;
+            retval = eb->len;
+            break;
+        }
+        if (st->error) {
+            errno = st->error;
+            st->error = 0;
+            retval = -1;
+            break;
+        }
+        if (st->eof) {
+            retval = 0;
+            break;
+        }
+
+        /*
+         * arm once, the kernel picks a buffer from the ring for each receive,
+         * armed again when a buffer is given back if the ring was empty
+         */
+        if (!st->armed && !st->nobufs && ef_recv_arm(rt, st) < 0) {
+            retval = -1;
+            break;
+        }
+
+        st->waiting = 1;
+        waited = 1;
+        ++rt->io_stat.yield_count;
+        if (ef_routine_park(er) < 0) {
+            st->waiting = 0;
+            retval = -1;
+            break;
+        }
+    }
+
+    ef_io_stat_count(rt->io_stat.read, waited, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_recv_borrow(ef_routine_t *er, int sockfd, void **buf)
+{
+    ef_runtime_t *rt;
+    ef_list_entry_t *ent;
+    ef_buffer_t *eb;
+    int waited = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    rt = er->poll_data.runtime_ptr;
+    if (!rt->bufs) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (rt->engine == EF_ENGINE_URING) {
+        retval = ef_routine_recv_multishot(er, sockfd, buf);
+        if (retval > 0) {
+            ++er->borrowed;
+        }
+        return retval;
     }
 
     /*
-     * the main event loop
+     * take a buffer only when the socket is readable
      */
-    // 事件主循环
     while (1) {
-        // 获取就绪的事件，一次最多获取1024个，最多阻塞等待1000ms
-        int cnt = rt->p->wait(rt->p, &evts[0], 1024, 1000);
-        if (cnt < 0 && errno != EINTR) {
-            return cnt;
+        ent = ef_list_remove_after(&rt->free_buf_list);
+        if (!ent) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        eb = CAST_PARENT_PTR(ent, ef_buffer_t, list_entry);
+        *buf = rt->buf_base + (eb - rt->bufs) * rt->buf_size;
+
+        retval = recv(sockfd, *buf, rt->buf_size, 0);
+        if (retval > 0) {
+            ++er->borrowed;
+            break;
+        }
+
+        ef_list_insert_after(&rt->free_buf_list, &eb->list_entry);
+        if (retval == 0 || errno != EAGAIN) {
+            break;
+        }
+
+        events = ef_routine_wait(er, sockfd, EF_POLLIN);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & EF_POLLERR) {
+            errno = EBADF;
+            return -1;
         }
 
         /*
-         * check all events returned by poll wait function
+         * may be resumed by other thread, take the buffer there
          */
-        for (int i = 0; i < cnt; ++i) {
-            ef_poll_data_t *ed = (ef_poll_data_t*)evts[i].ptr;
-            if (ed->type == FD_TYPE_LISTEN) {   // 事件类型为连接
-                while (1) {
-                    int socket = accept(ed->fd, NULL, NULL);
-                    if (socket < 0) {
-                        rt->p->unset(rt->p, ed->fd, EF_POLLIN);
-                        break;
-                    }
-                    ef_listen_info_t *li = CAST_PARENT_PTR(ed, ef_listen_info_t, poll_data);
+        rt = er->poll_data.runtime_ptr;
+    }
 
-                    /*
-                     * put new connection to queue
-                     */
-                    // 将新建立的客户端连接添加到监听socket的客户端连接队列中
-                    int ret = ef_queue_fd(rt, li, socket);
-                    if (ret < 0) {
-                        break;
-                    }
-                }
+    ef_io_stat_count(rt->io_stat.read, waited, retval);
 
-                /*
-                 * solaris event port will auto dissociate fd after event fired
-                 */
-                rt->p->associate(rt->p, ed->fd, EF_POLLIN, ed, 1);
-            } else if (ed->type == FD_TYPE_RWC) { // 事件类型为读写
-                //从协程池中获取一个协程去处理客户端连接的事件
-                ef_coroutine_resume(&rt->co_pool, &ed->routine_ptr->co, evts[i].events);
+    return retval;
+}
+
+void ef_routine_buffer_release(ef_routine_t *er, void *buf)
+{
+    ef_runtime_t *rt;
+    int bid;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    rt = er->poll_data.runtime_ptr;
+    bid = (int)(((char *)buf - rt->buf_base) / rt->buf_size);
+    --er->borrowed;
+
+    if (rt->engine == EF_ENGINE_URING) {
+        ef_uring_release_buffer(rt->p, rt->buf_base + bid * rt->buf_size, (int)rt->buf_size, bid);
+        ef_recv_rearm(rt);
+    } else {
+        ef_list_insert_after(&rt->free_buf_list, &rt->bufs[bid].list_entry);
+    }
+}
+
+/*
+ * wait for the fd ready when the caller retries the syscall itself,
+ * by a oneshot poll sqe on io_uring, so that a timeout cancels it
+ */
+inline long ef_routine_poll(ef_routine_t *er, int fd, int events)
+{
+    if (er->poll_data.runtime_ptr->engine == EF_ENGINE_URING) {
+        struct io_uring_sqe *sqe = ef_routine_sqe(er);
+        if (!sqe) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        return ef_routine_complete(er, sqe);
+    }
+    return ef_routine_wait(er, fd, events);
+}
+
+/*
+ * splice and wait for events on wait_fd when EAGAIN, wait_fd < 0
+ * means the one of fd_in and fd_out which is not a pipe
+ */
+inline ssize_t ef_routine_splice_fd(ef_routine_t *er, int fd_in, int fd_out, size_t len, unsigned int flags, int wait_fd, int events)
+{
+    int waited = 0;
+    long fired;
+    ssize_t retval;
+
+    /*
+     * try first, wait only when EAGAIN
+     */
+    while ((retval = splice(fd_in, NULL, fd_out, NULL, len, flags | SPLICE_F_NONBLOCK)) < 0 && errno == EAGAIN) {
+        if (wait_fd < 0) {
+            struct stat st;
+            if (fstat(fd_in, &st) == 0 && S_ISFIFO(st.st_mode)) {
+                wait_fd = fd_out;
+                events = EF_POLLOUT;
+            } else {
+                wait_fd = fd_in;
+                events = EF_POLLIN;
             }
         }
+        fired = ef_routine_poll(er, wait_fd, events);
+        if (fired < 0) {
+            return fired;
+        }
+        waited = 1;
+        if (fired & ((events == EF_POLLIN) ? EF_POLLERR : (EF_POLLERR | EF_POLLHUP))) {
+            errno = EBADF;
+            return -1;
+        }
+    }
 
-        // 刚监听之后，还没建立过客户端连接时，第一次创建客户端连接时，还没有协程被创建，所以协程池中没有可用协程，需要创建协程去处理新建的连接
-        /*
-         * handle queued connections
-         */
-        ent = ef_list_entry_after(&rt->listen_list);
+    if (events == EF_POLLOUT) {
+        ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, retval);
+    } else {
+        ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.read, waited, retval);
+    }
+    ef_routine_reply(er, fd_out, retval);
+
+    return retval;
+}
+
+ssize_t ef_routine_splice(ef_routine_t *er, int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+    return ef_routine_splice_fd(er, fd_in, fd_out, len, flags, -1, 0);
+}
+
+// 从runtime缓存的空闲pipe中获取一个，没有时新建
+static ef_pipe_t *ef_runtime_pipe_get(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent = ef_list_remove_after(&rt->free_pipe_list);
+    ef_pipe_t *pp;
+
+    if (ent) {
+        --rt->pipe_count;
+        return CAST_PARENT_PTR(ent, ef_pipe_t, list_entry);
+    }
+
+    pp = (ef_pipe_t *)malloc(sizeof(ef_pipe_t));
+    if (!pp) {
+        return NULL;
+    }
+    if (pipe2(pp->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        free(pp);
+        return NULL;
+    }
+    return pp;
+}
+
+// 归还pipe，还有数据残留的pipe不能再用，直接关闭
+static void ef_runtime_pipe_put(ef_runtime_t *rt, ef_pipe_t *pp, int empty)
+{
+    if (empty && rt->pipe_count < EF_PIPE_CACHE) {
+        ef_list_insert_after(&rt->free_pipe_list, &pp->list_entry);
+        ++rt->pipe_count;
+        return;
+    }
+    close(pp->fds[0]);
+    close(pp->fds[1]);
+    free(pp);
+}
+
+ssize_t ef_routine_relay(ef_routine_t *er, int fd_in, int fd_out)
+{
+    ssize_t total = 0, r, w;
+    ef_pipe_t *pp;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    pp = ef_runtime_pipe_get(er->poll_data.runtime_ptr);
+    if (!pp) {
+        return -1;
+    }
+
+    /*
+     * the pipe is empty before every fill, so EAGAIN comes from fd_in,
+     * and it is not empty while draining, so EAGAIN comes from fd_out
+     */
+    while ((r = ef_routine_splice_fd(er, fd_in, pp->fds[1], EF_PIPE_SIZE, SPLICE_F_MOVE, fd_in, EF_POLLIN)) > 0) {
+        while (r > 0) {
+            w = ef_routine_splice_fd(er, pp->fds[0], fd_out, r, SPLICE_F_MOVE, fd_out, EF_POLLOUT);
+            if (w <= 0) {
+                if (w == 0) {
+                    errno = EPIPE;
+                }
+                ef_runtime_pipe_put(er->poll_data.runtime_ptr, pp, 0);
+                return -1;
+            }
+            r -= w;
+            total += w;
+        }
+    }
+
+    /*
+     * back to the runtime we are on now, the routine may have been stolen
+     */
+    ef_runtime_pipe_put(er->poll_data.runtime_ptr, pp, 1);
+    return (r < 0) ? r : total;
+}
+
+// slab中每个缓冲区之前的头部，补齐到缓存行，缓冲区按64字节对齐
+typedef struct _ef_arena_buf {
+    ef_list_entry_t list_entry;
+    int cls;
+} ef_arena_buf_t;
+
+// slab开头的头部，链接到runtime的arena_slabs，以及映射的字节数
+typedef struct _ef_arena_slab {
+    ef_list_entry_t list_entry;
+    size_t size;
+} ef_arena_slab_t;
+
+#define EF_ARENA_HEADER 64
+
+/*
+ * map a slab and carve it into buffers of the class, EF_ARENA_SLAB bytes
+ * of buffers plus the headers, so that the largest class is not left with
+ * a buffer less for its headers, the pages of a buffer committed when it
+ * is first used
+ */
+static int ef_arena_carve(ef_runtime_t *rt, int cls)
+{
+    size_t stride = EF_ARENA_HEADER + EF_ARENA_SIZE(cls);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (EF_ARENA_HEADER + (EF_ARENA_SLAB / EF_ARENA_SIZE(cls)) * stride + page - 1) & ~(page - 1);
+    char *slab = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    ef_arena_slab_t *as = (ef_arena_slab_t *)slab;
+
+    if (slab == MAP_FAILED) {
+        return -1;
+    }
+    as->size = size;
+    ef_list_insert_after(&rt->arena_slabs, &as->list_entry);
+    for (size_t off = EF_ARENA_HEADER; off + stride <= size; off += stride) {
+        ef_arena_buf_t *ab = (ef_arena_buf_t *)(slab + off);
+        ab->cls = cls;
+        ef_list_insert_before(&rt->arena_free[cls], &ab->list_entry);
+    }
+    rt->arena_mapped += size;
+    return 0;
+}
+
+static void ef_arena_unmap(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent;
+
+    while ((ent = ef_list_remove_after(&rt->arena_slabs)) != NULL) {
+        munmap(ent, CAST_PARENT_PTR(ent, ef_arena_slab_t, list_entry)->size);
+    }
+    for (int cls = 0; cls < EF_ARENA_CLASSES; ++cls) {
+        ef_list_init(&rt->arena_free[cls]);
+    }
+    rt->arena_mapped = 0;
+}
+
+void *ef_arena_get(ef_runtime_t *rt, size_t size, size_t *cap)
+{
+    ef_arena_buf_t *ab;
+    int cls = 0;
+
+    while (cls < EF_ARENA_CLASSES && EF_ARENA_SIZE(cls) < size) {
+        ++cls;
+    }
+    if (cls == EF_ARENA_CLASSES) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+    if (ef_list_empty(&rt->arena_free[cls]) && ef_arena_carve(rt, cls) < 0) {
+        return NULL;
+    }
+
+    ab = CAST_PARENT_PTR(ef_list_remove_after(&rt->arena_free[cls]), ef_arena_buf_t, list_entry);
+    rt->arena_used += EF_ARENA_SIZE(cls);
+    if (cap) {
+        *cap = EF_ARENA_SIZE(cls);
+    }
+    return (char *)ab + EF_ARENA_HEADER;
+}
+
+void ef_arena_put(ef_runtime_t *rt, void *buf)
+{
+    ef_arena_buf_t *ab = (ef_arena_buf_t *)((char *)buf - EF_ARENA_HEADER);
+
+    // 最近归还的最先取出，它的页还在缓存中
+    ef_list_insert_after(&rt->arena_free[ab->cls], &ab->list_entry);
+    rt->arena_used -= EF_ARENA_SIZE(ab->cls);
+}
+
+/*
+ * the bytes ready to read on fd, 0 if nothing or at EOF,
+ * the second class if fd can not tell, such as a file
+ */
+static size_t ef_arena_pending(int fd)
+{
+    int pending = 0;
+
+    if (ioctl(fd, FIONREAD, &pending) < 0 || pending < 0) {
+        return EF_ARENA_SIZE(1);
+    }
+    return (size_t)pending;
+}
+
+ssize_t ef_routine_read_arena(ef_routine_t *er, int fd, void **buf)
+{
+    ef_runtime_t *rt;
+    size_t pending, cap;
+    int waited = 0, polled = 0;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+    rt = er->poll_data.runtime_ptr;
+
+    while (1) {
 
         /*
-         * every listening sockets
+         * wait with no buffer held until something to read,
+         * nothing pending after readable means EOF or error
          */
-        while (ent != &rt->listen_list) {
+        pending = ef_arena_pending(fd);
+        if (pending == 0 && !polled) {
+            events = ef_routine_poll(er, fd, EF_POLLIN);
+            if (events < 0) {
+                return events;
+            }
 
-            ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
-            ef_list_entry_t *enf = ef_list_entry_after(&li->fd_list);
+            /*
+             * nothing held while waiting, it may be stolen by another thread,
+             * take the buffer from the arena of the one we are on now
+             */
+            rt = er->poll_data.runtime_ptr;
+            waited = 1;
+            polled = 1;
+            continue;
+        }
+        if (pending > EF_ARENA_SIZE(EF_ARENA_CLASSES - 1)) {
+            pending = EF_ARENA_SIZE(EF_ARENA_CLASSES - 1);
+        }
+
+        *buf = ef_arena_get(rt, pending, &cap);
+        if (*buf == NULL) {
+            return -1;
+        }
+        retval = read(fd, *buf, cap);
+        if (retval > 0) {
+            ++er->borrowed;
+            break;
+        }
+        ef_arena_put(rt, *buf);
+        *buf = NULL;
+        if (retval == 0 || errno != EAGAIN) {
+            break;
+        }
+        polled = 0;
+    }
+
+    ef_io_stat_count(rt->io_stat.read, waited, retval);
+    return retval;
+}
+
+void ef_routine_arena_release(ef_routine_t *er, void *buf)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+    ef_arena_put(er->poll_data.runtime_ptr, buf);
+    --er->borrowed;
+}
+
+ef_bufio_t *ef_bufio_attach(ef_routine_t *er, int fd, int millisecs)
+{
+    ef_runtime_t *rt;
+    ef_list_entry_t *ent;
+    ef_bufio_t *b;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    rt = er->poll_data.runtime_ptr;
+    ent = ef_list_remove_after(&rt->free_bufio_list);
+    if (ent) {
+        --rt->bufio_count;
+        b = CAST_PARENT_PTR(ent, ef_bufio_t, list_entry);
+    } else {
+        b = (ef_bufio_t *)malloc(sizeof(ef_bufio_t));
+        if (!b) {
+            return NULL;
+        }
+    }
+    b->er = er;
+    b->fd = fd;
+    b->millisecs = (millisecs > 0) ? millisecs : 0;
+    b->in = NULL;
+    b->in_cap = 0;
+    b->in_start = 0;
+    b->in_end = 0;
+    b->out = NULL;
+    b->out_cap = 0;
+    b->out_len = 0;
+    ef_list_insert_after(&er->bufio_list, &b->list_entry);
+
+    /*
+     * the buffers go back to the arena of this runtime
+     */
+    ++er->borrowed;
+    return b;
+}
+
+// 归还输入缓冲区，没有预读的数据时才调用
+static void ef_bufio_drop_in(ef_bufio_t *b)
+{
+    if (b->in) {
+        ef_arena_put(b->er->poll_data.runtime_ptr, b->in);
+        b->in = NULL;
+        b->in_cap = 0;
+    }
+    b->in_start = 0;
+    b->in_end = 0;
+}
+
+// 归还输出缓冲区，其中未写出的数据被丢弃
+static void ef_bufio_drop_out(ef_bufio_t *b)
+{
+    if (b->out) {
+        ef_arena_put(b->er->poll_data.runtime_ptr, b->out);
+        b->out = NULL;
+        b->out_cap = 0;
+    }
+    b->out_len = 0;
+}
+
+// 归还到所属协程所在runtime的空闲链表，缓存已满时释放
+static void ef_bufio_free(ef_bufio_t *b)
+{
+    ef_runtime_t *rt = b->er->poll_data.runtime_ptr;
+
+    ef_bufio_drop_in(b);
+    ef_bufio_drop_out(b);
+    ef_list_remove(&b->list_entry);
+    --b->er->borrowed;
+    if (rt->bufio_count < EF_BUFIO_CACHE) {
+        ef_list_insert_after(&rt->free_bufio_list, &b->list_entry);
+        ++rt->bufio_count;
+        return;
+    }
+    free(b);
+}
+
+int ef_bufio_detach(ef_bufio_t *b)
+{
+    int retval = ef_bufio_flush(b);
+    ef_bufio_free(b);
+    return retval;
+}
+
+int ef_bufio_flush(ef_bufio_t *b)
+{
+    size_t sent = 0;
+    ssize_t w;
+
+    while (sent < b->out_len) {
+        if (b->millisecs) {
+            w = ef_routine_write_timeout(b->er, b->fd, b->out + sent, b->out_len - sent, b->millisecs);
+        } else {
+            w = ef_routine_write(b->er, b->fd, b->out + sent, b->out_len - sent);
+        }
+        if (w < 0) {
+
+            /*
+             * keep the rest, the caller may retry or give up
+             */
+            memmove(b->out, b->out + sent, b->out_len - sent);
+            b->out_len -= sent;
+            return -1;
+        }
+        sent += w;
+    }
+
+    /*
+     * nothing to hold while waiting for the next request
+     */
+    ef_bufio_drop_out(b);
+    return 0;
+}
+
+/*
+ * wait until fd readable, flush the output before, the peer may need
+ * it to send more, return the events or -1 if failed or timed out
+ */
+static long ef_bufio_wait(ef_bufio_t *b)
+{
+    long long saved = 0;
+    long events;
+
+    if (ef_bufio_flush(b) < 0) {
+        return -1;
+    }
+    if (b->millisecs) {
+        saved = ef_routine_deadline(b->er, b->millisecs);
+    }
+    events = ef_routine_poll(b->er, b->fd, EF_POLLIN);
+    if (b->millisecs) {
+        b->er->deadline = saved;
+    }
+    return events;
+}
+
+/*
+ * read from fd once, no wait if something there, or else flush
+ * the output before waiting, the peer may need it to send more
+ */
+static ssize_t ef_bufio_input(ef_bufio_t *b, void *buf, size_t count)
+{
+    ssize_t retval = read(b->fd, buf, count);
+
+    if (retval >= 0 || errno != EAGAIN) {
+        ef_io_stat_count(b->er->poll_data.runtime_ptr->io_stat.read, 0, retval);
+        return retval;
+    }
+    if (ef_bufio_flush(b) < 0) {
+        return -1;
+    }
+    if (b->millisecs) {
+        return ef_routine_read_timeout(b->er, b->fd, buf, count, b->millisecs);
+    }
+    return ef_routine_read(b->er, b->fd, buf, count);
+}
+
+/*
+ * move the input to a buffer of at least size bytes, the smallest
+ * class fitting the bytes pending when nothing buffered
+ */
+static int ef_bufio_grow_in(ef_bufio_t *b, size_t size)
+{
+    size_t len = b->in_end - b->in_start, cap;
+    char *in;
+
+    if (size > EF_BUFIO_SIZE) {
+        size = EF_BUFIO_SIZE;
+    }
+    in = (char *)ef_arena_get(b->er->poll_data.runtime_ptr, size, &cap);
+    if (!in) {
+        return -1;
+    }
+    if (len) {
+        memcpy(in, b->in + b->in_start, len);
+    }
+    ef_bufio_drop_in(b);
+    b->in = in;
+    b->in_cap = cap;
+    b->in_end = len;
+    return 0;
+}
 
-            /*
-             * every queued connection
-             */
-            while (enf != &li->fd_list) {
+// 向输入缓冲区追加数据，没有数据时不持有缓冲区，剩余数据移到开头或换到更大的一级以腾出空间
+static ssize_t ef_bufio_fill(ef_bufio_t *b)
+{
+    int polled = 0;
+    ssize_t r;
+
+    if (b->in_start == b->in_end) {
+        ef_bufio_drop_in(b);
+    } else if (b->in_end == b->in_cap && b->in_start > 0) {
+        memmove(b->in, b->in + b->in_start, b->in_end - b->in_start);
+        b->in_end -= b->in_start;
+        b->in_start = 0;
+    } else if (b->in_end == b->in_cap && b->in_cap < EF_BUFIO_SIZE && ef_bufio_grow_in(b, b->in_cap + 1) < 0) {
+        return -1;
+    }
+    if (b->in && b->in_end == b->in_cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
-                ef_queue_fd_t *qf = CAST_PARENT_PTR(enf, ef_queue_fd_t, list_entry);
-                enf = ef_list_entry_after(enf);
+    while (1) {
 
-                // 创建新的协程处理新建的客户端连接
-                int ret = ef_routine_run(rt, li->ef_proc, qf->fd);
-                if (ret < 0) {
-                    goto exit_queue;
-                } else {
-                    ef_list_remove(&qf->list_entry);
-                    ef_list_insert_after(&rt->free_fd_list, &qf->list_entry);
+        /*
+         * take a buffer only when something to read,
+         * nothing pending after readable means EOF or error
+         */
+        if (!b->in) {
+            size_t pending = ef_arena_pending(b->fd);
+            if (pending == 0 && !polled) {
+                if (ef_bufio_wait(b) < 0) {
+                    return -1;
                 }
+                polled = 1;
+                continue;
+            }
+            if (ef_bufio_grow_in(b, pending) < 0) {
+                return -1;
             }
-            ent = ef_list_entry_after(ent);
         }
 
-exit_queue:
-        // 事件循环停止
-        if (rt->stopping) {
+        r = read(b->fd, b->in + b->in_end, b->in_cap - b->in_end);
+        if (r >= 0 || errno != EAGAIN) {
+            ef_io_stat_count(b->er->poll_data.runtime_ptr->io_stat.read, polled, r);
+            break;
+        }
 
-            /*
-             * close all listening socket
-             */
-            if (!ef_list_empty(&rt->listen_list)) {
+        /*
+         * keep the buffer only for a partial frame
+         */
+        if (b->in_start == b->in_end) {
+            ef_bufio_drop_in(b);
+            polled = 0;
+        } else if (ef_bufio_wait(b) < 0) {
+            return -1;
+        } else {
+            polled = 1;
+        }
+    }
 
-                ent = ef_list_entry_after(&rt->listen_list);
+    if (r > 0) {
+        b->in_end += r;
+    } else if (b->in_start == b->in_end) {
+        ef_bufio_drop_in(b);
+    }
+    return r;
+}
 
-                while (ent != &rt->listen_list) {
+ssize_t ef_bufio_read(ef_bufio_t *b, void *buf, size_t count)
+{
+    size_t n;
 
-                    ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
-                    ent = ef_list_entry_after(ent);
+    if (b->in_start == b->in_end) {
 
-                    /*
-                     * close listening socket
-                     */
-                    if (li->poll_data.fd >= 0) {
-                        rt->p->dissociate(rt->p, li->poll_data.fd, 0, 0);
-                        close(li->poll_data.fd);
-                        li->poll_data.fd = -1;
-                    }
+        /*
+         * no use copying a big read through the buffer
+         */
+        if (count >= EF_BUFIO_SIZE) {
+            ef_bufio_drop_in(b);
+            return ef_bufio_input(b, buf, count);
+        }
+        ssize_t r = ef_bufio_fill(b);
+        if (r <= 0) {
+            return r;
+        }
+    }
 
-                    /*
-                     * free listen info if connection queue empty
-                     */
-                    if (ef_list_empty(&li->fd_list)) {
-                        ef_list_remove(&li->list_entry);
-                        free(li);
-                    }
-                }
-            }
+    n = b->in_end - b->in_start;
+    if (n > count) {
+        n = count;
+    }
+    memcpy(buf, b->in + b->in_start, n);
+    b->in_start += n;
+    return n;
+}
 
-            /*
-             * destroy the unused fd queue item
-             */
-            if (!ef_list_empty(&rt->free_fd_list)) {
-                ent = ef_list_remove_after(&rt->free_fd_list);
-                while (ent != NULL) {
-                    ef_queue_fd_t *qf = CAST_PARENT_PTR(ent, ef_queue_fd_t, list_entry);
-                    ent = ef_list_remove_after(&rt->free_fd_list);
-                    free(qf);
-                }
-            }
+ssize_t ef_bufio_read_exact(ef_bufio_t *b, void *buf, size_t count)
+{
+    size_t got = 0;
 
-            /*
-             * shrink coroutine pool, to free
-             */
-            if (rt->co_pool.free_count == rt->co_pool.full_count) {
-                rt->p->free(rt->p);
-                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.full_count);
-                break;
-            } else {
-                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.free_count);
-            }
+    while (got < count) {
+        ssize_t r = ef_bufio_read(b, (char *)buf + got, count - got);
+        if (r < 0) {
+            return r;
         }
-
-        if (rt->co_pool.free_count > 0 && rt->co_pool.full_count > rt->co_pool.limit_min) {
-            ef_coroutine_pool_shrink(&rt->co_pool, rt->shrink_millisecs, rt->count_per_shrink);
+        if (r == 0) {
+            break;
         }
+        got += r;
     }
-    return 0;
+    return got;
 }
 
-int ef_routine_close(ef_routine_t *er, int fd)
+ssize_t ef_bufio_read_until(ef_bufio_t *b, const void *delim, size_t delim_len, char **data)
 {
-    if (er == NULL) {
-        er = ef_routine_current();
-    }
-
-    /*
-     * dissociate fd before close
-     */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 0, 1);
-
-    return close(fd);
+    return ef_bufio_read_until_limit(b, delim, delim_len, EF_BUFIO_SIZE, data);
 }
 
-int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+ssize_t ef_bufio_read_until_limit(ef_bufio_t *b, const void *delim, size_t delim_len, size_t limit, char **data)
 {
-    int retval, flags, error = 0;
-    long events;
+    size_t scanned = 0, len;
+    char *found;
 
-    if (er == NULL) {
-        er = ef_routine_current();
+    if (delim_len == 0 || delim_len > limit || limit > EF_BUFIO_SIZE) {
+        errno = EINVAL;
+        return -1;
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = sockfd;
+    while (1) {
 
-    /*
-     * set non-block mode if needed
-     */
-    flags = fcntl(sockfd, F_GETFL);
-    if (!(flags & O_NONBLOCK)) {
-        retval = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-        if (retval < 0) {
-            error = errno;
-            goto exit_conn;
+        /*
+         * the bytes scanned before not scanned again, except a
+         * partial delim at the end, the offsets kept by the fill,
+         * only the first limit bytes searched
+         */
+        len = b->in_end - b->in_start;
+        if (len > limit) {
+            len = limit;
+        }
+        found = (len > scanned) ? memmem(b->in + b->in_start + scanned, len - scanned, delim, delim_len) : NULL;
+        if (found) {
+            *data = b->in + b->in_start;
+            len = found + delim_len - *data;
+            b->in_start += len;
+            return len;
+        }
+        if (len == limit) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        scanned = (len >= delim_len) ? len - delim_len + 1 : 0;
+
+        ssize_t r = ef_bufio_fill(b);
+        if (r <= 0) {
+            return r;
         }
     }
+}
 
-    retval = connect(sockfd, addr, addrlen);
-    if (retval < 0) {
-        if (errno != EINPROGRESS) {
-            error = errno;
-            goto exit_conn;
+ssize_t ef_bufio_write(ef_bufio_t *b, const void *buf, size_t count)
+{
+    size_t sent = 0;
+    ssize_t w;
+
+    if (b->out_len + count > EF_BUFIO_SIZE) {
+        if (ef_bufio_flush(b) < 0) {
+            return -1;
         }
-        retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, sockfd, EF_POLLOUT, &er->poll_data, 0);
-        if (retval < 0) {
-            error = errno;
-            goto exit_conn;
+
+        /*
+         * the buffered ones are out, this one in order after them
+         */
+        while (count >= EF_BUFIO_SIZE && sent < count) {
+            if (b->millisecs) {
+                w = ef_routine_write_timeout(b->er, b->fd, (const char *)buf + sent, count - sent, b->millisecs);
+            } else {
+                w = ef_routine_write(b->er, b->fd, (const char *)buf + sent, count - sent);
+            }
+            if (w < 0) {
+                return -1;
+            }
+            sent += w;
         }
-    } else {
-        return retval;
     }
 
-    /*
-     * yield and wait event
-     */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
-    if (events & (EF_POLLERR | EF_POLLHUP)) {
-        error = EBADF;
-        retval = -1;
-    } else if (events & EF_POLLOUT) {
-        socklen_t len = sizeof(error);
-        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (sent == count) {
+        return count;
     }
 
     /*
-     * dissociate fd after event fired
+     * a buffer of the class fitting what is buffered, a larger one when it grows
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, sockfd, 1, 0);
-
-exit_conn:
-
-    errno = error;
+    if (b->out_len + count - sent > b->out_cap) {
+        size_t cap;
+        char *out = (char *)ef_arena_get(b->er->poll_data.runtime_ptr, b->out_len + count - sent, &cap);
+        if (!out) {
+            return -1;
+        }
+        if (b->out_len) {
+            memcpy(out, b->out, b->out_len);
+        }
+        if (b->out) {
+            ef_arena_put(b->er->poll_data.runtime_ptr, b->out);
+        }
+        b->out = out;
+        b->out_cap = cap;
+    }
 
-    return retval;
+    memcpy(b->out + b->out_len, (const char *)buf + sent, count - sent);
+    b->out_len += count - sent;
+    if (b->out_len == EF_BUFIO_SIZE && ef_bufio_flush(b) < 0) {
+        return -1;
+    }
+    return count;
 }
 
-ssize_t ef_routine_read(ef_routine_t *er, int fd, void *buf, size_t count)
+ssize_t ef_routine_sendfile(ef_routine_t *er, int out_fd, int in_fd, off_t *offset, size_t count)
 {
-    int error = 0;
+    int waited = 0;
     long events;
     ssize_t retval;
 
@@ -420,201 +3549,151 @@ ssize_t ef_routine_read(ef_routine_t *er, int fd, void *buf, size_t count)
         er = ef_routine_current();
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = fd;
-
     /*
-     * always associate
+     * try first, wait only when EAGAIN, no sendfile op on io_uring, poll instead
      */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, fd, EF_POLLIN, &er->poll_data, 0);
-    if (retval < 0) {
-        return retval;
-    } else if (retval > 0) {
-        goto ready;
+    while ((retval = sendfile(out_fd, in_fd, offset, count)) < 0 && errno == EAGAIN) {
+        events = ef_routine_poll(er, out_fd, EF_POLLOUT);
+        if (events < 0) {
+            return events;
+        }
+        waited = 1;
+        if (events & (EF_POLLERR | EF_POLLHUP)) {
+            errno = EBADF;
+            return -1;
+        }
     }
 
-yield:
+    ef_io_stat_count(er->poll_data.runtime_ptr->io_stat.write, waited, retval);
+    ef_routine_reply(er, out_fd, retval);
 
-    /*
-     * yield and wait event
-     */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
-    if (events & EF_POLLERR) {
-        error = EBADF;
-        retval = -1;
-    } else if (events & (EF_POLLIN | EF_POLLHUP)) {
-ready:
-        retval = read(fd, buf, count);
-        if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, fd, EF_POLLIN | EF_POLLHUP);
-            goto yield;
-        } else if (retval < 0) {
-            error = errno;
-        }
-    }
+    return retval;
+}
 
-    /*
-     * dissociate fd after event fired
-     */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 1, 0);
+int ef_routine_connect_timeout(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen, int millisecs)
+{
+    long long saved;
+    int retval;
 
-    errno = error;
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
 
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_connect(er, sockfd, addr, addrlen);
+    er->deadline = saved;
     return retval;
 }
 
-ssize_t ef_routine_write(ef_routine_t *er, int fd, const void *buf, size_t count)
+ssize_t ef_routine_read_timeout(ef_routine_t *er, int fd, void *buf, size_t count, int millisecs)
 {
-    int error = 0;
-    long events;
+    long long saved;
     ssize_t retval;
 
     if (er == NULL) {
         er = ef_routine_current();
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = fd;
-
-    /*
-     * always associate
-     */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, fd, EF_POLLOUT, &er->poll_data, 0);
-    if (retval < 0) {
-        return retval;
-    } else if (retval > 0) {
-        goto ready;
-    }
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_read(er, fd, buf, count);
+    er->deadline = saved;
+    return retval;
+}
 
-yield:
+ssize_t ef_routine_write_timeout(ef_routine_t *er, int fd, const void *buf, size_t count, int millisecs)
+{
+    long long saved;
+    ssize_t retval;
 
-    /*
-     * yield and wait event
-     */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
-    if (events & (EF_POLLERR | EF_POLLHUP)) {
-        error = EBADF;
-        retval = -1;
-    } else if(events & EF_POLLOUT) {
-ready:
-        retval = write(fd, buf, count);
-        if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, fd, EF_POLLOUT);
-            goto yield;
-        } else if (retval < 0) {
-            error = errno;
-        }
+    if (er == NULL) {
+        er = ef_routine_current();
     }
 
-    /*
-     * dissociate fd after event fired
-     */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 1, 0);
-
-    errno = error;
-
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_write(er, fd, buf, count);
+    er->deadline = saved;
     return retval;
 }
 
-ssize_t ef_routine_recv(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags)
+ssize_t ef_routine_recv_timeout(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags, int millisecs)
 {
-    int retval, error = 0;
-    long events;
+    long long saved;
+    ssize_t retval;
 
     if (er == NULL) {
         er = ef_routine_current();
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = sockfd;
-
-    /*
-     * always associate
-     */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, sockfd, EF_POLLIN, &er->poll_data, 0);
-    if (retval < 0) {
-        return retval;
-    } else if (retval > 0) {
-        goto ready;
-    }
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_recv(er, sockfd, buf, len, flags);
+    er->deadline = saved;
+    return retval;
+}
 
-yield:
+ssize_t ef_routine_send_timeout(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags, int millisecs)
+{
+    long long saved;
+    ssize_t retval;
 
-    /*
-     * yield and wait event
-     */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
-    if (events & EF_POLLERR) {
-        error = EBADF;
-        retval = -1;
-    } else if (events & (EF_POLLIN | EF_POLLHUP)) {
-ready:
-        retval = recv(sockfd, buf, len, flags);
-        if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, sockfd, EF_POLLIN | EF_POLLHUP);
-            goto yield;
-        } else if (retval < 0) {
-            error = errno;
-        }
+    if (er == NULL) {
+        er = ef_routine_current();
     }
 
-    /*
-     * dissociate fd after event fired
-     */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, sockfd, 1, 0);
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_send(er, sockfd, buf, len, flags);
+    er->deadline = saved;
+    return retval;
+}
 
-    errno = error;
+ssize_t ef_routine_recv_borrow_timeout(ef_routine_t *er, int sockfd, void **buf, int millisecs)
+{
+    long long saved;
+    ssize_t retval;
 
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_recv_borrow(er, sockfd, buf);
+    er->deadline = saved;
     return retval;
 }
 
-ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags)
+ssize_t ef_routine_read_arena_timeout(ef_routine_t *er, int fd, void **buf, int millisecs)
 {
-    int retval, error = 0;
-    long events;
+    long long saved;
+    ssize_t retval;
 
     if (er == NULL) {
         er = ef_routine_current();
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = sockfd;
-    /*
-     * always associate
-     */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, sockfd, EF_POLLOUT, &er->poll_data, 0);
-    if (retval < 0) {
-        return retval;
-    } else if (retval > 0) {
-        goto ready;
-    }
+    saved = ef_routine_deadline(er, millisecs);
+    retval = ef_routine_read_arena(er, fd, buf);
+    er->deadline = saved;
+    return retval;
+}
 
-yield:
+int ef_routine_sleep(ef_routine_t *er, int millisecs)
+{
+    long long saved;
+    int fd;
 
-    /*
-     * yield and wait event
-     */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
-    if (events & (EF_POLLERR | EF_POLLHUP)) {
-        error = EBADF;
-        retval = -1;
-    } else if(events & EF_POLLOUT) {
-ready:
-        retval = send(sockfd, buf, len, flags);
-        if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, sockfd, EF_POLLOUT);
-            goto yield;
-        } else if (retval < 0) {
-            error = errno;
-        }
+    if (er == NULL) {
+        er = ef_routine_current();
     }
 
     /*
-     * dissociate fd after event fired
+     * not waiting for any fd, nothing to dissociate when the timer fired,
+     * the fd waited for last is restored for the later waits
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, sockfd, 1, 0);
-
-    errno = error;
-
-    return retval;
+    saved = er->deadline;
+    fd = er->poll_data.fd;
+    er->deadline = ef_timer_now() + (long long)millisecs * 1000000;
+    er->poll_data.fd = -1;
+    ef_routine_park(er);
+    er->poll_data.fd = fd;
+    er->deadline = saved;
+    return 0;
 }
@@ -24,21 +24,78 @@
 #include "coroutine.h"
 #include "util/list.h"
 #include "poll.h"
+#include "timer.h"
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define FD_TYPE_LISTEN 1 // listen
 #define FD_TYPE_RWC    2 // read (recv), write (send), connect
+#define FD_TYPE_RECV   3 // multishot recv, io_uring only
+#define FD_TYPE_WAKE   4 // eventfd to wake an idle thread for work stealing
+#define FD_TYPE_DGRAM  5 // datagram socket owned by one routine, no accept
+#define FD_TYPE_TASK   6 // routines started with the loop, no socket
+
+#define EF_ENGINE_POLL  0 // readiness based, ef_create_poll
+#define EF_ENGINE_URING 1 // completion based, io_uring
+
+#define EF_ACCEPT_BUDGET 64 // connections accepted per loop iteration on a listener by default
+#define EF_BUFIO_SIZE    16384 // bytes of each direction of ef_bufio_t, the longest frame of ef_bufio_read_until
+
+/*
+ * the size classes of ef_arena_get, 1KB, 4KB, 16KB and 64KB, carved from
+ * slabs of EF_ARENA_SLAB bytes of buffers and their headers, mapped when needed
+ */
+#define EF_ARENA_CLASSES   4
+#define EF_ARENA_MIN_SHIFT 10
+#define EF_ARENA_SLAB      (256 * 1024)
+#define EF_ARENA_SIZE(cls) ((size_t)1 << (EF_ARENA_MIN_SHIFT + (cls) * 2))
+#define EF_LISTEN_INLINE 1  // start the handler right after accept, not at the end of the iteration
+#define EF_LISTEN_SHARED 2  // run the handlers on the shared stacks of ef_init_shared_stacks
+#define EF_LISTEN_LATENCY 4 // count the queue wait, first byte and handler latency of the connections
+
+#define EF_LATENCY_SUB_BITS 4  // 16 buckets for each power of 2 nanoseconds, within 1/16 of the value
+#define EF_LATENCY_MAX_BIT  39 // up to 2^40 nanoseconds (about 18 minutes), the last bucket takes the longer ones
+#define EF_LATENCY_BUCKETS  ((EF_LATENCY_MAX_BIT - EF_LATENCY_SUB_BITS + 2) << EF_LATENCY_SUB_BITS)
+
+#define EF_OVERLOAD_QUEUE  0 // keep the accepted connections in the ring until a routine is free, the default
+#define EF_OVERLOAD_DISARM 1 // stop accepting until a routine exits, the kernel backlog absorbs the burst
+#define EF_OVERLOAD_REJECT 2 // reset the accepted connections no routine can be created for
+
+#define EF_STACK_BUCKETS  40                   // log-linear buckets of stack pages, up to 2048 pages
+#define EF_STACK_SAMPLES  64                   // adaptive commit recalculated every so many runs
+#define EF_STACK_ADAPTIVE (EF_FIBER_TRACK | 4) // commit new stacks by the p99 depth of the handler
+
+#define EF_STACK_RELEASE_NOW      1  // give back the stack pages as soon as a routine exited
+#define EF_STACK_RELEASE_IDLE     2  // give back the stack pages of the routines pooled for millisecs
+#define EF_STACK_RELEASE_PRESSURE 3  // give back all pooled ones under memory pressure, checked every millisecs
+#define EF_STACK_PRESSURE         10 // under memory pressure when MemAvailable below this percent of MemTotal
 
 typedef struct _ef_routine ef_routine_t;
 typedef struct _ef_runtime ef_runtime_t;
-typedef struct _ef_queue_fd ef_queue_fd_t;
 typedef struct _ef_poll_data ef_poll_data_t;
 typedef struct _ef_listen_info ef_listen_info_t;
+typedef struct _ef_io_stat ef_io_stat_t;
+typedef struct _ef_buffer ef_buffer_t;
+typedef struct _ef_recv_state ef_recv_state_t;
+typedef struct _ef_pipe ef_pipe_t;
+typedef struct _ef_bufio ef_bufio_t;
+typedef struct _ef_stack_stat ef_stack_stat_t;
+typedef struct _ef_listen_stat ef_listen_stat_t;
+typedef struct _ef_runtime_stat ef_runtime_stat_t;
+typedef struct _ef_latency_hist ef_latency_hist_t;
 
 typedef long (*ef_routine_proc_t)(int fd, ef_routine_t *er);
 
+/*
+ * defined by <sys/socket.h> only with _GNU_SOURCE
+ */
+struct mmsghdr;
+
 struct _ef_poll_data {
     // socket类型（标识了socket能产生的事件类型，如服务端监听socket(FD_TYPE_LISTEN)会产生连接事件，客户端socket(FD_TYPE_RWC)会产生读写事件）
     int type;
@@ -52,13 +109,6 @@ struct _ef_poll_data {
     ef_routine_proc_t ef_proc;
 };
 
-// 客户端FD的队列
-struct _ef_queue_fd {
-    int fd;
-    // 用于链接所有客户端FD的结构
-    ef_list_entry_t list_entry;
-};
-
 struct _ef_listen_info {
     // IO多路复用器添加事件时传入的额外数据，用于关联多个数据结构
     ef_poll_data_t poll_data;
@@ -66,14 +116,185 @@ struct _ef_listen_info {
     ef_routine_proc_t ef_proc;
     // 用于链接到ef_runtime_t的监听链表的结构
     ef_list_entry_t list_entry;
-    // 用于链接到ef_runtime_t的客户端FD列表的结构
-    // 表示该监听socket所建立的所有客户端连接socket
-    ef_list_entry_t fd_list;
+    // 每次事件循环最多accept的连接数，避免连接风暴时饿死已建立的连接
+    int accept_budget;
+    // EF_LISTEN_INLINE等选项
+    int flags;
+    // 还有未accept的连接，预算用完或队列满时保持为1，下次事件循环继续
+    int readable;
+    // 最近一次accept所在的事件循环
+    unsigned long round;
+    // 已accept但还没有协程处理的连接，固定容量的环形队列，容量为2的幂
+    unsigned int ring_mask;
+    unsigned int head;
+    unsigned int tail;
+    // 处理函数的协程栈深度统计，同一个处理函数的监听socket共用
+    ef_stack_stat_t *stack_stat;
+    // 协程池用尽时的处理策略EF_OVERLOAD_*，以及连接在队列中最多等待的毫秒数，0表示不限
+    int overload;
+    int queue_millisecs;
+    // EF_OVERLOAD_DISARM时已停止accept，有协程结束后恢复
+    int disarmed;
+    // io_uring引擎上有未完成的accept请求
+    int accepting;
+    // 准入控制的计数
+    ef_listen_stat_t *stat;
+    // 各连接进入队列的时间，与fds一一对应，只在限制了等待时间时记录
+    long long *queued_at;
+    int fds[0];
+};
+
+// runtime拥有的接收缓冲区，只在数据到达时才被挑选出来借给协程
+struct _ef_buffer {
+    // 缓冲区中数据的长度
+    int len;
+    // 空闲时链接到runtime的空闲缓冲区链表，收到数据后链接到ef_recv_state_t的数据队列
+    ef_list_entry_t list_entry;
+};
+
+// 协程在某个socket上的multishot recv状态
+struct _ef_recv_state {
+    // 作为cqe的user_data，type为FD_TYPE_RECV
+    ef_poll_data_t poll_data;
+    // recv是否仍在内核中生效，是否以multishot提交
+    int armed;
+    int multishot;
+    // 缓冲区用尽，在runtime的nobufs_recv_list中等待归还
+    int nobufs;
+    ef_list_entry_t nobufs_entry;
+    // 协程是否在等待数据
+    int waiting;
+    // 对端已关闭
+    int eof;
+    // 待返回给协程的错误
+    int error;
+    // 已收到但协程还未取走的缓冲区
+    ef_list_entry_t buf_list;
+    // 用于链接到ef_routine_t的recv_list，或runtime的空闲链表
+    ef_list_entry_t list_entry;
+};
+
+// ef_routine_relay使用的pipe，用完后清空的pipe缓存在runtime中
+struct _ef_pipe {
+    int fds[2];
+    // 空闲时链接到runtime的空闲pipe链表
+    ef_list_entry_t list_entry;
+};
+
+// 协程在一个fd上的读写缓冲，输入预读到缓冲区，输出合并后一起写出，用完后缓存在runtime中
+struct _ef_bufio {
+    // 所属的协程，以及读写的fd
+    ef_routine_t *er;
+    int fd;
+    // 每次等待的超时，0表示不超时
+    int millisecs;
+    // 预读的输入，[in_start, in_end)是还未取走的数据，有数据可读时才从runtime取得缓冲区，取完后归还
+    char *in;
+    size_t in_cap;
+    size_t in_start;
+    size_t in_end;
+    // 合并的输出，还未写出的out_len字节，写出后归还缓冲区
+    char *out;
+    size_t out_cap;
+    size_t out_len;
+    // 链接到ef_routine_t的bufio_list，空闲时链接到runtime的空闲链表
+    ef_list_entry_t list_entry;
+};
+
+// 一个处理函数的协程栈深度（高水位）分布，按页计数，每个线程一份
+struct _ef_stack_stat {
+    ef_routine_proc_t proc;
+    long page_size;
+    // 统计的次数，以及见过的最大深度（字节）
+    unsigned long count;
+    size_t max;
+    // 1到8页各占一个桶，之后每个2的幂分为4个桶，见ef_stack_stat_percentile
+    unsigned long buckets[EF_STACK_BUCKETS];
+    // EF_STACK_ADAPTIVE时新建协程栈预先提交的大小，由p99得出，0表示样本还不够
+    size_t commit;
+    // 用于链接到runtime的stack_stat_list
+    ef_list_entry_t list_entry;
+};
+
+// 延迟的分布，纳秒，按对数分桶：小于16的每个值一个桶，之后每个2的幂分为16个桶
+struct _ef_latency_hist {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[EF_LATENCY_BUCKETS];
+};
+
+// 一个监听socket的准入控制计数，每个线程一份，事件循环结束后仍然保留
+struct _ef_listen_stat {
+    // ef_add_listen时传入的监听socket，其他线程上复制的监听socket也记为它
+    int socket;
+    // 监听的端口，不是TCP/IP的socket时为0
+    int port;
+    // accept的连接数，accept失败的次数（EMFILE等，不含EAGAIN），以及队列的最大长度
+    unsigned long accepted;
+    unsigned long failed;
+    unsigned long queue_max;
+    // 在队列中等待超时而被重置的连接数
+    unsigned long expired;
+    // 没有协程可用而被立即重置的连接数
+    unsigned long rejected;
+    // 因协程池用尽而停止accept的次数
+    unsigned long disarmed;
+    // EF_LISTEN_LATENCY时连接的延迟：在队列中等待协程的时间，从开始处理到写出第一个字节的时间，
+    // 以及处理函数从开始到关闭连接的时间
+    ef_latency_hist_t queue_wait;
+    ef_latency_hist_t first_byte;
+    ef_latency_hist_t duration;
+    // 用于链接到runtime的listen_stat_list
+    ef_list_entry_t list_entry;
+};
+
+// 读写操作的统计，fast表示第一次系统调用就完成，无需让出协程等待事件
+struct _ef_io_stat {
+    struct {
+        unsigned long fast;
+        unsigned long wait;
+        unsigned long bytes;
+    } read, write;
+    // 因等待IO事件而让出协程的次数
+    unsigned long yield_count;
+    // 从其他线程窃取的就绪协程数
+    unsigned long steal_count;
+};
+
+#define ef_io_stat_count(st, waited, count) \
+    do { if (waited) { ++(st).wait; } else { ++(st).fast; } if ((count) > 0) { (st).bytes += (count); } } while (0)
+
+// 一个线程的runtime的运行统计，由ef_runtime_stat从runtime与协程池中取得
+struct _ef_runtime_stat {
+    // 事件循环的次数，等待多路复用器的次数，以及返回的事件总数
+    unsigned long rounds;
+    unsigned long waits;
+    unsigned long events;
+    // 恢复协程执行的次数，每次切换进去再切换回来
+    unsigned long switches;
+    // 从协程池中复用的协程数，新建栈的协程数，收缩或腾出位置时释放的协程数
+    unsigned long pool_hits;
+    unsigned long pool_maps;
+    unsigned long pool_frees;
+    // 协程池中现有的协程数，以及其中空闲的
+    unsigned long coroutines;
+    unsigned long free_coroutines;
+    // 分级IO缓冲区映射的字节数，以及借出的字节数
+    unsigned long arena_mapped;
+    unsigned long arena_used;
+    // 读写操作的统计
+    ef_io_stat_t io;
 };
 
 struct _ef_runtime {
     // 多路复用器
     ef_poll_t *p;
+    // IO引擎，EF_ENGINE_POLL或EF_ENGINE_URING
+    int engine;
+    // io_uring引擎是否使用multishot accept与multishot recv
+    int accept_multishot;
+    int recv_multishot;
     // 停止状态标志位
     int stopping;
     //
@@ -82,25 +303,230 @@ struct _ef_runtime {
     int count_per_shrink;
     // 协程池
     ef_coroutine_pool_t co_pool;
+    // 空闲协程栈内存页的归还策略EF_STACK_RELEASE_*，以及空闲时间或检查间隔，下次检查内存压力的时间
+    int release_policy;
+    int release_millisecs;
+    long long release_check;
+    // 定时器，IO超时与ef_routine_sleep使用，事件循环按最近的到期时间阻塞
+    ef_timer_wheel_t timers;
     // 监听链表，是个双向链表的结构，初始化时只有一个虚拟头节点，自己指向自己，有新的监听FD时，会将其封装成entry插入到这个链表末尾
     ef_list_entry_t listen_list;
-    // 空闲的ef_queue_fd_t，一个ef_queue_fd_t表示一个客户端连接。缓存ef_queue_fd_t对象，因为客户端连接建立和断开比较频繁
-    ef_list_entry_t free_fd_list;
+    // 事件循环的次数
+    unsigned long round;
+    // 等待多路复用器的次数，以及返回的事件总数
+    unsigned long wait_count;
+    unsigned long event_count;
+    // 有监听socket还可以继续accept，事件循环不阻塞
+    int accept_pending;
+    // 读写快速路径的命中统计
+    ef_io_stat_t io_stat;
+    // 各处理函数的协程栈深度统计，事件循环结束后仍然保留
+    ef_list_entry_t stack_stat_list;
+    // 各监听socket的准入控制计数，事件循环结束后仍然保留
+    ef_list_entry_t listen_stat_list;
+    // 接收缓冲区，共buf_count个，每个buf_size字节，使用io_uring时注册为provided buffer ring
+    char *buf_base;
+    size_t buf_size;
+    int buf_count;
+    ef_buffer_t *bufs;
+    // 空闲的接收缓冲区，使用io_uring时由内核管理
+    ef_list_entry_t free_buf_list;
+    // 空闲的ef_recv_state_t
+    ef_list_entry_t free_recv_list;
+    // 缓冲区用尽而停止的ef_recv_state_t，有缓冲区归还时重新提交
+    ef_list_entry_t nobufs_recv_list;
+    // 空闲的pipe，以及其数量
+    ef_list_entry_t free_pipe_list;
+    int pipe_count;
+    // 空闲的ef_bufio_t，以及其数量
+    ef_list_entry_t free_bufio_list;
+    int bufio_count;
+    // 按大小分级的IO缓冲区，使用时才从slab中切分，空闲的链接在各级的空闲链表上
+    ef_list_entry_t arena_free[EF_ARENA_CLASSES];
+    // 已映射的slab，所有协程结束后释放，以及映射与借出的字节数
+    ef_list_entry_t arena_slabs;
+    unsigned long arena_mapped;
+    unsigned long arena_used;
+    // 多线程运行时的线程数，以及本runtime所在线程的下标
+    int thread_count;
+    int thread_index;
+    // 所有线程的runtime，下标0为调用ef_run_loop的线程，其余由框架创建
+    ef_runtime_t **runtimes;
+    pthread_t thread;
+    // 各线程初始化完成后通知第一个线程
+    sem_t *started;
+    // 工作窃取，就绪的协程先放入ready_list，空闲的线程可以取走一半到自己的线程上恢复执行
+    int steal;
+    pthread_mutex_t ready_lock;
+    ef_list_entry_t ready_list;
+    int ready_count;
+    // 阻塞在多路复用器上时为1，其他线程有多余的就绪协程时写wake_fd唤醒
+    int idle;
+    int wake_fd;
+    ef_poll_data_t wake_data;
+    // 在其他线程上结束的本线程的协程，由本线程放回协程池，受ready_lock保护
+    ef_list_entry_t remote_free_list;
+    // 在本线程上运行的其他线程的协程数
+    int foreign;
 };
 
 struct _ef_routine {
     ef_coroutine_t co;
     ef_poll_data_t poll_data;
+    // 协程在各个socket上的multishot recv状态
+    ef_list_entry_t recv_list;
+    // 协程还未归还的读写缓冲
+    ef_list_entry_t bufio_list;
+    // 工作窃取时链接到runtime的ready_list，以及恢复时传入的事件
+    ef_list_entry_t ready_entry;
+    long ready_events;
+    // 借出未归还的接收缓冲区等属于当前线程的资源数，不为0时不能被其他线程取走
+    int borrowed;
+    // _timeout调用的截止时间，CLOCK_MONOTONIC纳秒，0表示没有
+    long long deadline;
+    // 等待时挂在runtime时间轮上的定时器，到期时timedout置1
+    ef_timer_t timer;
+    int timedout;
+    // io_uring的IORING_OP_LINK_TIMEOUT使用的截止时间
+    struct timespec link_timeout;
+    // 开启EF_FIBER_TRACK时，协程结束时把栈深度计入所属处理函数的统计
+    ef_stack_stat_t *stack_stat;
+    // EF_LISTEN_LATENCY时计入延迟的监听socket统计，关闭连接后为NULL，开始处理的时间，以及是否已写出第一个字节
+    // 延迟只按accept得到的连接conn_fd统计，poll_data.fd是最近一次等待的fd
+    ef_listen_stat_t *latency_stat;
+    int conn_fd;
+    long long started_at;
+    int replied;
 };
 
-extern ef_runtime_t *ef_runtime;
+// 每个线程都有自己的runtime
+extern __thread ef_runtime_t *ef_runtime;
 
 #define ef_routine_current() ((ef_routine_t*)ef_coroutine_current(&ef_runtime->co_pool))
 
 int ef_init(ef_runtime_t *rt, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink);
+int ef_init_engine(ef_runtime_t *rt, int engine, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink);
+
+/*
+ * run ef_proc in a routine for each connection accepted on socket, a datagram
+ * socket (SOCK_DGRAM) is detected and not accepted on, a routine is started on
+ * each thread with a dup of it when the loop runs, and receives by
+ * ef_routine_recvmmsg, which returns 0 when the loop is stopping
+ */
 int ef_add_listen(ef_runtime_t *rt, int socket, ef_routine_proc_t ef_proc);
+
+/*
+ * the same as ef_add_listen, accept at most accept_budget connections on
+ * the socket per loop iteration, 0 for EF_ACCEPT_BUDGET, flags EF_LISTEN_INLINE
+ * starts the handler right after accept instead of at the end of the iteration,
+ * EF_LISTEN_SHARED runs the handlers on shared stacks, see ef_init_shared_stacks,
+ * EF_LISTEN_LATENCY counts the latency of each connection, see ef_listen_stat
+ */
+int ef_add_listen_ex(ef_runtime_t *rt, int socket, ef_routine_proc_t ef_proc, int accept_budget, int flags);
+
+/*
+ * what to do with the new connections on socket when the coroutine pool
+ * reached limit_max, EF_OVERLOAD_QUEUE keeps them in the ring of the listener,
+ * reset if waited longer than queue_millisecs (0 for no limit), EF_OVERLOAD_DISARM
+ * stops accepting until a routine exits, EF_OVERLOAD_REJECT resets them at once,
+ * call after ef_add_listen, applied to the threads by ef_init_threads,
+ * return -1 if no listener on socket
+ */
+int ef_listen_overload(ef_runtime_t *rt, int socket, int policy, int queue_millisecs);
+
+/*
+ * start count routines running ef_proc on each thread when the loop runs,
+ * with fd -1, such as the clients of a load generator or background jobs,
+ * flags EF_LISTEN_SHARED runs them on shared stacks, call before ef_run_loop,
+ * the loop stops when stopping is set and they all returned
+ */
+int ef_add_routine(ef_runtime_t *rt, ef_routine_proc_t ef_proc, int count, int flags);
+
+/*
+ * the admission counters of the listener on socket, summed over the threads of rt
+ * into st, queue_max is the longest of them, return -1 if no listener on socket,
+ * with EF_LISTEN_LATENCY the latency histograms merged as well
+ */
+int ef_listen_stat(ef_runtime_t *rt, int socket, ef_listen_stat_t *st);
+
+/*
+ * the counters of the runtime on thread index of rt, the sum of all the
+ * threads if thread is -1, read while the threads are running, each
+ * counter is exact but they are not a snapshot taken at the same time,
+ * return -1 if no such thread
+ */
+int ef_runtime_stat(ef_runtime_t *rt, int thread, ef_runtime_stat_t *st);
+
+/*
+ * count one sample of nanosecs into h, atomic so that other threads may read or record
+ */
+void ef_latency_record(ef_latency_hist_t *h, long long nanosecs);
+
+/*
+ * the nanoseconds that percent (such as 99.9) of the counted samples took at most,
+ * the upper bound of the bucket, but not more than the max seen, 0 if nothing counted
+ */
+unsigned long ef_latency_percentile(const ef_latency_hist_t *h, double percent);
+
+/*
+ * run the loop on nthreads threads, each with its own runtime, poller and
+ * coroutine pool created like rt, listen sockets are replicated per thread,
+ * by SO_REUSEPORT if the socket has it set, or else shared, call after ef_init,
+ * with steal set an idle thread takes half of the ready routines of the busiest
+ * one, only for the pollers keep no fd state (poll.migratable), else ignored
+ */
+int ef_init_threads(ef_runtime_t *rt, int nthreads, int steal);
 int ef_run_loop(ef_runtime_t *rt);
 
+/*
+ * create count receive buffers of size bytes owned by the runtime,
+ * used by ef_routine_recv_borrow, must be called after ef_init
+ */
+int ef_init_buffers(ef_runtime_t *rt, int count, size_t size);
+
+/*
+ * commit bytes of each new routine stack at once, and expand it by at least
+ * grow bytes when it overflows, flags EF_FIBER_PREFAULT populates the pages
+ * on creating, so handlers with big locals take no SIGSEGV on the request path,
+ * must be called after ef_init, applied to the threads by ef_init_threads
+ */
+int ef_init_stack(ef_runtime_t *rt, size_t commit, size_t grow, int flags);
+
+/*
+ * give back the touched stack pages of the pooled routines by madvise with
+ * advice, MADV_DONTNEED (or 0) returns the memory at once, MADV_FREE is
+ * cheaper and lets the kernel take them when it needs, the routines stay
+ * pooled, so RSS drops after a traffic spike without munmap and mmap again,
+ * policy is EF_STACK_RELEASE_NOW, EF_STACK_RELEASE_IDLE or EF_STACK_RELEASE_PRESSURE,
+ * must be called after ef_init, applied to the threads by ef_init_threads
+ */
+int ef_init_stack_release(ef_runtime_t *rt, int policy, int millisecs, int advice);
+
+/*
+ * map count shared stacks per thread, the routines of listeners added with
+ * EF_LISTEN_SHARED run on them in turn, their frames copied to the heap
+ * when others take the stack, for a lot of mostly idle connections,
+ * such a routine stays on its thread, and waits for readiness then does
+ * the syscall on io_uring as well, the kernel never holds its stack memory,
+ * without shared stacks the flag is ignored, must be called after ef_init
+ */
+int ef_init_shared_stacks(ef_runtime_t *rt, int count);
+
+/*
+ * with EF_FIBER_TRACK in the flags of ef_init_stack, the stack high-water mark
+ * of each routine is counted to its handler when it exits, and with
+ * EF_STACK_ADAPTIVE new stacks of a handler are committed by its p99 depth,
+ * ef_stack_stat sums the threads of rt for the handler proc into st,
+ * return -1 if no listener has the handler
+ */
+int ef_stack_stat(ef_runtime_t *rt, ef_routine_proc_t proc, ef_stack_stat_t *st);
+
+/*
+ * the bytes that percent of the counted routines used at most, rounded up
+ * to the upper bound of the bucket, 0 if nothing counted
+ */
+size_t ef_stack_stat_percentile(const ef_stack_stat_t *st, int percent);
+
 int ef_routine_close(ef_routine_t *er, int fd);
 int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 ssize_t ef_routine_read(ef_routine_t *er, int fd, void *buf, size_t count);
@@ -108,6 +534,148 @@ ssize_t ef_routine_write(ef_routine_t *er, int fd, const void *buf, size_t count
 ssize_t ef_routine_recv(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags);
 ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags);
 
+/*
+ * readv and recvmsg return once some data received as read does, writev and
+ * sendmsg resume on partial writes until all the vectors written, so they
+ * return less than the total only if failed after part of it written
+ */
+ssize_t ef_routine_readv(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt);
+ssize_t ef_routine_writev(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt);
+ssize_t ef_routine_recvmsg(ef_routine_t *er, int sockfd, struct msghdr *msg, int flags);
+ssize_t ef_routine_sendmsg(ef_routine_t *er, int sockfd, const struct msghdr *msg, int flags);
+
+/*
+ * receive up to vlen datagrams in one syscall, wait when none, return the
+ * number received, or 0 if no more datagram and the loop is stopping
+ */
+int ef_routine_recvmmsg(ef_routine_t *er, int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
+/*
+ * send vlen datagrams in as few syscalls as possible, wait when the socket
+ * buffer is full, return the number sent, less than vlen only if failed
+ */
+int ef_routine_sendmmsg(ef_routine_t *er, int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
+/*
+ * receive into a runtime owned buffer picked when data arrived, *buf points
+ * to the borrowed buffer when returned > 0, give it back by ef_routine_buffer_release
+ */
+ssize_t ef_routine_recv_borrow(ef_routine_t *er, int sockfd, void **buf);
+void ef_routine_buffer_release(ef_routine_t *er, void *buf);
+
+/*
+ * move up to len bytes from fd_in to fd_out by splice(2), one of them must be
+ * a pipe, wait on the other one when EAGAIN, flags are the ones of splice(2)
+ */
+ssize_t ef_routine_splice(ef_routine_t *er, int fd_in, int fd_out, size_t len, unsigned int flags);
+
+/*
+ * copy from fd_in to fd_out until fd_in reaches EOF, through a pipe of the
+ * runtime without user space copy, return the bytes relayed, or -1 if failed
+ */
+ssize_t ef_routine_relay(ef_routine_t *er, int fd_in, int fd_out);
+
+/*
+ * a buffer of at least size bytes from the size classes of the runtime, *cap
+ * set to the size of the class, NULL with ENOBUFS if larger than the largest,
+ * give it back to the same runtime by ef_arena_put
+ */
+void *ef_arena_get(ef_runtime_t *rt, size_t size, size_t *cap);
+void ef_arena_put(ef_runtime_t *rt, void *buf);
+
+/*
+ * wait until fd readable with no buffer held, then read into an arena buffer
+ * of the class fitting the bytes pending (FIONREAD), *buf points to it when
+ * returned > 0, give it back by ef_routine_arena_release, an idle connection
+ * waiting here takes no buffer memory at all
+ */
+ssize_t ef_routine_read_arena(ef_routine_t *er, int fd, void **buf);
+void ef_routine_arena_release(ef_routine_t *er, void *buf);
+
+/*
+ * buffered reads and writes on fd for the routine, the buffers taken from the
+ * arena of the runtime only while holding data, the input one when readable
+ * and the output one until flushed, the routine stays on the thread until
+ * detached, millisecs limits each wait (0 for none), returned to the runtime
+ * when the routine exited, the output not flushed then is dropped
+ */
+ef_bufio_t *ef_bufio_attach(ef_routine_t *er, int fd, int millisecs);
+
+/*
+ * flush the output and give the buffers back, the input buffered is dropped,
+ * fd not closed, return -1 if the flush failed
+ */
+int ef_bufio_detach(ef_bufio_t *b);
+
+/*
+ * reads are served from the input buffer, when it is empty a read tries fd
+ * at once, the output is flushed only if that would wait, so the responses
+ * to pipelined requests go out together, then waits for the input
+ */
+ssize_t ef_bufio_read(ef_bufio_t *b, void *buf, size_t count);
+
+/*
+ * read exactly count bytes, fewer only at EOF, -1 if failed
+ */
+ssize_t ef_bufio_read_exact(ef_bufio_t *b, void *buf, size_t count);
+
+/*
+ * read ahead until delim shows up, *data points to the bytes up to and including
+ * delim in the input buffer, valid until the next read on b, return the length,
+ * 0 at EOF before delim, -1 with EMSGSIZE if not found in EF_BUFIO_SIZE bytes
+ */
+ssize_t ef_bufio_read_until(ef_bufio_t *b, const void *delim, size_t delim_len, char **data);
+
+/*
+ * the same as ef_bufio_read_until, -1 with EMSGSIZE as soon as limit bytes
+ * (at most EF_BUFIO_SIZE) are buffered without delim, nothing more read then
+ */
+ssize_t ef_bufio_read_until_limit(ef_bufio_t *b, const void *delim, size_t delim_len, size_t limit, char **data);
+
+/*
+ * copy into the output buffer, flushed when full, a write no smaller than
+ * the buffer goes to fd directly after the buffered ones, return count or -1
+ */
+ssize_t ef_bufio_write(ef_bufio_t *b, const void *buf, size_t count);
+
+/*
+ * write out all of the output buffer, return 0 or -1
+ */
+int ef_bufio_flush(ef_bufio_t *b);
+
+// 输入缓冲区中还未取走的字节数，不为0时不需要等待即可读取
+#define ef_bufio_buffered(b) ((b)->in_end - (b)->in_start)
+
+/*
+ * send up to count bytes of in_fd from *offset to out_fd by sendfile(2),
+ * *offset is advanced by the bytes sent, wait on out_fd when EAGAIN
+ */
+ssize_t ef_routine_sendfile(ef_routine_t *er, int out_fd, int in_fd, off_t *offset, size_t count);
+
+/*
+ * the same as the ones without _timeout, but fail with ETIMEDOUT if not done
+ * in millisecs, the deadline covers the whole call however many times it waits
+ */
+int ef_routine_connect_timeout(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen, int millisecs);
+ssize_t ef_routine_read_timeout(ef_routine_t *er, int fd, void *buf, size_t count, int millisecs);
+ssize_t ef_routine_write_timeout(ef_routine_t *er, int fd, const void *buf, size_t count, int millisecs);
+ssize_t ef_routine_recv_timeout(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags, int millisecs);
+ssize_t ef_routine_send_timeout(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags, int millisecs);
+ssize_t ef_routine_recv_borrow_timeout(ef_routine_t *er, int sockfd, void **buf, int millisecs);
+ssize_t ef_routine_read_arena_timeout(ef_routine_t *er, int fd, void **buf, int millisecs);
+
+/*
+ * set a deadline millisecs later for all the waits of the routine until
+ * restored, a nearer one set before is kept, return the previous one,
+ * put it back to er->deadline when done, for the ones covering several calls
+ */
+long long ef_routine_deadline(ef_routine_t *er, int millisecs);
+
+/*
+ * suspend the routine for millisecs, 0 just gives the others a chance to run
+ */
+int ef_routine_sleep(ef_routine_t *er, int millisecs);
+
 #define ef_wrap_close(fd) \
     ef_routine_close(NULL, fd)
 
@@ -126,4 +694,67 @@ ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t le
 #define ef_wrap_send(sockfd, buf, len, flags) \
     ef_routine_send(NULL, sockfd, buf, len, flags)
 
+#define ef_wrap_readv(fd, iov, iovcnt) \
+    ef_routine_readv(NULL, fd, iov, iovcnt)
+
+#define ef_wrap_writev(fd, iov, iovcnt) \
+    ef_routine_writev(NULL, fd, iov, iovcnt)
+
+#define ef_wrap_recvmsg(sockfd, msg, flags) \
+    ef_routine_recvmsg(NULL, sockfd, msg, flags)
+
+#define ef_wrap_sendmsg(sockfd, msg, flags) \
+    ef_routine_sendmsg(NULL, sockfd, msg, flags)
+
+#define ef_wrap_recvmmsg(sockfd, msgvec, vlen, flags) \
+    ef_routine_recvmmsg(NULL, sockfd, msgvec, vlen, flags)
+
+#define ef_wrap_sendmmsg(sockfd, msgvec, vlen, flags) \
+    ef_routine_sendmmsg(NULL, sockfd, msgvec, vlen, flags)
+
+#define ef_wrap_recv_borrow(sockfd, buf) \
+    ef_routine_recv_borrow(NULL, sockfd, buf)
+
+#define ef_wrap_buffer_release(buf) \
+    ef_routine_buffer_release(NULL, buf)
+
+#define ef_wrap_read_arena(fd, buf) \
+    ef_routine_read_arena(NULL, fd, buf)
+
+#define ef_wrap_arena_release(buf) \
+    ef_routine_arena_release(NULL, buf)
+
+#define ef_wrap_splice(fd_in, fd_out, len, flags) \
+    ef_routine_splice(NULL, fd_in, fd_out, len, flags)
+
+#define ef_wrap_relay(fd_in, fd_out) \
+    ef_routine_relay(NULL, fd_in, fd_out)
+
+#define ef_wrap_sendfile(out_fd, in_fd, offset, count) \
+    ef_routine_sendfile(NULL, out_fd, in_fd, offset, count)
+
+#define ef_wrap_connect_timeout(sockfd, addr, addrlen, millisecs) \
+    ef_routine_connect_timeout(NULL, sockfd, addr, addrlen, millisecs)
+
+#define ef_wrap_read_timeout(fd, buf, count, millisecs) \
+    ef_routine_read_timeout(NULL, fd, buf, count, millisecs)
+
+#define ef_wrap_write_timeout(fd, buf, count, millisecs) \
+    ef_routine_write_timeout(NULL, fd, buf, count, millisecs)
+
+#define ef_wrap_recv_timeout(sockfd, buf, len, flags, millisecs) \
+    ef_routine_recv_timeout(NULL, sockfd, buf, len, flags, millisecs)
+
+#define ef_wrap_send_timeout(sockfd, buf, len, flags, millisecs) \
+    ef_routine_send_timeout(NULL, sockfd, buf, len, flags, millisecs)
+
+#define ef_wrap_recv_borrow_timeout(sockfd, buf, millisecs) \
+    ef_routine_recv_borrow_timeout(NULL, sockfd, buf, millisecs)
+
+#define ef_wrap_read_arena_timeout(fd, buf, millisecs) \
+    ef_routine_read_arena_timeout(NULL, fd, buf, millisecs)
+
+#define ef_wrap_sleep(millisecs) \
+    ef_routine_sleep(NULL, millisecs)
+
 #endif
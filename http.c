@@ -0,0 +1,383 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#define _GNU_SOURCE
+
+#include "http.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * the handler and the limits shared by all threads
+ */
+static ef_http_handler_t ef_http_handler = NULL;
+static size_t ef_http_max_header = EF_HTTP_HEADER_SIZE;
+static size_t ef_http_max_body = EF_HTTP_BODY_SIZE;
+static int ef_http_timeout = EF_HTTP_TIMEOUT;
+static int ef_http_max_requests = 0;
+
+static const struct {
+    int status;
+    const char *reason;
+} ef_http_reasons[] = {
+    {100, "Continue"},
+    {200, "OK"},
+    {201, "Created"},
+    {204, "No Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {304, "Not Modified"},
+    {400, "Bad Request"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {408, "Request Timeout"},
+    {413, "Content Too Large"},
+    {431, "Request Header Fields Too Large"},
+    {500, "Internal Server Error"},
+    {501, "Not Implemented"},
+    {503, "Service Unavailable"},
+    {505, "HTTP Version Not Supported"},
+};
+
+static const char *ef_http_reason(int status)
+{
+    for (int i = 0; i < sizeof(ef_http_reasons) / sizeof(ef_http_reasons[0]); ++i) {
+        if (ef_http_reasons[i].status == status) {
+            return ef_http_reasons[i].reason;
+        }
+    }
+    return "Unknown";
+}
+
+int ef_http_init(ef_http_handler_t handler, size_t max_header, size_t max_body, int timeout_millisecs, int max_requests)
+{
+    /*
+     * the header read into the input buffer of ef_bufio,
+     * the body into a buffer of the arena
+     */
+    if (!handler || max_header > EF_BUFIO_SIZE || max_body > EF_ARENA_SIZE(EF_ARENA_CLASSES - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    ef_http_handler = handler;
+    ef_http_max_header = max_header ? max_header : EF_HTTP_HEADER_SIZE;
+    ef_http_max_body = max_body ? max_body : EF_HTTP_BODY_SIZE;
+    ef_http_timeout = (timeout_millisecs > 0) ? timeout_millisecs : EF_HTTP_TIMEOUT;
+    ef_http_max_requests = (max_requests > 0) ? max_requests : 0;
+    return 0;
+}
+
+const char *ef_http_header(const ef_http_request_t *req, const char *name)
+{
+    for (int i = 0; i < req->header_count; ++i) {
+        if (strcasecmp(req->headers[i].name, name) == 0) {
+            return req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+int ef_http_respond(ef_http_request_t *req, int status, const char *content_type, const void *body, size_t len)
+{
+    char head[256];
+    int head_len;
+
+    if (req->responded) {
+        errno = EINVAL;
+        return -1;
+    }
+    req->responded = 1;
+
+    /*
+     * keep-alive is the default of HTTP/1.1 only
+     */
+    head_len = snprintf(head, sizeof(head), "HTTP/1.%d %d %s\r\nContent-Length: %zu\r\n%s%s%s%s\r\n",
+        req->minor, status, ef_http_reason(status), len,
+        content_type ? "Content-Type: " : "", content_type ? content_type : "", content_type ? "\r\n" : "",
+        !req->keepalive ? "Connection: close\r\n" : (req->minor == 0 ? "Connection: keep-alive\r\n" : ""));
+    if (head_len < 0 || head_len >= (int)sizeof(head)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ef_bufio_write(req->bufio, head, head_len) < 0) {
+        return -1;
+    }
+    if (len && strcmp(req->method, "HEAD") != 0 && ef_bufio_write(req->bufio, body, len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// 请求有误时响应并关闭连接
+static void ef_http_error(ef_http_request_t *req, int status)
+{
+    const char *reason = ef_http_reason(status);
+
+    req->keepalive = 0;
+    if (!req->method) {
+        req->method = "GET";
+    }
+    ef_http_respond(req, status, "text/plain; charset=utf-8", reason, strlen(reason));
+}
+
+static char *ef_http_trim(char *s, char *end)
+{
+    while (s < end && (*s == ' ' || *s == '\t')) {
+        ++s;
+    }
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    *end = '\0';
+    return s;
+}
+
+/*
+ * split the header block of len bytes ending with an empty line in place,
+ * return 0, or the status to respond with if it is not a valid request
+ */
+static int ef_http_parse(ef_http_request_t *req, char *data, size_t len)
+{
+    char *line, *eol, *sp, *colon;
+    char *last = data + len - 2;
+
+    if (memchr(data, '\0', len)) {
+        return 400;
+    }
+
+    /*
+     * the empty line ends every line search below
+     */
+    *last = '\0';
+
+    eol = strstr(data, "\r\n");
+    *eol = '\0';
+    sp = strchr(data, ' ');
+    if (!sp || sp == data) {
+        return 400;
+    }
+    *sp = '\0';
+    req->method = data;
+    req->target = sp + 1;
+    sp = strchr(sp + 1, ' ');
+    if (!sp || sp == req->target) {
+        return 400;
+    }
+    *sp++ = '\0';
+    if (strncmp(sp, "HTTP/", 5) != 0) {
+        return 400;
+    }
+    if (strncmp(sp, "HTTP/1.", 7) != 0 || (sp[7] != '0' && sp[7] != '1') || sp + 8 != eol) {
+        return 505;
+    }
+    req->minor = sp[7] - '0';
+
+    for (line = eol + 2; line < last; line = eol + 2) {
+        eol = strstr(line, "\r\n");
+        colon = memchr(line, ':', eol - line);
+        if (!colon || colon == line || colon[-1] == ' ' || colon[-1] == '\t') {
+            return 400;
+        }
+        if (req->header_count == EF_HTTP_MAX_HEADERS) {
+            return 431;
+        }
+        *colon = '\0';
+        req->headers[req->header_count].name = line;
+        req->headers[req->header_count].value = ef_http_trim(colon + 1, eol);
+        ++req->header_count;
+    }
+    return 0;
+}
+
+/*
+ * the connection kept alive after the request, and the body length
+ */
+static int ef_http_framing(ef_http_request_t *req, size_t *body_len)
+{
+    const char *conn = ef_http_header(req, "Connection");
+    const char *cl = ef_http_header(req, "Content-Length");
+    char *end;
+
+    req->keepalive = (req->minor == 1);
+    if (conn && strcasestr(conn, "close")) {
+        req->keepalive = 0;
+    } else if (conn && strcasestr(conn, "keep-alive")) {
+        req->keepalive = 1;
+    }
+    if (ef_http_max_requests && req->served + 1 >= ef_http_max_requests) {
+        req->keepalive = 0;
+    }
+
+    /*
+     * no chunked request body, its framing is not followed
+     */
+    if (ef_http_header(req, "Transfer-Encoding")) {
+        return 501;
+    }
+    *body_len = 0;
+    if (cl) {
+        if (*cl < '0' || *cl > '9') {
+            return 400;
+        }
+        errno = 0;
+        unsigned long long v = strtoull(cl, &end, 10);
+        if (errno || *end != '\0') {
+            return 400;
+        }
+        if (v > ef_http_max_body) {
+            return 413;
+        }
+        *body_len = (size_t)v;
+    }
+    return 0;
+}
+
+/*
+ * the header block moved to hold, the body read after it may refill
+ * the input buffer, the strings of req rebased to the copy
+ */
+static void ef_http_rebase(ef_http_request_t *req, const char *from, char *to)
+{
+    req->method = to + (req->method - from);
+    req->target = to + (req->target - from);
+    for (int i = 0; i < req->header_count; ++i) {
+        req->headers[i].name = to + (req->headers[i].name - from);
+        req->headers[i].value = to + (req->headers[i].value - from);
+    }
+}
+
+long ef_http_proc(int fd, ef_routine_t *er)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    ef_http_request_t req;
+    ef_bufio_t *b;
+    char *data, *head = NULL, *body = NULL;
+    size_t body_len;
+    ssize_t len;
+    long long saved = er->deadline;
+    int status;
+
+    if (!ef_http_handler) {
+        return -1;
+    }
+    b = ef_bufio_attach(er, fd, ef_http_timeout);
+    if (!b) {
+        return -1;
+    }
+
+    for (int served = 0; ; ++served) {
+        memset(&req, 0, sizeof(req));
+        req.er = er;
+        req.bufio = b;
+        req.served = served;
+        // 解析出版本之前按HTTP/1.1响应错误
+        req.minor = 1;
+
+        /*
+         * one deadline for the whole request, header and body, a client
+         * sending a byte at a time cannot hold the connection, the
+         * per wait timeout of b is only for writing the responses
+         */
+        ef_routine_deadline(er, ef_http_timeout);
+
+        /*
+         * the input buffer taken only when the next request arrives,
+         * the pipelined responses flushed before waiting for it
+         */
+        len = ef_bufio_read_until_limit(b, "\r\n\r\n", 4, ef_http_max_header, &data);
+        if (len <= 0) {
+            if (len < 0 && errno == EMSGSIZE) {
+                ef_http_error(&req, 431);
+            } else if (len < 0 && errno == ETIMEDOUT && ef_bufio_buffered(b) > 0) {
+                ef_http_error(&req, 408);
+            }
+            break;
+        }
+        status = ef_http_parse(&req, data, len);
+        if (!status) {
+            status = ef_http_framing(&req, &body_len);
+        }
+        if (status) {
+            ef_http_error(&req, status);
+            break;
+        }
+
+        if (body_len) {
+            head = (char *)ef_arena_get(rt, len, NULL);
+            body = (char *)ef_arena_get(rt, body_len, NULL);
+            if (!head || !body) {
+                ef_http_error(&req, 503);
+                goto release;
+            }
+            memcpy(head, data, len);
+            ef_http_rebase(&req, data, head);
+
+            /*
+             * the client may wait for it before sending the body,
+             * no need if some of the body is already here
+             */
+            const char *expect = ef_http_header(&req, "Expect");
+            if (expect && strcasecmp(expect, "100-continue") == 0 && ef_bufio_buffered(b) == 0) {
+                static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                if (ef_bufio_write(b, cont, sizeof(cont) - 1) < 0 || ef_bufio_flush(b) < 0) {
+                    goto release;
+                }
+            }
+            len = ef_bufio_read_exact(b, body, body_len);
+            if (len != (ssize_t)body_len) {
+                if (len < 0 && errno == ETIMEDOUT) {
+                    ef_http_error(&req, 408);
+                }
+                goto release;
+            }
+            req.body = body;
+            req.body_len = body_len;
+        }
+
+        er->deadline = saved;
+        status = ef_http_handler(&req);
+        if (!req.responded) {
+            ef_http_error(&req, 500);
+        }
+        if (body_len) {
+            ef_arena_put(rt, head);
+            ef_arena_put(rt, body);
+            head = body = NULL;
+        }
+        if (status < 0 || !req.keepalive) {
+            break;
+        }
+    }
+
+release:
+    er->deadline = saved;
+    if (head) {
+        ef_arena_put(rt, head);
+    }
+    if (body) {
+        ef_arena_put(rt, body);
+    }
+    ef_bufio_detach(b);
+    return 0;
+}
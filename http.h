@@ -0,0 +1,99 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _HTTP_HEADER_
+#define _HTTP_HEADER_
+
+#include "framework.h"
+
+/*
+ * the default limits of ef_http_init, a request header must fit in
+ * EF_BUFIO_SIZE, a body in the largest class of the buffer arena
+ */
+#define EF_HTTP_HEADER_SIZE 8192
+#define EF_HTTP_BODY_SIZE   65536
+#define EF_HTTP_TIMEOUT     10000
+#define EF_HTTP_MAX_HEADERS 32
+
+typedef struct _ef_http_header ef_http_header_t;
+typedef struct _ef_http_request ef_http_request_t;
+
+struct _ef_http_header {
+    const char *name;
+    const char *value;
+};
+
+// 一个请求，字符串都以0结尾，处理函数返回后失效
+struct _ef_http_request {
+    // 处理请求的协程，以及连接上的读写缓冲
+    ef_routine_t *er;
+    ef_bufio_t *bufio;
+    // 请求行，target包括path与query，HTTP/1.minor
+    const char *method;
+    const char *target;
+    int minor;
+    ef_http_header_t headers[EF_HTTP_MAX_HEADERS];
+    int header_count;
+    // Content-Length的请求体，没有时为NULL
+    const char *body;
+    size_t body_len;
+    // 响应后是否保持连接，处理函数可以清零以在响应后关闭
+    int keepalive;
+    // 处理函数是否已响应，没有响应时返回500
+    int responded;
+    // 连接上在这个请求之前已处理的请求数
+    int served;
+};
+
+/*
+ * called for each request, respond by ef_http_respond, return -1 to close
+ * the connection, the responses are buffered, they go out together when no
+ * more pipelined request buffered, or the output buffer is full
+ */
+typedef int (*ef_http_handler_t)(ef_http_request_t *req);
+
+/*
+ * serve HTTP/1.1 by handler with keep-alive and pipelining, max_header and
+ * max_body bytes at most (0 for the defaults), timeout_millisecs to receive
+ * a whole request from when it is waited for, the idle time of a kept alive
+ * connection included, and for each wait writing the responses, max_requests
+ * on a connection before closing it (0 for no limit), call before ef_run_loop
+ */
+int ef_http_init(ef_http_handler_t handler, size_t max_header, size_t max_body, int timeout_millisecs, int max_requests);
+
+/*
+ * the handler to pass to ef_add_listen, serves the requests on the
+ * connection until closed by either side, timed out, or an error
+ */
+long ef_http_proc(int fd, ef_routine_t *er);
+
+/*
+ * the value of the header name (case insensitive), NULL if not sent
+ */
+const char *ef_http_header(const ef_http_request_t *req, const char *name);
+
+/*
+ * respond to req with status and len bytes of body, content_type NULL to
+ * send none, no body for HEAD, Content-Length and Connection added,
+ * only once for a request, return 0 or -1 if the connection failed
+ */
+int ef_http_respond(ef_http_request_t *req, int status, const char *content_type, const void *body, size_t len);
+
+#endif
@@ -18,25 +18,37 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+// recvmmsg, sendmmsg
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include "framework.h"
+#include "static.h"
+#include "metrics.h"
+#include "http.h"
 
 // 协程事件循环主结构体
 ef_runtime_t efr = {0};
 
 #define BUFFER_SIZE 8192
 
+// 等待请求与连接后端的超时，慢速或不发送数据的客户端不能一直占用协程
+#define REQUEST_TIMEOUT 10000
+
 // for performance test
 // forward port 8080 <=> 80, HTTP GET only
 // let a http server run at localhost:80
 // use HTTP/1.0 or set http header 'Connection: Close'
 long forward_proc(int fd, ef_routine_t *er)
 {
-    char buffer[BUFFER_SIZE];
-    ssize_t r = ef_routine_read(er, fd, buffer, BUFFER_SIZE);
+    // 请求到达后才从runtime取得按请求大小分级的缓冲区，等待请求的连接不占用缓冲区，也不占用协程栈
+    void *buffer;
+    ssize_t r = ef_routine_read_arena_timeout(er, fd, &buffer, REQUEST_TIMEOUT);
     if(r <= 0)
     {
         return r;
@@ -45,34 +57,20 @@ long forward_proc(int fd, ef_routine_t *er)
     struct sockaddr_in addr_in = {0};
     addr_in.sin_family = AF_INET;
     addr_in.sin_port = htons(80);
-    int ret = ef_routine_connect(er, sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in));
+    int ret = ef_routine_connect_timeout(er, sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in), REQUEST_TIMEOUT);
     if(ret < 0)
     {
+        ef_routine_arena_release(er, buffer);
         return ret;
     }
     ssize_t w = ef_routine_write(er, sockfd, buffer, r);
+    ef_routine_arena_release(er, buffer);
     if(w < 0)
     {
         goto exit_proc;
     }
-    while(1)
-    {
-        r = ef_routine_read(er, sockfd, buffer, BUFFER_SIZE);
-        if(r <= 0)
-        {
-            break;
-        }
-        ssize_t wrt = 0;
-        while(wrt < r)
-        {
-            w = ef_routine_write(er, fd, &buffer[wrt], r - wrt);
-            if(w < 0)
-            {
-                goto exit_proc;
-            }
-            wrt += w;
-        }
-    }
+    // 响应通过pipe在内核中从后端socket直接转给客户端，不经过用户态缓冲区
+    ef_routine_relay(er, sockfd, fd);
     exit_proc:
     ef_routine_close(er, sockfd);
     return ret;
@@ -81,12 +79,14 @@ long forward_proc(int fd, ef_routine_t *er)
 long greeting_proc(int fd, ef_routine_t *er)
 {
     char resp_ok[] = "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 26\r\nContent-Type: text/plain; charset=utf-8\r\n\r\nWelcome to the EFramework!";
-    char buffer[BUFFER_SIZE];
-    ssize_t r = ef_routine_read(er, fd, buffer, BUFFER_SIZE);
+    // 使用runtime的接收缓冲区，空闲连接不占用接收缓冲区
+    void *buffer;
+    ssize_t r = ef_routine_recv_borrow_timeout(er, fd, &buffer, REQUEST_TIMEOUT);
     if(r <= 0)
     {
         return r;
     }
+    ef_routine_buffer_release(er, buffer);
     r = sizeof(resp_ok) - 1;
     ssize_t wrt = 0;
     while(wrt < r)
@@ -101,6 +101,64 @@ long greeting_proc(int fd, ef_routine_t *er)
     return 0;
 }
 
+// 保持连接的问候语，同一个连接上的请求由一个协程依次处理，流水线的响应合并写出
+int greeting_handler(ef_http_request_t *req)
+{
+    static const char greeting[] = "Welcome to the EFramework!";
+    return ef_http_respond(req, 200, "text/plain; charset=utf-8", greeting, sizeof(greeting) - 1);
+}
+
+// 每次系统调用收发的数据报个数，以及每个数据报的最大长度
+#define DGRAM_BATCH 32
+#define DGRAM_SIZE  2048
+
+typedef struct {
+    struct mmsghdr msgs[DGRAM_BATCH];
+    struct iovec iovs[DGRAM_BATCH];
+    struct sockaddr_storage addrs[DGRAM_BATCH];
+    char bufs[DGRAM_BATCH][DGRAM_SIZE];
+} dgram_batch_t;
+
+// UDP回显，一次系统调用收取一批数据报，再一次发回
+long echo_proc(int fd, ef_routine_t *er)
+{
+    // 协程栈放不下，从堆上分配
+    dgram_batch_t *b = (dgram_batch_t *)malloc(sizeof(dgram_batch_t));
+    if(b == NULL)
+    {
+        return -1;
+    }
+    while(1)
+    {
+        for(int i = 0; i < DGRAM_BATCH; ++i)
+        {
+            b->iovs[i].iov_base = b->bufs[i];
+            b->iovs[i].iov_len = DGRAM_SIZE;
+            memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+            b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+            b->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // 返回0表示事件循环正在停止
+        int n = ef_routine_recvmmsg(er, fd, b->msgs, DGRAM_BATCH, 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        for(int i = 0; i < n; ++i)
+        {
+            b->iovs[i].iov_len = b->msgs[i].msg_len;
+        }
+        if(ef_routine_sendmmsg(er, fd, b->msgs, n, 0) < 0)
+        {
+            break;
+        }
+    }
+    free(b);
+    return 0;
+}
+
 void signal_handler(int num)
 {
     // 将协程事件循环的停止状态标志位置为1，标识为退出事件循环
@@ -112,7 +170,48 @@ int main(int argc, char *argv[])
     // 1. 初始化框架
     // 协程池初始化，需要指定协程池规模，协程栈大小
     // IO多路复用初始化
-    if (ef_init(&efr, 64 * 1024, 256, 512, 1000 * 60, 16) < 0) {
+    // 参数为uring时使用io_uring引擎，否则使用编译时选择的多路复用器
+    // 参数为数字时表示事件循环的线程数，参数为steal时空闲的线程从繁忙的线程窃取就绪协程
+    int engine = EF_ENGINE_POLL, threads = 1, steal = 0, reuse = 1;
+    struct { const char *name; int socket; } listens[] = {
+        {"forward", -1}, {"greeting", -1}, {"static", -1}, {"http", -1},
+    };
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "uring") == 0) {
+            engine = EF_ENGINE_URING;
+        } else if (strcmp(argv[i], "steal") == 0) {
+            steal = 1;
+        } else if (atoi(argv[i]) > 0) {
+            threads = atoi(argv[i]);
+        }
+    }
+    if (ef_init_engine(&efr, engine, 64 * 1024, 256, 512, 1000 * 60, 16) < 0) {
+        return -1;
+    }
+
+    // 接收缓冲区，使用io_uring时注册为provided buffer ring
+    if (ef_init_buffers(&efr, 1024, BUFFER_SIZE) < 0) {
+        return -1;
+    }
+
+    // 静态文件的处理函数栈上有8KB的缓冲区，预先提交16KB的协程栈，溢出时按16KB扩展，避免请求路径上的SIGSEGV
+    // 同时统计各处理函数的栈深度，样本足够后按p99预先提交
+    if (ef_init_stack(&efr, 16 * 1024, 16 * 1024, EF_STACK_ADAPTIVE) < 0) {
+        return -1;
+    }
+
+    // 协程在池中空闲5秒后归还其栈内存页，流量高峰之后RSS可以降下来，协程仍留在池中
+    if (ef_init_stack_release(&efr, EF_STACK_RELEASE_IDLE, 5000, 0) < 0) {
+        return -1;
+    }
+
+    // 每个线程4个共享栈，栈上没有大缓冲区的处理函数可以运行在共享栈上，每个连接只占用很少的内存
+    if (ef_init_shared_stacks(&efr, 4) < 0) {
+        return -1;
+    }
+
+    // 每个线程一个事件循环，监听socket通过SO_REUSEPORT复制到各个线程
+    if (ef_init_threads(&efr, threads, steal) < 0) {
         return -1;
     }
 
@@ -129,6 +228,8 @@ int main(int argc, char *argv[])
     {
         return -1;
     }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
     struct sockaddr_in addr_in = {0};
     addr_in.sin_family = AF_INET;
     addr_in.sin_port = htons(8081);
@@ -142,13 +243,19 @@ int main(int argc, char *argv[])
     // 框架支持多个监听socket分别监听不同端口，所以先放入链表，框架运行起来后会一并处理
     // 需要指定业务处理入口，此处为forward_proc
     // 新建立的连接会交给一个协程，forward_proc便是这些协程的执行入口
-    ef_add_listen(&efr, sockfd, forward_proc);
+    // EF_LISTEN_LATENCY统计每个连接的排队、首字节与处理时间
+    ef_add_listen_ex(&efr, sockfd, forward_proc, EF_ACCEPT_BUDGET, EF_LISTEN_LATENCY);
+    // 协程池用尽时停止accept，连接留在内核的backlog中，等有协程结束后再取出来
+    ef_listen_overload(&efr, sockfd, EF_OVERLOAD_DISARM, 0);
+    listens[0].socket = sockfd;
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if(sockfd < 0)
     {
         return -1;
     }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
     addr_in.sin_port = htons(8082);
     retval = bind(sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in));
     if(retval < 0)
@@ -156,8 +263,124 @@ int main(int argc, char *argv[])
         return -1;
     }
     listen(sockfd, 512);
-    ef_add_listen(&efr, sockfd, greeting_proc);
+    // 问候语的处理很短，accept之后立即创建协程处理，不用等到本次事件循环结束，并且运行在共享栈上
+    ef_add_listen_ex(&efr, sockfd, greeting_proc, EF_ACCEPT_BUDGET, EF_LISTEN_INLINE | EF_LISTEN_SHARED | EF_LISTEN_LATENCY);
+    // 没有协程可用时直接重置连接，客户端可以立即重试其他实例
+    ef_listen_overload(&efr, sockfd, EF_OVERLOAD_REJECT, 0);
+    listens[1].socket = sockfd;
+
+    // 8083端口提供当前目录下的静态文件，每个线程缓存256个打开的文件，1秒后再次使用时重新检查
+    if (ef_static_init(".", 256, 1000) < 0) {
+        return -1;
+    }
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd < 0)
+    {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    addr_in.sin_port = htons(8083);
+    retval = bind(sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in));
+    if(retval < 0)
+    {
+        return -1;
+    }
+    listen(sockfd, 512);
+    ef_add_listen_ex(&efr, sockfd, ef_static_proc, EF_ACCEPT_BUDGET, EF_LISTEN_LATENCY);
+    // 在队列中等待超过1秒的连接被重置
+    ef_listen_overload(&efr, sockfd, EF_OVERLOAD_QUEUE, 1000);
+    listens[2].socket = sockfd;
+
+    // 8084端口的UDP回显，数据报socket不需要accept，由一个协程负责收发
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sockfd < 0)
+    {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    addr_in.sin_port = htons(8084);
+    retval = bind(sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in));
+    if(retval < 0)
+    {
+        return -1;
+    }
+    ef_add_listen(&efr, sockfd, echo_proc);
+
+    // 8085端口以Prometheus的文本格式输出各线程与各监听socket的运行统计
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd < 0)
+    {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    addr_in.sin_port = htons(8085);
+    retval = bind(sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in));
+    if(retval < 0)
+    {
+        return -1;
+    }
+    listen(sockfd, 512);
+    ef_add_listen(&efr, sockfd, ef_metrics_proc);
+
+    // 8086端口以HTTP/1.1保持连接提供问候语，每次等待请求最多REQUEST_TIMEOUT毫秒
+    if (ef_http_init(greeting_handler, 0, 0, REQUEST_TIMEOUT, 0) < 0) {
+        return -1;
+    }
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd < 0)
+    {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    addr_in.sin_port = htons(8086);
+    retval = bind(sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in));
+    if(retval < 0)
+    {
+        return -1;
+    }
+    listen(sockfd, 512);
+    ef_add_listen_ex(&efr, sockfd, ef_http_proc, EF_ACCEPT_BUDGET, EF_LISTEN_LATENCY);
+    listens[3].socket = sockfd;
 
     // 启动协程事件循环
-    return ef_run_loop(&efr);
+    retval = ef_run_loop(&efr);
+    ef_static_free();
+
+    // 输出各线程读写快速路径的命中情况
+    for (int i = 0; i < efr.thread_count; ++i) {
+        ef_io_stat_t *st = &(efr.runtimes ? efr.runtimes[i] : &efr)->io_stat;
+        fprintf(stderr, "thread %d read fast/wait: %lu/%lu, write fast/wait: %lu/%lu, yield: %lu, steal: %lu\n", i,
+            st->read.fast, st->read.wait, st->write.fast, st->write.wait, st->yield_count, st->steal_count);
+    }
+
+    // 输出各处理函数的协程栈深度
+    struct { const char *name; ef_routine_proc_t proc; } procs[] = {
+        {"forward", forward_proc}, {"greeting", greeting_proc}, {"static", ef_static_proc}, {"echo", echo_proc},
+        {"http", ef_http_proc},
+    };
+    for (int i = 0; i < sizeof(procs) / sizeof(procs[0]); ++i) {
+        ef_stack_stat_t ss;
+        if (ef_stack_stat(&efr, procs[i].proc, &ss) == 0 && ss.count > 0) {
+            fprintf(stderr, "%s stack runs: %lu, p50/p99/max: %zu/%zu/%zu\n", procs[i].name, ss.count,
+                ef_stack_stat_percentile(&ss, 50), ef_stack_stat_percentile(&ss, 99), ss.max);
+        }
+    }
+
+    // 输出各监听socket的准入控制计数
+    for (int i = 0; i < sizeof(listens) / sizeof(listens[0]); ++i) {
+        ef_listen_stat_t ls;
+        if (ef_listen_stat(&efr, listens[i].socket, &ls) == 0 && ls.accepted > 0) {
+            fprintf(stderr, "%s accepted: %lu, queue max: %lu, expired: %lu, rejected: %lu, disarmed: %lu\n", listens[i].name,
+                ls.accepted, ls.queue_max, ls.expired, ls.rejected, ls.disarmed);
+            fprintf(stderr, "%s queue wait/first byte/duration p50: %lu/%lu/%lu, p99: %lu/%lu/%lu, p99.9: %lu/%lu/%lu ns\n", listens[i].name,
+                ef_latency_percentile(&ls.queue_wait, 50), ef_latency_percentile(&ls.first_byte, 50), ef_latency_percentile(&ls.duration, 50),
+                ef_latency_percentile(&ls.queue_wait, 99), ef_latency_percentile(&ls.first_byte, 99), ef_latency_percentile(&ls.duration, 99),
+                ef_latency_percentile(&ls.queue_wait, 99.9), ef_latency_percentile(&ls.first_byte, 99.9), ef_latency_percentile(&ls.duration, 99.9));
+        }
+    }
+    return retval;
 }
@@ -0,0 +1,251 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "metrics.h"
+#include "util/list.h"
+#include "util/util.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+// 一个指标，同名的相邻放在一起，只输出一次HELP与TYPE
+typedef struct _ef_metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    // 额外的标签，没有时为NULL
+    const char *label;
+    // 计数在ef_runtime_stat_t或ef_listen_stat_t中的偏移，都是unsigned long
+    size_t offset;
+} ef_metric_t;
+
+// 格式化时的输出位置，超出size的部分只计入长度
+typedef struct _ef_metrics_out {
+    char *buf;
+    size_t size;
+    size_t len;
+} ef_metrics_out_t;
+
+static const ef_metric_t ef_metrics_runtime[] = {
+    {"ef_loop_iterations_total", "counter", "Event loop iterations.", NULL, offsetof(ef_runtime_stat_t, rounds)},
+    {"ef_poll_waits_total", "counter", "Waits on the poller.", NULL, offsetof(ef_runtime_stat_t, waits)},
+    {"ef_poll_events_total", "counter", "Events returned by the poller.", NULL, offsetof(ef_runtime_stat_t, events)},
+    {"ef_coroutine_switches_total", "counter", "Routines resumed, each a switch in and one back out.", NULL, offsetof(ef_runtime_stat_t, switches)},
+    {"ef_coroutine_pool_hits_total", "counter", "Routines reused from the pool.", NULL, offsetof(ef_runtime_stat_t, pool_hits)},
+    {"ef_coroutine_pool_maps_total", "counter", "Routines created with a newly mapped stack.", NULL, offsetof(ef_runtime_stat_t, pool_maps)},
+    {"ef_coroutine_pool_frees_total", "counter", "Routines freed by shrinking the pool.", NULL, offsetof(ef_runtime_stat_t, pool_frees)},
+    {"ef_coroutines", "gauge", "Routines in the pool.", "state=\"all\"", offsetof(ef_runtime_stat_t, coroutines)},
+    {"ef_coroutines", "gauge", "Routines in the pool.", "state=\"free\"", offsetof(ef_runtime_stat_t, free_coroutines)},
+    {"ef_arena_bytes", "gauge", "Bytes of the IO buffer slabs.", "state=\"mapped\"", offsetof(ef_runtime_stat_t, arena_mapped)},
+    {"ef_arena_bytes", "gauge", "Bytes of the IO buffer slabs.", "state=\"used\"", offsetof(ef_runtime_stat_t, arena_used)},
+    {"ef_io_operations_total", "counter", "Reads and writes, done at the first try or after waiting.", "op=\"read\",path=\"fast\"", offsetof(ef_runtime_stat_t, io.read.fast)},
+    {"ef_io_operations_total", "counter", "Reads and writes, done at the first try or after waiting.", "op=\"read\",path=\"wait\"", offsetof(ef_runtime_stat_t, io.read.wait)},
+    {"ef_io_operations_total", "counter", "Reads and writes, done at the first try or after waiting.", "op=\"write\",path=\"fast\"", offsetof(ef_runtime_stat_t, io.write.fast)},
+    {"ef_io_operations_total", "counter", "Reads and writes, done at the first try or after waiting.", "op=\"write\",path=\"wait\"", offsetof(ef_runtime_stat_t, io.write.wait)},
+    {"ef_io_bytes_total", "counter", "Bytes read and written.", "op=\"read\"", offsetof(ef_runtime_stat_t, io.read.bytes)},
+    {"ef_io_bytes_total", "counter", "Bytes read and written.", "op=\"write\"", offsetof(ef_runtime_stat_t, io.write.bytes)},
+    {"ef_io_yields_total", "counter", "Routines yielded to wait for IO.", NULL, offsetof(ef_runtime_stat_t, io.yield_count)},
+    {"ef_steals_total", "counter", "Ready routines taken from other threads.", NULL, offsetof(ef_runtime_stat_t, io.steal_count)},
+};
+
+static const ef_metric_t ef_metrics_listen[] = {
+    {"ef_listen_accepted_total", "counter", "Connections accepted.", NULL, offsetof(ef_listen_stat_t, accepted)},
+    {"ef_listen_accept_failures_total", "counter", "Accepts failed other than EAGAIN.", NULL, offsetof(ef_listen_stat_t, failed)},
+    {"ef_listen_expired_total", "counter", "Connections reset after waiting too long in the queue.", NULL, offsetof(ef_listen_stat_t, expired)},
+    {"ef_listen_rejected_total", "counter", "Connections reset with no routine for them.", NULL, offsetof(ef_listen_stat_t, rejected)},
+    {"ef_listen_disarmed_total", "counter", "Times accepting stopped with the pool exhausted.", NULL, offsetof(ef_listen_stat_t, disarmed)},
+    {"ef_listen_queue_max", "gauge", "Most connections waiting in the queue at once.", NULL, offsetof(ef_listen_stat_t, queue_max)},
+};
+
+// EF_LISTEN_LATENCY的延迟分布，以summary输出
+static const ef_metric_t ef_metrics_latency[] = {
+    {"ef_listen_queue_wait_seconds", "summary", "Time connections waited in the queue for a routine.", NULL, offsetof(ef_listen_stat_t, queue_wait)},
+    {"ef_listen_first_byte_seconds", "summary", "Time from the handler started to the first byte written.", NULL, offsetof(ef_listen_stat_t, first_byte)},
+    {"ef_listen_duration_seconds", "summary", "Time from the handler started to the connection closed.", NULL, offsetof(ef_listen_stat_t, duration)},
+};
+
+static const double ef_metrics_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+#define ef_metric_value(st, m) \
+    __atomic_load_n((const unsigned long *)((const char *)(st) + (m)->offset), __ATOMIC_RELAXED)
+
+static void ef_metrics_printf(ef_metrics_out_t *out, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    if (out->len < out->size) {
+        len = vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+    } else {
+        len = vsnprintf(NULL, 0, fmt, ap);
+    }
+    va_end(ap);
+    if (len > 0) {
+        out->len += len;
+    }
+}
+
+static void ef_metrics_family(ef_metrics_out_t *out, const ef_metric_t *metrics, int idx)
+{
+    const ef_metric_t *m = &metrics[idx];
+    if (idx == 0 || strcmp(metrics[idx - 1].name, m->name) != 0) {
+        ef_metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+    }
+}
+
+size_t ef_metrics_format(ef_runtime_t *rt, char *buf, size_t size)
+{
+    ef_metrics_out_t out = {buf, size, 0};
+    ef_runtime_stat_t st;
+
+    if (buf && size > 0) {
+        buf[0] = '\0';
+    }
+
+    for (int idx = 0; idx < sizeof(ef_metrics_runtime) / sizeof(ef_metrics_runtime[0]); ++idx) {
+        const ef_metric_t *m = &ef_metrics_runtime[idx];
+        ef_metrics_family(&out, ef_metrics_runtime, idx);
+        for (int thread = 0; thread < rt->thread_count; ++thread) {
+            if (ef_runtime_stat(rt, thread, &st) < 0) {
+                continue;
+            }
+            ef_metrics_printf(&out, "%s{thread=\"%d\"%s%s} %lu\n", m->name, thread,
+                m->label ? "," : "", m->label ? m->label : "", ef_metric_value(&st, m));
+        }
+    }
+
+    /*
+     * the listen stats are added before the loop runs, and never removed
+     */
+    for (int idx = 0; idx < sizeof(ef_metrics_listen) / sizeof(ef_metrics_listen[0]); ++idx) {
+        const ef_metric_t *m = &ef_metrics_listen[idx];
+        ef_metrics_family(&out, ef_metrics_listen, idx);
+        for (int thread = 0; thread < rt->thread_count; ++thread) {
+            ef_runtime_t *peer = rt->runtimes ? rt->runtimes[thread] : rt;
+            ef_list_entry_t *ent = ef_list_entry_after(&peer->listen_stat_list);
+            while (ent != &peer->listen_stat_list) {
+                ef_listen_stat_t *ls = CAST_PARENT_PTR(ent, ef_listen_stat_t, list_entry);
+                ent = ef_list_entry_after(ent);
+
+                /*
+                 * the routines of ef_add_routine accept nothing
+                 */
+                if (ls->socket < 0) {
+                    continue;
+                }
+                ef_metrics_printf(&out, "%s{thread=\"%d\",port=\"%d\"} %lu\n", m->name, thread, ls->port, ef_metric_value(ls, m));
+            }
+        }
+    }
+
+    /*
+     * quantiles of each thread, only the listeners counted some
+     */
+    for (int idx = 0; idx < sizeof(ef_metrics_latency) / sizeof(ef_metrics_latency[0]); ++idx) {
+        const ef_metric_t *m = &ef_metrics_latency[idx];
+        ef_metrics_family(&out, ef_metrics_latency, idx);
+        for (int thread = 0; thread < rt->thread_count; ++thread) {
+            ef_runtime_t *peer = rt->runtimes ? rt->runtimes[thread] : rt;
+            ef_list_entry_t *ent = ef_list_entry_after(&peer->listen_stat_list);
+            while (ent != &peer->listen_stat_list) {
+                ef_listen_stat_t *ls = CAST_PARENT_PTR(ent, ef_listen_stat_t, list_entry);
+                const ef_latency_hist_t *h = (const ef_latency_hist_t *)((const char *)ls + m->offset);
+                unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+                ent = ef_list_entry_after(ent);
+                if (count == 0) {
+                    continue;
+                }
+                for (int q = 0; q < sizeof(ef_metrics_quantiles) / sizeof(ef_metrics_quantiles[0]); ++q) {
+                    ef_metrics_printf(&out, "%s{thread=\"%d\",port=\"%d\",quantile=\"%g\"} %.9f\n", m->name, thread, ls->port,
+                        ef_metrics_quantiles[q], ef_latency_percentile(h, ef_metrics_quantiles[q] * 100) / 1e9);
+                }
+                ef_metrics_printf(&out, "%s_sum{thread=\"%d\",port=\"%d\"} %.9f\n", m->name, thread, ls->port,
+                    __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+                ef_metrics_printf(&out, "%s_count{thread=\"%d\",port=\"%d\"} %lu\n", m->name, thread, ls->port, count);
+            }
+        }
+    }
+    return out.len;
+}
+
+static long ef_metrics_reply(ef_routine_t *er, int fd, const char *status, const char *body, size_t len)
+{
+    char head[160];
+    struct iovec iov[2];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: %zu\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n\r\n", status, len);
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = len;
+    return ef_routine_writev(er, fd, iov, len > 0 ? 2 : 1) < 0 ? -1 : 0;
+}
+
+long ef_metrics_proc(int fd, ef_routine_t *er)
+{
+    char req[EF_METRICS_HEADER_SIZE];
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    size_t len = 0, size;
+    char *body;
+    ssize_t r;
+    long retval;
+
+    /*
+     * read until the end of the request header, any path is the same
+     */
+    while (1) {
+        r = ef_routine_read_timeout(er, fd, req + len, sizeof(req) - 1 - len, EF_METRICS_TIMEOUT);
+        if (r <= 0) {
+            return r;
+        }
+        len += r;
+        req[len] = '\0';
+        if (strstr(req + (len > (size_t)r + 3 ? len - r - 3 : 0), "\r\n\r\n")) {
+            break;
+        }
+        if (len == sizeof(req) - 1) {
+            return ef_metrics_reply(er, fd, "431 Request Header Fields Too Large", NULL, 0);
+        }
+    }
+    if (strncmp(req, "GET ", 4) != 0) {
+        return ef_metrics_reply(er, fd, "405 Method Not Allowed", NULL, 0);
+    }
+
+    /*
+     * the counters keep growing between the two passes, leave some room
+     */
+    size = ef_metrics_format(rt, NULL, 0) + 1024;
+    body = (char *)malloc(size);
+    if (!body) {
+        return ef_metrics_reply(er, fd, "500 Internal Server Error", NULL, 0);
+    }
+    len = ef_metrics_format(rt, body, size);
+    if (len >= size) {
+        len = size - 1;
+    }
+    retval = ef_metrics_reply(er, fd, "200 OK", body, len);
+    free(body);
+    return retval;
+}
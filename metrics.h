@@ -0,0 +1,46 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _METRICS_HEADER_
+#define _METRICS_HEADER_
+
+#include "framework.h"
+
+/*
+ * the request header must fit in, and the time to wait for it
+ */
+#define EF_METRICS_HEADER_SIZE 4096
+#define EF_METRICS_TIMEOUT     10000
+
+/*
+ * format the counters of all the threads of rt and of their listeners
+ * in the prometheus text format, labeled by thread, and by port for
+ * the listeners, return the length of it, truncated to size - 1 and
+ * null terminated if size is not enough, the same as snprintf
+ */
+size_t ef_metrics_format(ef_runtime_t *rt, char *buf, size_t size);
+
+/*
+ * the handler to pass to ef_add_listen, answers one GET request
+ * with the counters of the runtime, and closes the connection
+ */
+long ef_metrics_proc(int fd, ef_routine_t *er);
+
+#endif
@@ -29,11 +29,13 @@ typedef ef_poll_t *(*create_func_t)(int cap);
 typedef int (*associate_func_t)(ef_poll_t *p, int fd, int events, void *ptr, int fired);
 typedef int (*dissociate_func_t)(ef_poll_t *p, int fd, int fired, int onclose);
 typedef int (*unset_func_t)(ef_poll_t *p, int fd, int events);
-typedef int (*wait_func_t)(ef_poll_t *p, ef_event_t *evts, int count, int millisecs);
+typedef int (*wait_func_t)(ef_poll_t *p, ef_event_t *evts, int count, long long nanosecs);
 typedef int (*free_func_t)(ef_poll_t *p);
 
 struct _ef_event {
     int events;
+    // 仅完成通知类的实现（io_uring）使用，即cqe->flags
+    unsigned int flags;
     void *ptr;
 };
 
@@ -43,12 +45,14 @@ struct _ef_poll {
     associate_func_t associate;
     // 解注册某个FD的感兴趣事件到IO多路复用器
     dissociate_func_t dissociate;
-    // 暂时无用
+    // 清除已就绪但已被消费（如返回EAGAIN）的事件，epollet等需要记录就绪状态的实现使用
     unset_func_t unset;
-    // 获取就绪的事件
+    // 获取就绪的事件，超时为纳秒，-1表示一直等待，内核支持时精确到亚毫秒
     wait_func_t wait;
     // 释放多路复用器
     free_func_t free;
+    // 不在用户态保存fd的注册状态，associate与dissociate可以由其他线程调用，协程可以迁移到其他线程
+    int migratable;
 };
 
 // 创建多路复用器
@@ -62,4 +66,17 @@ extern create_func_t ef_create_poll;
 #define EF_POLLERR 0x008
 #define EF_POLLHUP 0x010
 
+/*
+ * round the timeout up to milliseconds for the pollers only take that
+ */
+inline int ef_poll_millisecs(long long nanosecs) __attribute__((always_inline));
+
+inline int ef_poll_millisecs(long long nanosecs)
+{
+    if (nanosecs < 0) {
+        return -1;
+    }
+    return (int)((nanosecs + 999999) / 1000000);
+}
+
 #endif
\ No newline at end of file
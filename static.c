@@ -0,0 +1,417 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "static.h"
+#include "timer.h"
+#include "util/list.h"
+#include "util/util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * the root directory and the cache settings shared by all threads
+ */
+static char *ef_static_root = NULL;
+static size_t ef_static_root_len = 0;
+static int ef_static_cache_size = 0;
+static int ef_static_valid_millisecs = 0;
+
+/*
+ * every thread has its own file cache, created when first used,
+ * freed by the key destructor when the thread exits
+ */
+static __thread ef_file_cache_t *ef_static_cache = NULL;
+static pthread_key_t ef_static_key;
+
+static const struct {
+    const char *ext;
+    const char *type;
+} ef_static_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm",  "text/html; charset=utf-8"},
+    {"css",  "text/css; charset=utf-8"},
+    {"js",   "application/javascript"},
+    {"json", "application/json"},
+    {"txt",  "text/plain; charset=utf-8"},
+    {"xml",  "application/xml"},
+    {"svg",  "image/svg+xml"},
+    {"png",  "image/png"},
+    {"jpg",  "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif",  "image/gif"},
+    {"ico",  "image/x-icon"},
+    {"webp", "image/webp"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+    {NULL,   NULL},
+};
+
+static unsigned int ef_file_hash(const char *path)
+{
+    unsigned int hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// 文件已被移除且没有协程在使用时关闭
+static void ef_file_put(ef_file_t *f)
+{
+    if (f->detached && f->refs == 0) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+// 从哈希表与LRU链表中移除，正在使用的文件由最后一个使用者关闭
+static void ef_file_cache_detach(ef_file_cache_t *fc, ef_file_t *f)
+{
+    ef_file_t **pf = &fc->buckets[f->hash & fc->bucket_mask];
+
+    while (*pf != f) {
+        pf = &(*pf)->next;
+    }
+    *pf = f->next;
+    ef_list_remove(&f->lru_entry);
+    --fc->count;
+    f->detached = 1;
+    ef_file_put(f);
+}
+
+int ef_file_cache_init(ef_file_cache_t *fc, int capacity, int valid_millisecs)
+{
+    size_t bucket_count;
+
+    if (capacity <= 0) {
+        capacity = 1;
+    }
+    bucket_count = ef_resize((size_t)capacity, 16);
+    fc->buckets = (ef_file_t **)calloc(bucket_count, sizeof(ef_file_t *));
+    if (!fc->buckets) {
+        return -1;
+    }
+    fc->capacity = capacity;
+    fc->count = 0;
+    fc->valid_nanosecs = (long long)valid_millisecs * 1000000;
+    fc->bucket_mask = (unsigned int)bucket_count - 1;
+    ef_list_init(&fc->lru);
+    return 0;
+}
+
+ef_file_t *ef_file_cache_open(ef_file_cache_t *fc, const char *path)
+{
+    unsigned int hash = ef_file_hash(path);
+    long long now = ef_timer_now();
+    ef_file_t *f = fc->buckets[hash & fc->bucket_mask];
+    struct stat st;
+    size_t len;
+    int fd;
+
+    while (f && (f->hash != hash || strcmp(f->path, path) != 0)) {
+        f = f->next;
+    }
+
+    /*
+     * stat again after a while, the file may be replaced or modified
+     */
+    if (f && now - f->checked >= fc->valid_nanosecs) {
+        if (stat(path, &st) == 0 && st.st_dev == f->st.st_dev && st.st_ino == f->st.st_ino &&
+            st.st_size == f->st.st_size && st.st_mtim.tv_sec == f->st.st_mtim.tv_sec &&
+            st.st_mtim.tv_nsec == f->st.st_mtim.tv_nsec) {
+            f->checked = now;
+        } else {
+            ef_file_cache_detach(fc, f);
+            f = NULL;
+        }
+    }
+
+    if (!f) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return NULL;
+        }
+        len = strlen(path);
+        f = (ef_file_t *)malloc(sizeof(ef_file_t) + len + 1);
+        if (!f) {
+            close(fd);
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (fstat(fd, &f->st) < 0) {
+            close(fd);
+            free(f);
+            return NULL;
+        }
+        f->fd = fd;
+        f->checked = now;
+        f->refs = 0;
+        f->detached = 0;
+        f->hash = hash;
+        memcpy(f->path, path, len + 1);
+
+        /*
+         * evict the least recently used one
+         */
+        if (fc->count >= fc->capacity) {
+            ef_file_cache_detach(fc, CAST_PARENT_PTR(ef_list_entry_before(&fc->lru), ef_file_t, lru_entry));
+        }
+        f->next = fc->buckets[hash & fc->bucket_mask];
+        fc->buckets[hash & fc->bucket_mask] = f;
+        ++fc->count;
+    } else {
+        ef_list_remove(&f->lru_entry);
+    }
+
+    ef_list_insert_after(&fc->lru, &f->lru_entry);
+    ++f->refs;
+    return f;
+}
+
+void ef_file_cache_release(ef_file_cache_t *fc, ef_file_t *f)
+{
+    --f->refs;
+    ef_file_put(f);
+}
+
+void ef_file_cache_free(ef_file_cache_t *fc)
+{
+    while (!ef_list_empty(&fc->lru)) {
+        ef_file_cache_detach(fc, CAST_PARENT_PTR(ef_list_entry_after(&fc->lru), ef_file_t, lru_entry));
+    }
+    free(fc->buckets);
+    fc->buckets = NULL;
+}
+
+static void ef_static_cache_destroy(void *param)
+{
+    ef_file_cache_t *fc = (ef_file_cache_t *)param;
+    ef_file_cache_free(fc);
+    free(fc);
+}
+
+int ef_static_init(const char *root, int cache_size, int valid_millisecs)
+{
+    size_t len = strlen(root);
+
+    /*
+     * the request path starts with a slash
+     */
+    while (len > 1 && root[len - 1] == '/') {
+        --len;
+    }
+    ef_static_root = strndup(root, len);
+    if (!ef_static_root) {
+        return -1;
+    }
+    if (pthread_key_create(&ef_static_key, ef_static_cache_destroy) != 0) {
+        free(ef_static_root);
+        ef_static_root = NULL;
+        return -1;
+    }
+    ef_static_root_len = len;
+    ef_static_cache_size = cache_size;
+    ef_static_valid_millisecs = valid_millisecs;
+    return 0;
+}
+
+void ef_static_free(void)
+{
+    /*
+     * the destructor is not called for the thread calling ef_run_loop
+     */
+    if (ef_static_cache) {
+        pthread_setspecific(ef_static_key, NULL);
+        ef_static_cache_destroy(ef_static_cache);
+        ef_static_cache = NULL;
+    }
+    free(ef_static_root);
+    ef_static_root = NULL;
+}
+
+static ef_file_cache_t *ef_static_get_cache(void)
+{
+    ef_file_cache_t *fc = ef_static_cache;
+
+    if (fc) {
+        return fc;
+    }
+    fc = (ef_file_cache_t *)malloc(sizeof(ef_file_cache_t));
+    if (!fc) {
+        return NULL;
+    }
+    if (ef_file_cache_init(fc, ef_static_cache_size, ef_static_valid_millisecs) < 0) {
+        free(fc);
+        return NULL;
+    }
+    pthread_setspecific(ef_static_key, fc);
+    ef_static_cache = fc;
+    return fc;
+}
+
+static const char *ef_static_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+
+    if (ext && !strchr(ext, '/')) {
+        ++ext;
+        for (int idx = 0; ef_static_types[idx].ext; ++idx) {
+            if (strcasecmp(ext, ef_static_types[idx].ext) == 0) {
+                return ef_static_types[idx].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int ef_static_send(ef_routine_t *er, int fd, const char *buf, size_t len, int flags)
+{
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t w = ef_routine_send(er, fd, buf + sent, len - sent, flags);
+        if (w < 0) {
+            return -1;
+        }
+        sent += w;
+    }
+    return 0;
+}
+
+static long ef_static_error(ef_routine_t *er, int fd, const char *status)
+{
+    char head[128];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", status);
+    return ef_static_send(er, fd, head, len, 0);
+}
+
+long ef_static_proc(int fd, ef_routine_t *er)
+{
+    char req[EF_STATIC_HEADER_SIZE];
+    char path[PATH_MAX];
+    char head[256];
+    const char *uri;
+    size_t len = 0, uri_len;
+    ef_file_cache_t *fc;
+    ef_file_t *f;
+    int is_head, head_len;
+    off_t offset = 0;
+    ssize_t r;
+
+    /*
+     * read until the end of the request header, only the request line used
+     */
+    while (1) {
+        r = ef_routine_read_timeout(er, fd, req + len, sizeof(req) - 1 - len, EF_STATIC_TIMEOUT);
+        if (r <= 0) {
+            return r;
+        }
+        len += r;
+        req[len] = '\0';
+        if (strstr(req + (len > (size_t)r + 3 ? len - r - 3 : 0), "\r\n\r\n")) {
+            break;
+        }
+        if (len == sizeof(req) - 1) {
+            return ef_static_error(er, fd, "431 Request Header Fields Too Large");
+        }
+    }
+
+    if (strncmp(req, "GET ", 4) == 0) {
+        is_head = 0;
+        uri = req + 4;
+    } else if (strncmp(req, "HEAD ", 5) == 0) {
+        is_head = 1;
+        uri = req + 5;
+    } else {
+        return ef_static_error(er, fd, "405 Method Not Allowed");
+    }
+
+    /*
+     * the path without the query, no way out of the root
+     */
+    uri_len = strcspn(uri, " ?#\r\n");
+    if (uri[0] != '/') {
+        return ef_static_error(er, fd, "400 Bad Request");
+    }
+    for (const char *dots = uri; (dots = strstr(dots, "/..")) != NULL && dots < uri + uri_len; ++dots) {
+        if (dots + 3 == uri + uri_len || dots[3] == '/') {
+            return ef_static_error(er, fd, "403 Forbidden");
+        }
+    }
+    if (ef_static_root_len + uri_len + sizeof("index.html") > sizeof(path)) {
+        return ef_static_error(er, fd, "414 URI Too Long");
+    }
+    memcpy(path, ef_static_root, ef_static_root_len);
+    memcpy(path + ef_static_root_len, uri, uri_len);
+    len = ef_static_root_len + uri_len;
+    if (path[len - 1] == '/') {
+        memcpy(path + len, "index.html", sizeof("index.html"));
+    } else {
+        path[len] = '\0';
+    }
+
+    fc = ef_static_get_cache();
+    if (!fc) {
+        return ef_static_error(er, fd, "500 Internal Server Error");
+    }
+    f = ef_file_cache_open(fc, path);
+    if (!f) {
+        if (errno == EACCES) {
+            return ef_static_error(er, fd, "403 Forbidden");
+        }
+        return ef_static_error(er, fd, "404 Not Found");
+    }
+    if (!S_ISREG(f->st.st_mode)) {
+        ef_file_cache_release(fc, f);
+        return ef_static_error(er, fd, "404 Not Found");
+    }
+
+    /*
+     * the cache is not locked, keep the routine on this thread until released
+     */
+    ++er->borrowed;
+
+    /*
+     * the header goes out with the first part of the file
+     */
+    head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: %lld\r\nContent-Type: %s\r\n\r\n",
+        (long long)f->st.st_size, ef_static_type(path));
+    if (ef_static_send(er, fd, head, head_len, (is_head || f->st.st_size == 0) ? 0 : MSG_MORE) < 0) {
+        offset = -1;
+    }
+
+    while (!is_head && offset >= 0 && offset < f->st.st_size) {
+        r = ef_routine_sendfile(er, fd, f->fd, &offset, f->st.st_size - offset);
+        if (r <= 0) {
+            break;
+        }
+    }
+
+    ef_file_cache_release(fc, f);
+    --er->borrowed;
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _STATIC_HEADER_
+#define _STATIC_HEADER_
+
+#include "framework.h"
+#include <sys/stat.h>
+
+/*
+ * the request header must fit in, and the time to wait for it
+ */
+#define EF_STATIC_HEADER_SIZE 4096
+#define EF_STATIC_TIMEOUT     10000
+
+typedef struct _ef_file ef_file_t;
+typedef struct _ef_file_cache ef_file_cache_t;
+
+// 缓存的已打开文件，以及打开时的fstat结果
+struct _ef_file {
+    int fd;
+    struct stat st;
+    // 上次确认文件没有变化的时间，CLOCK_MONOTONIC纳秒
+    long long checked;
+    // 正在使用的协程数，为0且已从缓存中移除时才关闭
+    int refs;
+    // 已从缓存中移除
+    int detached;
+    unsigned int hash;
+    // 哈希桶中的下一个
+    ef_file_t *next;
+    // 链接到缓存的LRU链表，最近使用的在最前面
+    ef_list_entry_t lru_entry;
+    char path[0];
+};
+
+// 已打开文件的LRU缓存，不加锁，每个线程一个
+struct _ef_file_cache {
+    int capacity;
+    int count;
+    // 超过这个时间后再次使用时重新stat，文件被替换或修改后重新打开
+    long long valid_nanosecs;
+    unsigned int bucket_mask;
+    ef_file_t **buckets;
+    ef_list_entry_t lru;
+};
+
+/*
+ * keep at most capacity files open, check the
+ * file again if used valid_millisecs after last check
+ */
+int ef_file_cache_init(ef_file_cache_t *fc, int capacity, int valid_millisecs);
+
+/*
+ * get the file opened read only, from the cache if it has, NULL if
+ * failed with errno set, give it back by ef_file_cache_release
+ */
+ef_file_t *ef_file_cache_open(ef_file_cache_t *fc, const char *path);
+void ef_file_cache_release(ef_file_cache_t *fc, ef_file_t *f);
+
+/*
+ * close all files not in use, the ones in use are closed when released
+ */
+void ef_file_cache_free(ef_file_cache_t *fc);
+
+/*
+ * serve the files under root, each thread has a file cache of cache_size
+ * files, call before ef_run_loop, and ef_static_free after it returned
+ */
+int ef_static_init(const char *root, int cache_size, int valid_millisecs);
+void ef_static_free(void);
+
+/*
+ * the handler to pass to ef_add_listen, answers one GET or HEAD
+ * request by sendfile, and closes the connection
+ */
+long ef_static_proc(int fd, ef_routine_t *er);
+
+#endif
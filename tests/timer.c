@@ -0,0 +1,125 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * drives the timer wheel with a simulated clock that always jumps to
+ * ef_timer_wheel_next, as the event loop does, and checks that every
+ * timer fires within a tick of its deadline
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../timer.h"
+#include "../util/util.h"
+
+#define MSECS(n) ((long long)(n) * EF_TIMER_TICK_NSECS)
+
+static int failed = 0;
+
+// 推进到now，检查到期的定时器不早于截止时间，也不晚于一个tick
+static int expire_all(ef_timer_wheel_t *tw, long long now)
+{
+    ef_timer_t *t;
+    int fired = 0;
+
+    while ((t = ef_timer_wheel_expire(tw, now)) != NULL) {
+        if (t->expire > now || now - t->expire >= EF_TIMER_TICK_NSECS) {
+            if (failed++ < 10) {
+                fprintf(stderr, "timer of %lld ns fired at %lld ns\n", t->expire, now);
+            }
+        }
+        ++fired;
+    }
+    return fired;
+}
+
+// 按ef_timer_wheel_next等待，until为-1时直到所有定时器到期，否则最晚到until
+static long long run_until(ef_timer_wheel_t *tw, long long now, long long until)
+{
+    long long next;
+
+    while ((next = ef_timer_wheel_next(tw, now)) >= 0 && (until < 0 || now + next <= until)) {
+        now += next;
+        expire_all(tw, now);
+    }
+    if (until > now) {
+        now = until;
+        expire_all(tw, now);
+    }
+    return now;
+}
+
+/*
+ * a timer on level 1 cascades at the next round, before the one
+ * found on level 0 is due
+ */
+static void test_cascade_before_level0(void)
+{
+    ef_timer_wheel_t tw;
+    ef_timer_t a, b;
+    long long now = 0;
+
+    ef_timer_wheel_init(&tw, now);
+    ef_timer_add(&tw, &a, MSECS(100));
+
+    now = run_until(&tw, now, MSECS(50));
+    ef_timer_add(&tw, &b, now + MSECS(60));
+
+    if (ef_timer_wheel_next(&tw, now) > MSECS(50)) {
+        fprintf(stderr, "next %lld ns is after the deadline of %lld ns\n", ef_timer_wheel_next(&tw, now), a.expire - now);
+        ++failed;
+    }
+    run_until(&tw, now, -1);
+    if (a.pending || b.pending) {
+        fprintf(stderr, "timers left pending\n");
+        ++failed;
+    }
+}
+
+/*
+ * timers spread over the levels, added while the clock moves
+ */
+static void test_random(void)
+{
+    static ef_timer_t timers[1000];
+    ef_timer_wheel_t tw;
+    long long now = MSECS(12345) + 678;
+
+    srand(1);
+    ef_timer_wheel_init(&tw, now);
+    for (int i = 0; i < sizeof(timers) / sizeof(timers[0]); ++i) {
+        long long delay = (rand() % 4) == 0 ? rand() % MSECS(300000) : rand() % MSECS(500);
+        ef_timer_add(&tw, &timers[i], now + delay);
+        now = run_until(&tw, now, now + rand() % MSECS(3));
+    }
+    run_until(&tw, now, -1);
+    if (tw.count != 0) {
+        fprintf(stderr, "%d timers left\n", tw.count);
+        ++failed;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    test_cascade_before_level0();
+    test_random();
+    printf("%s\n", failed ? "FAIL" : "ok");
+    return failed ? 1 : 0;
+}
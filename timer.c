@@ -0,0 +1,218 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "timer.h"
+#include "util/util.h"
+#include <time.h>
+
+long long ef_timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void ef_timer_wheel_init(ef_timer_wheel_t *tw, long long now)
+{
+    tw->current = now / EF_TIMER_TICK_NSECS;
+    tw->count = 0;
+    ef_list_init(&tw->expired);
+    for (int level = 0; level < EF_TIMER_LEVELS; ++level) {
+        for (int idx = 0; idx < EF_TIMER_SLOTS; ++idx) {
+            ef_list_init(&tw->slots[level][idx]);
+        }
+    }
+}
+
+/*
+ * put the timer to the slot by the distance to current,
+ * level n holds the timers within 64^(n+1) ticks
+ */
+static void ef_timer_place(ef_timer_wheel_t *tw, ef_timer_t *t)
+{
+    long long tick = t->expire / EF_TIMER_TICK_NSECS;
+    long long diff = tick - tw->current;
+    int level = 0;
+
+    if (diff < 0) {
+        tick = tw->current;
+        diff = 0;
+    }
+
+    while (level < EF_TIMER_LEVELS - 1 && diff >= (1LL << (EF_TIMER_SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    /*
+     * too far, wait in the last slot of the top level and placed again when cascaded
+     */
+    if (diff >= (1LL << (EF_TIMER_SLOT_BITS * EF_TIMER_LEVELS))) {
+        tick = tw->current + (1LL << (EF_TIMER_SLOT_BITS * EF_TIMER_LEVELS)) - 1;
+    }
+
+    ef_list_insert_before(&tw->slots[level][(tick >> (EF_TIMER_SLOT_BITS * level)) & EF_TIMER_SLOT_MASK], &t->list_entry);
+}
+
+void ef_timer_add(ef_timer_wheel_t *tw, ef_timer_t *t, long long expire)
+{
+    t->expire = expire;
+    t->pending = 1;
+    ++tw->count;
+    ef_timer_place(tw, t);
+}
+
+void ef_timer_del(ef_timer_wheel_t *tw, ef_timer_t *t)
+{
+    if (t->pending) {
+        ef_list_remove(&t->list_entry);
+        t->pending = 0;
+        --tw->count;
+    }
+}
+
+/*
+ * move the timers of an upper level slot down to where they belong now
+ */
+static void ef_timer_cascade(ef_timer_wheel_t *tw, ef_list_entry_t *slot)
+{
+    ef_list_entry_t list, *ent;
+
+    /*
+     * a timer may go back to the same slot, so detach the slot first
+     */
+    ef_list_init(&list);
+    while ((ent = ef_list_remove_after(slot)) != NULL) {
+        ef_list_insert_before(&list, ent);
+    }
+    while ((ent = ef_list_remove_after(&list)) != NULL) {
+        ef_timer_place(tw, CAST_PARENT_PTR(ent, ef_timer_t, list_entry));
+    }
+}
+
+/*
+ * move the timers in slot expired at now to the expired list
+ */
+static void ef_timer_collect(ef_timer_wheel_t *tw, ef_list_entry_t *slot, long long now)
+{
+    ef_list_entry_t *ent = ef_list_entry_after(slot);
+    while (ent != slot) {
+        ef_timer_t *t = CAST_PARENT_PTR(ent, ef_timer_t, list_entry);
+        ent = ef_list_entry_after(ent);
+        if (t->expire <= now) {
+            ef_list_remove(&t->list_entry);
+            ef_list_insert_before(&tw->expired, &t->list_entry);
+        }
+    }
+}
+
+static void ef_timer_advance(ef_timer_wheel_t *tw, long long now)
+{
+    long long tick = now / EF_TIMER_TICK_NSECS;
+
+    if (tw->count == 0) {
+        if (tick > tw->current) {
+            tw->current = tick;
+        }
+        return;
+    }
+
+    while (tw->current < tick) {
+        ef_timer_collect(tw, &tw->slots[0][tw->current & EF_TIMER_SLOT_MASK], now);
+        ++tw->current;
+
+        /*
+         * a round of the lower level finished, cascade the next slot of the upper level
+         */
+        for (int level = 1; level < EF_TIMER_LEVELS; ++level) {
+            if ((tw->current & ((1LL << (EF_TIMER_SLOT_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            ef_timer_cascade(tw, &tw->slots[level][(tw->current >> (EF_TIMER_SLOT_BITS * level)) & EF_TIMER_SLOT_MASK]);
+        }
+    }
+
+    /*
+     * the current tick is not finished, only the ones before now
+     */
+    ef_timer_collect(tw, &tw->slots[0][tw->current & EF_TIMER_SLOT_MASK], now);
+}
+
+ef_timer_t *ef_timer_wheel_expire(ef_timer_wheel_t *tw, long long now)
+{
+    ef_list_entry_t *ent;
+    ef_timer_t *t;
+
+    if (ef_list_empty(&tw->expired)) {
+        ef_timer_advance(tw, now);
+    }
+
+    ent = ef_list_remove_after(&tw->expired);
+    if (!ent) {
+        return NULL;
+    }
+
+    t = CAST_PARENT_PTR(ent, ef_timer_t, list_entry);
+    t->pending = 0;
+    --tw->count;
+    return t;
+}
+
+long long ef_timer_wheel_next(ef_timer_wheel_t *tw, long long now)
+{
+    long long next, cascade;
+
+    if (tw->count == 0) {
+        return -1;
+    }
+    if (!ef_list_empty(&tw->expired)) {
+        return 0;
+    }
+
+    /*
+     * the level 0 holds the timers of the next 64 ticks, the first
+     * not empty slot has the earliest deadline of the level, but an
+     * upper level timer cascaded at the next round may be earlier
+     */
+    cascade = ((tw->current | EF_TIMER_SLOT_MASK) + 1) * EF_TIMER_TICK_NSECS;
+    for (long long tick = tw->current; tick < tw->current + EF_TIMER_SLOTS; ++tick) {
+        ef_list_entry_t *slot = &tw->slots[0][tick & EF_TIMER_SLOT_MASK];
+        ef_list_entry_t *ent = ef_list_entry_after(slot);
+        if (ent == slot) {
+            continue;
+        }
+        next = CAST_PARENT_PTR(ent, ef_timer_t, list_entry)->expire;
+        for (ent = ef_list_entry_after(ent); ent != slot; ent = ef_list_entry_after(ent)) {
+            long long expire = CAST_PARENT_PTR(ent, ef_timer_t, list_entry)->expire;
+            if (expire < next) {
+                next = expire;
+            }
+        }
+        if (next > cascade) {
+            next = cascade;
+        }
+        return next > now ? next - now : 0;
+    }
+
+    /*
+     * wake up at the next cascade
+     */
+    return cascade > now ? cascade - now : 0;
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef _TIMER_HEADER_
+#define _TIMER_HEADER_
+
+#include <stddef.h>
+#include "util/list.h"
+
+/*
+ * hierarchical timer wheel, 4 levels of 64 slots, 1ms per tick,
+ * the deadlines are kept in nanoseconds of CLOCK_MONOTONIC, so the
+ * earliest one can be waited for precisely, longer than about 4.6 hours
+ * are clamped to the last slot and placed again when cascaded
+ */
+#define EF_TIMER_TICK_NSECS 1000000LL
+#define EF_TIMER_LEVELS     4
+#define EF_TIMER_SLOT_BITS  6
+#define EF_TIMER_SLOTS      (1 << EF_TIMER_SLOT_BITS)
+#define EF_TIMER_SLOT_MASK  (EF_TIMER_SLOTS - 1)
+
+typedef struct _ef_timer ef_timer_t;
+typedef struct _ef_timer_wheel ef_timer_wheel_t;
+
+struct _ef_timer {
+    // 链接到时间轮的槽，或已到期的链表
+    ef_list_entry_t list_entry;
+    // 到期时间，CLOCK_MONOTONIC纳秒
+    long long expire;
+    // 是否在时间轮上
+    int pending;
+};
+
+struct _ef_timer_wheel {
+    // 最后处理过的tick，该tick的槽中可能还有未到期的定时器
+    long long current;
+    // 时间轮上的定时器数，包括已到期还未取走的
+    int count;
+    // 已到期还未取走的定时器
+    ef_list_entry_t expired;
+    ef_list_entry_t slots[EF_TIMER_LEVELS][EF_TIMER_SLOTS];
+};
+
+/*
+ * the current time of CLOCK_MONOTONIC in nanoseconds
+ */
+long long ef_timer_now(void);
+
+void ef_timer_wheel_init(ef_timer_wheel_t *tw, long long now);
+
+/*
+ * add the timer to expire at the absolute time expire, O(1)
+ */
+void ef_timer_add(ef_timer_wheel_t *tw, ef_timer_t *t, long long expire);
+
+/*
+ * remove the timer if it is pending, O(1)
+ */
+void ef_timer_del(ef_timer_wheel_t *tw, ef_timer_t *t);
+
+/*
+ * take one expired timer at now, NULL if no more,
+ * the timer is not pending any more when returned
+ */
+ef_timer_t *ef_timer_wheel_expire(ef_timer_wheel_t *tw, long long now);
+
+/*
+ * nanoseconds from now to the earliest deadline, or to the next
+ * cascade if only long timers left, -1 if no timer at all
+ */
+long long ef_timer_wheel_next(ef_timer_wheel_t *tw, long long now);
+
+#endif
@@ -0,0 +1,393 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "uring.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+typedef struct io_uring_sqe io_uring_sqe_t;
+typedef struct io_uring_cqe io_uring_cqe_t;
+
+typedef struct _ef_uring {
+    ef_poll_t poll;
+    int ring_fd;
+
+    /*
+     * the submission queue, sqe_tail is the local tail,
+     * published to the kernel when submitting
+     */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+    io_uring_sqe_t *sqes;
+
+    /*
+     * the completion queue
+     */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    io_uring_cqe_t *cqes;
+
+    /*
+     * the mapped areas
+     */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /*
+     * the provided buffer ring, kernel picks buffers from it
+     */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned short br_mask;
+    unsigned short br_tail;
+} ef_uring_t;
+
+static inline int ef_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int ef_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int ef_uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/*
+ * publish the local tail, return the number of sqes to submit
+ */
+static inline unsigned int ef_uring_flush(ef_uring_t *ur)
+{
+    __atomic_store_n(ur->sq_tail, ur->sqe_tail, __ATOMIC_RELEASE);
+    return ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int ef_uring_reserve(ef_poll_t *p, int count)
+{
+    ef_uring_t *ur = (ef_uring_t *)p;
+
+    /*
+     * submit now if the submission queue is full
+     */
+    if (ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) + count > ur->sq_entries) {
+        if (ef_uring_enter(ur->ring_fd, ef_uring_flush(ur), 0, 0, NULL, 0) < 0) {
+            return -1;
+        }
+        if (ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) + count > ur->sq_entries) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct io_uring_sqe *ef_uring_get_sqe(ef_poll_t *p)
+{
+    ef_uring_t *ur = (ef_uring_t *)p;
+    io_uring_sqe_t *sqe;
+
+    if (ef_uring_reserve(p, 1) < 0) {
+        return NULL;
+    }
+
+    sqe = &ur->sqes[ur->sqe_tail & ur->sq_mask];
+    memset(sqe, 0, sizeof(io_uring_sqe_t));
+    ++ur->sqe_tail;
+    return sqe;
+}
+
+static int ef_uring_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+{
+    io_uring_sqe_t *sqe;
+
+    /*
+     * oneshot poll, nothing left after fired
+     */
+    if (fired) {
+        return 0;
+    }
+
+    sqe = ef_uring_get_sqe(p);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (unsigned long)ptr;
+    return 0;
+}
+
+static int ef_uring_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+{
+    return 0;
+}
+
+static int ef_uring_unset(ef_poll_t *p, int fd, int events)
+{
+    return 0;
+}
+
+static int ef_uring_wait(ef_poll_t *p, ef_event_t *evts, int count, long long nanosecs)
+{
+    ef_uring_t *ur = (ef_uring_t *)p;
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts;
+    unsigned int head, tail, to_submit;
+    int ret, cnt = 0;
+
+    to_submit = ef_uring_flush(ur);
+    head = *ur->cq_head;
+    tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+    /*
+     * submit all sqes queued in this loop iteration, and wait
+     * for completions only when nothing completed yet
+     */
+    if (head != tail || nanosecs == 0) {
+        if (to_submit > 0) {
+            ret = ef_uring_enter(ur->ring_fd, to_submit, 0, 0, NULL, 0);
+            if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                return ret;
+            }
+        }
+    } else {
+        if (nanosecs > 0) {
+            ts.tv_sec = nanosecs / 1000000000;
+            ts.tv_nsec = nanosecs % 1000000000;
+            arg.ts = (unsigned long)&ts;
+        }
+        arg.sigmask_sz = _NSIG / 8;
+        ret = ef_uring_enter(ur->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret < 0 && errno != ETIME && errno != EBUSY) {
+            return ret;
+        }
+        tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    /*
+     * reap the completions, user_data 0 means nobody cares
+     */
+    while (head != tail && cnt < count) {
+        io_uring_cqe_t *cqe = &ur->cqes[head & ur->cq_mask];
+        if (cqe->user_data) {
+            evts[cnt].events = cqe->res;
+            evts[cnt].flags = cqe->flags;
+            evts[cnt].ptr = (void *)(unsigned long)cqe->user_data;
+            ++cnt;
+        }
+        ++head;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+    return cnt;
+}
+
+int ef_uring_setup_buffers(ef_poll_t *p, int group, char *base, int count, int size)
+{
+    ef_uring_t *ur = (ef_uring_t *)p;
+    struct io_uring_buf_reg reg = {0};
+
+    /*
+     * ring entries must be power of 2, and only one group supported
+     */
+    if (ur->br || count <= 0 || count > 32768 || (count & (count - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ur->br_size = sizeof(struct io_uring_buf) * count;
+    ur->br = (struct io_uring_buf_ring *)mmap(NULL, ur->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (ur->br == MAP_FAILED) {
+        ur->br = NULL;
+        return -1;
+    }
+
+    reg.ring_addr = (unsigned long)ur->br;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (ef_uring_register(ur->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ur->br, ur->br_size);
+        ur->br = NULL;
+        return -1;
+    }
+
+    ur->br_mask = count - 1;
+    ur->br_tail = 0;
+    for (int bid = 0; bid < count; ++bid) {
+        ef_uring_release_buffer(p, base + (size_t)bid * size, size, bid);
+    }
+    return 0;
+}
+
+void ef_uring_release_buffer(ef_poll_t *p, void *addr, int size, int bid)
+{
+    ef_uring_t *ur = (ef_uring_t *)p;
+    struct io_uring_buf *buf = &ur->br->bufs[ur->br_tail & ur->br_mask];
+
+    buf->addr = (unsigned long)addr;
+    buf->len = size;
+    buf->bid = bid;
+
+    /*
+     * make the buffer visible to the kernel
+     */
+    __atomic_store_n(&ur->br->tail, ++ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static int ef_uring_free(ef_poll_t *p)
+{
+    ef_uring_t *ur = (ef_uring_t *)p;
+    if (ur->br) {
+        munmap(ur->br, ur->br_size);
+    }
+    munmap(ur->sqes, ur->sqes_size);
+    if (ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    }
+    munmap(ur->sq_ring, ur->sq_ring_size);
+    close(ur->ring_fd);
+    free(ur);
+    return 0;
+}
+
+ef_poll_t *ef_uring_create(int cap)
+{
+    ef_uring_t *ur;
+    struct io_uring_params params = {0};
+    char *sq, *cq;
+
+    /*
+     * submission queue at least 128
+     */
+    if (cap < 128) {
+        cap = 128;
+    }
+
+    ur = (ef_uring_t *)malloc(sizeof(ef_uring_t));
+    if (!ur) {
+        return NULL;
+    }
+    ur->br = NULL;
+
+    ur->ring_fd = ef_uring_setup(cap, &params);
+    if (ur->ring_fd < 0) {
+        free(ur);
+        return NULL;
+    }
+
+    /*
+     * need the timeout argument of io_uring_enter, since linux 5.11
+     */
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ur->ring_fd);
+        free(ur);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    ur->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ur->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe_t);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_ring_size > ur->sq_ring_size) {
+            ur->sq_ring_size = ur->cq_ring_size;
+        }
+        ur->cq_ring_size = ur->sq_ring_size;
+    }
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ring == MAP_FAILED) {
+        goto failed_sq;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ring = ur->sq_ring;
+    } else {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ring == MAP_FAILED) {
+            goto failed_cq;
+        }
+    }
+
+    ur->sqes_size = params.sq_entries * sizeof(io_uring_sqe_t);
+    ur->sqes = (io_uring_sqe_t *)mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        goto failed_sqes;
+    }
+
+    sq = (char *)ur->sq_ring;
+    ur->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ur->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ur->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ur->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ur->sq_entries = *(unsigned int *)(sq + params.sq_off.ring_entries);
+    ur->sqe_tail = *ur->sq_tail;
+
+    /*
+     * the sqes are always used in order, so fill the index array once
+     */
+    for (unsigned int idx = 0; idx < ur->sq_entries; ++idx) {
+        ur->sq_array[idx] = idx;
+    }
+
+    cq = (char *)ur->cq_ring;
+    ur->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ur->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ur->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ur->cqes = (io_uring_cqe_t *)(cq + params.cq_off.cqes);
+
+    ur->poll.associate = ef_uring_associate;
+    ur->poll.dissociate = ef_uring_dissociate;
+    ur->poll.unset = ef_uring_unset;
+    ur->poll.wait = ef_uring_wait;
+    ur->poll.free = ef_uring_free;
+    ur->poll.migratable = 0;
+    return &ur->poll;
+
+failed_sqes:
+    if (ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    }
+failed_cq:
+    munmap(ur->sq_ring, ur->sq_ring_size);
+failed_sq:
+    close(ur->ring_fd);
+    free(ur);
+    return NULL;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef _URING_HEADER_
+#define _URING_HEADER_
+
+#include "poll.h"
+#include <linux/io_uring.h>
+
+/*
+ * create the io_uring engine, it is also a ef_poll_t, associate is
+ * implemented by oneshot IORING_OP_POLL_ADD, and wait returns the
+ * completions, ef_event_t.events holds cqe->res in that case
+ */
+ef_poll_t *ef_uring_create(int cap);
+
+/*
+ * get a zeroed sqe, the sqes are submitted in batch by the next wait,
+ * or immediately when the submission queue is full
+ */
+struct io_uring_sqe *ef_uring_get_sqe(ef_poll_t *p);
+
+/*
+ * make room for count sqes, so that the linked ones
+ * are not split by a submission in between
+ */
+int ef_uring_reserve(ef_poll_t *p, int count);
+
+/*
+ * register count buffers of size bytes start from base as the provided
+ * buffer ring of group, count must be power of 2, since linux 5.19
+ */
+int ef_uring_setup_buffers(ef_poll_t *p, int group, char *base, int count, int size);
+
+/*
+ * give the buffer bid back to the provided buffer ring
+ */
+void ef_uring_release_buffer(ef_poll_t *p, void *addr, int size, int bid);
+
+#endif